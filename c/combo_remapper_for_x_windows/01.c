@@ -41,6 +41,14 @@
   - (l/r)alt+f -> ctrl+right
   - (l/r)alt-b -> ctrol+left
 
+  - (l/r)ctrl+w -> ctrl+x
+  - (l/r)alt+w -> ctrl+c
+  - (l/r)ctrl+g -> esc
+
+  - (l/r)ctrl+space -> sets the mark (see mark_press): until ctrl+g,
+    ctrl+w or alt+w, the movements above (ctrl+f, ..., alt+v) are
+    sent with shift, so that they select, as in Emacs.
+
   Compile with:
   gcc ./01.c `pkg-config --cflags libevdev` `pkg-config --libs libevdev x11` -pthread -o 01
 
@@ -64,30 +72,57 @@
 #include <unistd.h>
 #include "libevdev/libevdev-uinput.h"
 #include "libevdev/libevdev.h"
+#include "../libevdev/evbatch.h"
+#include "../libevdev/keystate.h"
+
+// Events produced while handling the current input frame. They are
+// written to uinput all at once, terminated by a single SYN_REPORT,
+// by sync_key_evs, when the input frame's own SYN_REPORT comes in.
+#define OUT_QUEUE_SIZE 64
+struct input_event out_queue[OUT_QUEUE_SIZE];
+unsigned int out_queue_size = 0;
 
-static void send_key_ev_and_sync(const struct libevdev_uinput *uidev, unsigned int code, int value)
+static void sync_key_evs(const struct libevdev_uinput *uidev)
 {
-  int err;
+  if (out_queue_size == 0)
+    return;
 
-  err = libevdev_uinput_write_event(uidev, EV_KEY, code, value);
-  if (err != 0) {
-    perror("Error in writing EV_KEY event\n");
-    exit(err);
-  }
-  err = libevdev_uinput_write_event(uidev, EV_SYN, SYN_REPORT, 0);
-  if (err != 0) {
-    perror("Error in writing EV_SYN, SYN_REPORT, 0.\n");
-    exit(err);
+  out_queue[out_queue_size++] = (struct input_event){ .type = EV_SYN, .code = SYN_REPORT, .value = 0 };
+
+  ssize_t size = out_queue_size * sizeof(struct input_event);
+  if (write(libevdev_uinput_get_fd(uidev), out_queue, size) != size) {
+    perror("Error in writing events\n");
+    exit(errno);
   }
 
+  out_queue_size = 0;
+}
+
+static void send_key_ev(const struct libevdev_uinput *uidev, unsigned int code, int value)
+{
+  // Keep room for the SYN_REPORT.
+  if (out_queue_size == OUT_QUEUE_SIZE - 1)
+    sync_key_evs(uidev);
+
+  out_queue[out_queue_size++] = (struct input_event){ .type = EV_KEY, .code = code, .value = value };
+
   printf("Sending %u %u\n", code, value);
 }
 
+// What a map does in mark mode (see mark_press).
+enum mark_action {
+  MARK_KEEPS, // nothing: the mark stays as it is
+  MARK_MOVES, // a movement: shifted while the mark is active
+  MARK_SETS,  // C-space: sets the mark (unsets it if set); sends nothing
+  MARK_ENDS,  // C-g, kill, copy: unsets the mark
+};
+
 typedef struct {
   unsigned int mod_from;
   unsigned int key_from;
   unsigned int mod_to;
   unsigned int key_to;
+  enum mark_action mark;
 } map;
 
 char* mapped_windows[] = {
@@ -104,76 +139,108 @@ map maps[] = {
   // |mod           key| | mod   key  |
 
   // C-f, C-b, C-p, C-n
-  { KEY_RIGHTCTRL, KEY_F, 0, KEY_RIGHT }, { KEY_LEFTCTRL, KEY_F, 0, KEY_RIGHT },
-  { KEY_RIGHTCTRL, KEY_B, 0, KEY_LEFT }, { KEY_LEFTCTRL, KEY_B, 0, KEY_LEFT },
-  { KEY_RIGHTCTRL, KEY_P, 0, KEY_UP }, { KEY_LEFTCTRL, KEY_P, 0, KEY_UP },
-  { KEY_RIGHTCTRL, KEY_N, 0, KEY_DOWN }, { KEY_LEFTCTRL, KEY_N, 0, KEY_DOWN },
+  { KEY_RIGHTCTRL, KEY_F, 0, KEY_RIGHT, MARK_MOVES }, { KEY_LEFTCTRL, KEY_F, 0, KEY_RIGHT, MARK_MOVES },
+  { KEY_RIGHTCTRL, KEY_B, 0, KEY_LEFT, MARK_MOVES }, { KEY_LEFTCTRL, KEY_B, 0, KEY_LEFT, MARK_MOVES },
+  { KEY_RIGHTCTRL, KEY_P, 0, KEY_UP, MARK_MOVES }, { KEY_LEFTCTRL, KEY_P, 0, KEY_UP, MARK_MOVES },
+  { KEY_RIGHTCTRL, KEY_N, 0, KEY_DOWN, MARK_MOVES }, { KEY_LEFTCTRL, KEY_N, 0, KEY_DOWN, MARK_MOVES },
 
   // C-a, C-e
-  { KEY_RIGHTCTRL, KEY_A, 0, KEY_HOME }, { KEY_LEFTCTRL, KEY_A, 0, KEY_HOME },
-  { KEY_RIGHTCTRL, KEY_E, 0, KEY_END }, { KEY_LEFTCTRL, KEY_E, 0, KEY_END },
+  { KEY_RIGHTCTRL, KEY_A, 0, KEY_HOME, MARK_MOVES }, { KEY_LEFTCTRL, KEY_A, 0, KEY_HOME, MARK_MOVES },
+  { KEY_RIGHTCTRL, KEY_E, 0, KEY_END, MARK_MOVES }, { KEY_LEFTCTRL, KEY_E, 0, KEY_END, MARK_MOVES },
 
   // M-f, M-b
-  { KEY_RIGHTALT, KEY_F, KEY_RIGHTCTRL, KEY_RIGHT }, { KEY_LEFTALT, KEY_F, KEY_LEFTCTRL, KEY_RIGHT },
-  { KEY_RIGHTALT, KEY_B, KEY_RIGHTCTRL, KEY_LEFT }, { KEY_LEFTALT, KEY_B, KEY_LEFTCTRL, KEY_LEFT },
+  { KEY_RIGHTALT, KEY_F, KEY_RIGHTCTRL, KEY_RIGHT, MARK_MOVES }, { KEY_LEFTALT, KEY_F, KEY_LEFTCTRL, KEY_RIGHT, MARK_MOVES },
+  { KEY_RIGHTALT, KEY_B, KEY_RIGHTCTRL, KEY_LEFT, MARK_MOVES }, { KEY_LEFTALT, KEY_B, KEY_LEFTCTRL, KEY_LEFT, MARK_MOVES },
 
   // M-v, C-v
-  { KEY_RIGHTALT, KEY_V, 0, KEY_PAGEUP }, { KEY_LEFTALT, KEY_V, 0, KEY_PAGEUP },
-  { KEY_RIGHTCTRL, KEY_V, 0, KEY_PAGEDOWN }, { KEY_LEFTCTRL, KEY_V, 0, KEY_PAGEDOWN },
+  { KEY_RIGHTALT, KEY_V, 0, KEY_PAGEUP, MARK_MOVES }, { KEY_LEFTALT, KEY_V, 0, KEY_PAGEUP, MARK_MOVES },
+  { KEY_RIGHTCTRL, KEY_V, 0, KEY_PAGEDOWN, MARK_MOVES }, { KEY_LEFTCTRL, KEY_V, 0, KEY_PAGEDOWN, MARK_MOVES },
+
+  // C-space
+  { KEY_RIGHTCTRL, KEY_SPACE, 0, 0, MARK_SETS }, { KEY_LEFTCTRL, KEY_SPACE, 0, 0, MARK_SETS },
+
+  // C-w, M-w
+  { KEY_RIGHTCTRL, KEY_W, KEY_RIGHTCTRL, KEY_X, MARK_ENDS }, { KEY_LEFTCTRL, KEY_W, KEY_LEFTCTRL, KEY_X, MARK_ENDS },
+  { KEY_RIGHTALT, KEY_W, KEY_RIGHTCTRL, KEY_C, MARK_ENDS }, { KEY_LEFTALT, KEY_W, KEY_LEFTCTRL, KEY_C, MARK_ENDS },
+
+  // C-g
+  { KEY_RIGHTCTRL, KEY_G, 0, KEY_ESC, MARK_ENDS }, { KEY_LEFTCTRL, KEY_G, 0, KEY_ESC, MARK_ENDS },
   // TODO:
-  // C-w
-  // M-w
   // C-y
   // C-d
   // M-d
   // C-k
-  // C-space
   // C-s
   // C-r
-  // C-g
   // Escaping map [I usually bind it to C-q]
 };
 
+// Mark mode, as in Emacs: C-space sets the mark, and the movements
+// which follow select (they are sent with shift), until C-g, a kill
+// or a copy unsets it.
+//
+// Each mapped window has a mark of its own. It is a two-state machine,
+// stepped (by mark_press) with a lookup, by the mark_action of each
+// map whose output goes down; keys which are not mapped leave it alone.
+enum mark_state {
+  MARK_INACTIVE,
+  MARK_ACTIVE,
+};
+
+enum mark_state mark_states[sizeof(mapped_windows)/sizeof(char*)];
+
+static const enum mark_state next_mark_state[2][4] = {
+  //                KEEPS          MOVES          SETS           ENDS
+  [MARK_INACTIVE] = { MARK_INACTIVE, MARK_INACTIVE, MARK_ACTIVE,   MARK_INACTIVE },
+  [MARK_ACTIVE]   = { MARK_ACTIVE,   MARK_ACTIVE,   MARK_INACTIVE, MARK_INACTIVE },
+};
+
+// Keys (key_from) whose output is being sent with shift, so that shift
+// is released along with it, even if the mark has changed since.
+unsigned char shifted[KEY_CNT];
+
 // Take index of a map in maps and send mod_to + key_to of that map
 static void send_output(const struct libevdev_uinput *uidev, int i) {
   if (maps[i].mod_to)
-    send_key_ev_and_sync(uidev, maps[i].mod_to, 1);
+    send_key_ev(uidev, maps[i].mod_to, 1);
 }
 
-typedef struct {
-  unsigned int code;
-  int value;
-} keyboard_key_state;
-
-keyboard_key_state keyboard[] = {
-  { KEY_LEFTCTRL, 0 }, // 29
-  { KEY_RIGHTCTRL, 0 }, // 97
-  { KEY_LEFTALT, 0 }, // 56
-  { KEY_RIGHTALT, 0 },
-  { KEY_P, 0 }, // 25
-  { KEY_F, 0 }, // 33
-  { KEY_B, 0 }, // 48
-  { KEY_N, 0 }, // 49
-  { KEY_V, 0 },
-  { KEY_A, 0 },
-  { KEY_E, 0 },
-};
-// KEY_RIGHT     106
-// KEY_LEFT      105
+// Step the mark of window w for the output of m going down, and press
+// shift if m is a movement made while the mark is active. Return
+// whether m has an output to send (C-space has none).
+static int mark_press(const struct libevdev_uinput *uidev, map *m, int w) {
+  enum mark_state state = mark_states[w];
 
-void set_keyboard_state(struct input_event ev) {
-  for (int i = 0; i < sizeof(keyboard)/sizeof(keyboard_key_state); i++) {
-    if (keyboard[i].code == ev.code)
-      keyboard[i].value = ev.value;
+  if (m->mark == MARK_MOVES && state == MARK_ACTIVE && !shifted[m->key_from]) {
+    send_key_ev(uidev, KEY_LEFTSHIFT, 1);
+    shifted[m->key_from] = 1;
   }
+
+  mark_states[w] = next_mark_state[state][m->mark];
+  if (mark_states[w] != state)
+    printf("Mark %s\n", mark_states[w] == MARK_ACTIVE ? "set" : "unset");
+
+  return m->mark != MARK_SETS;
 }
 
-int kb_state_of(unsigned int k_code) {
-  for (int i = 0; i < sizeof(keyboard)/sizeof(keyboard_key_state); i++) {
-    if (keyboard[i].code == k_code)
-      return keyboard[i].value;
+// Release shift, if mark_press pressed it for the output of m.
+static void mark_release(const struct libevdev_uinput *uidev, map *m) {
+  if (shifted[m->key_from]) {
+    send_key_ev(uidev, KEY_LEFTSHIFT, 0);
+    shifted[m->key_from] = 0;
   }
-  return -1;
+}
+
+// State of the keyboard: the value (1, 2 or 0) of every key (see
+// keystate.h).
+keystate keyboard;
+
+void set_keyboard_state(struct input_event ev) {
+  keystate_set(&keyboard, ev.code, ev.value);
+}
+
+int kb_state_of(unsigned int k_code) {
+  return keystate_value(&keyboard, k_code);
 }
 
 struct libevdev_uinput *uidev;
@@ -227,7 +294,7 @@ void handle_key(struct input_event ev) {
 
   if (currently_focused_window_copy == -1) {
     printf("we should not use combo maps\n");
-    send_key_ev_and_sync(uidev, ev.code, ev.value);
+    send_key_ev(uidev, ev.code, ev.value);
     return;
   }
 
@@ -244,39 +311,49 @@ void handle_key(struct input_event ev) {
     if (ev.value == 1) {
       printf("we are in ev.value == 1 block\n");
       if (kb_state_of(map_of_key->mod_from) == 1) {
-	send_key_ev_and_sync(uidev, map_of_key->mod_from, 0);
-	if (map_of_key->mod_to)
-	  send_key_ev_and_sync(uidev, map_of_key->mod_to, 1);
-        send_key_ev_and_sync(uidev, map_of_key->key_to, 1);
+	send_key_ev(uidev, map_of_key->mod_from, 0);
+	if (mark_press(uidev, map_of_key, currently_focused_window_copy)) {
+	  if (map_of_key->mod_to)
+	    send_key_ev(uidev, map_of_key->mod_to, 1);
+	  send_key_ev(uidev, map_of_key->key_to, 1);
+	}
       } else if (kb_state_of(map_of_key->mod_from) == 2) {
-        send_key_ev_and_sync(uidev, map_of_key->mod_from, 0);
-	if (map_of_key->mod_to)
-	  send_key_ev_and_sync(uidev, map_of_key->mod_to, 1);
-        send_key_ev_and_sync(uidev, map_of_key->key_to, 1);
+        send_key_ev(uidev, map_of_key->mod_from, 0);
+	if (mark_press(uidev, map_of_key, currently_focused_window_copy)) {
+	  if (map_of_key->mod_to)
+	    send_key_ev(uidev, map_of_key->mod_to, 1);
+	  send_key_ev(uidev, map_of_key->key_to, 1);
+	}
       } else if (kb_state_of(map_of_key->mod_from) == 0) {
-        send_key_ev_and_sync(uidev, ev.code, ev.value);
+        send_key_ev(uidev, ev.code, ev.value);
       }
     } else if (ev.value == 2) {
       if (kb_state_of(map_of_key->mod_from) == 1) {
-        send_key_ev_and_sync(uidev, map_of_key->key_to, 2);
+	if (map_of_key->key_to)
+	  send_key_ev(uidev, map_of_key->key_to, 2);
       } else if (kb_state_of(map_of_key->mod_from) == 2) {
-        send_key_ev_and_sync(uidev, map_of_key->key_to, 2);
+	if (map_of_key->key_to)
+	  send_key_ev(uidev, map_of_key->key_to, 2);
       } else if (kb_state_of(map_of_key->mod_from) == 0) {
-        send_key_ev_and_sync(uidev, ev.code, ev.value);
+        send_key_ev(uidev, ev.code, ev.value);
       }
     } else if (ev.value == 0) {
       if (kb_state_of(map_of_key->mod_from) == 1) {
-        send_key_ev_and_sync(uidev, map_of_key->key_to, 0);
+	if (map_of_key->key_to)
+	  send_key_ev(uidev, map_of_key->key_to, 0);
 	if (map_of_key->mod_to)
-	  send_key_ev_and_sync(uidev, map_of_key->mod_to, 0);
-        send_key_ev_and_sync(uidev, map_of_key->mod_from, 1);
+	  send_key_ev(uidev, map_of_key->mod_to, 0);
+	mark_release(uidev, map_of_key);
+        send_key_ev(uidev, map_of_key->mod_from, 1);
       } else if (kb_state_of(map_of_key->mod_from) == 2) {
-        send_key_ev_and_sync(uidev, map_of_key->key_to, 0);
+	if (map_of_key->key_to)
+	  send_key_ev(uidev, map_of_key->key_to, 0);
 	if (map_of_key->mod_to)
-	  send_key_ev_and_sync(uidev, map_of_key->mod_to, 0);
-        send_key_ev_and_sync(uidev, map_of_key->mod_from, 1);
+	  send_key_ev(uidev, map_of_key->mod_to, 0);
+	mark_release(uidev, map_of_key);
+        send_key_ev(uidev, map_of_key->mod_from, 1);
       } else if (kb_state_of(map_of_key->mod_from) == 0) {
-        send_key_ev_and_sync(uidev, ev.code, ev.value);
+        send_key_ev(uidev, ev.code, ev.value);
       }
     }
   } else if (map_of_mod) {
@@ -285,20 +362,24 @@ void handle_key(struct input_event ev) {
       printf("we are in ev.value == 1  block\n");
       if (kb_state_of(map_of_mod->key_from) == 1)  {
 	printf("we are in kb_state_of(map_of_mod->key_from) == 1\n");
-        send_key_ev_and_sync(uidev, map_of_mod->mod_from, 0);
-        send_key_ev_and_sync(uidev, map_of_mod->key_from, 0);
-	if (map_of_mod->mod_to)
-	  send_key_ev_and_sync(uidev, map_of_mod->mod_to, 1);
-        send_key_ev_and_sync(uidev, map_of_mod->key_to, 1);
+        send_key_ev(uidev, map_of_mod->mod_from, 0);
+        send_key_ev(uidev, map_of_mod->key_from, 0);
+	if (mark_press(uidev, map_of_mod, currently_focused_window_copy)) {
+	  if (map_of_mod->mod_to)
+	    send_key_ev(uidev, map_of_mod->mod_to, 1);
+	  send_key_ev(uidev, map_of_mod->key_to, 1);
+	}
       } else if (kb_state_of(map_of_mod->key_from) == 2) {
         printf("we are in kb_state_of(map_of_mod->key_from) == 2\n");
-	send_key_ev_and_sync(uidev, map_of_mod->mod_from, 0);
-        send_key_ev_and_sync(uidev, map_of_mod->key_from, 0);
-	if (map_of_mod->mod_to)
-	  send_key_ev_and_sync(uidev, map_of_mod->mod_to, 1);
-        send_key_ev_and_sync(uidev, map_of_mod->key_to, 1);
+	send_key_ev(uidev, map_of_mod->mod_from, 0);
+        send_key_ev(uidev, map_of_mod->key_from, 0);
+	if (mark_press(uidev, map_of_mod, currently_focused_window_copy)) {
+	  if (map_of_mod->mod_to)
+	    send_key_ev(uidev, map_of_mod->mod_to, 1);
+	  send_key_ev(uidev, map_of_mod->key_to, 1);
+	}
       } else if (kb_state_of(map_of_mod->key_from) == 0) {
-        send_key_ev_and_sync(uidev, ev.code, ev.value);
+        send_key_ev(uidev, ev.code, ev.value);
       }
     } else if (ev.value == 2) {
       printf("we are in ev.value == 2  block\n");
@@ -307,28 +388,32 @@ void handle_key(struct input_event ev) {
       } else if (kb_state_of(map_of_mod->key_from) == 2) {
         printf("What should we be doing here?");
       } else if (kb_state_of(map_of_mod->key_from) == 0) {
-        send_key_ev_and_sync(uidev, ev.code, ev.value);
+        send_key_ev(uidev, ev.code, ev.value);
       }
     } else if (ev.value == 0) {
       printf("we are in ev.value == 0  block\n");
       if (kb_state_of(map_of_mod->key_from) == 1)  {
-        send_key_ev_and_sync(uidev, ev.code, ev.value);
+        send_key_ev(uidev, ev.code, ev.value);
 	if (map_of_mod->mod_to)
-	  send_key_ev_and_sync(uidev, map_of_mod->mod_to, 0);
-        send_key_ev_and_sync(uidev, map_of_mod->key_to, 0);
-        send_key_ev_and_sync(uidev, map_of_mod->key_from, 1);
+	  send_key_ev(uidev, map_of_mod->mod_to, 0);
+	if (map_of_mod->key_to)
+	  send_key_ev(uidev, map_of_mod->key_to, 0);
+	mark_release(uidev, map_of_mod);
+        send_key_ev(uidev, map_of_mod->key_from, 1);
       } else if (kb_state_of(map_of_mod->key_from) == 2) {
-        send_key_ev_and_sync(uidev, ev.code, ev.value);
+        send_key_ev(uidev, ev.code, ev.value);
 	if (map_of_mod->mod_to)
-	  send_key_ev_and_sync(uidev, map_of_mod->mod_to, 0);
-        send_key_ev_and_sync(uidev, map_of_mod->key_to, 0);
-        send_key_ev_and_sync(uidev, map_of_mod->key_from, 1);
+	  send_key_ev(uidev, map_of_mod->mod_to, 0);
+	if (map_of_mod->key_to)
+	  send_key_ev(uidev, map_of_mod->key_to, 0);
+	mark_release(uidev, map_of_mod);
+        send_key_ev(uidev, map_of_mod->key_from, 1);
       } else if (kb_state_of(map_of_mod->key_from) == 0) {
-        send_key_ev_and_sync(uidev, ev.code, ev.value);
+        send_key_ev(uidev, ev.code, ev.value);
       }
     }
   } else {
-    send_key_ev_and_sync(uidev, ev.code, ev.value);
+    send_key_ev(uidev, ev.code, ev.value);
   }
 }
 
@@ -400,6 +485,14 @@ void *track_window() {
   }
 }
 
+// Feed an input event to the engine.
+static void handle_input_event(struct input_event ev) {
+  if (ev.type == EV_KEY)
+    handle_key(ev);
+  else if (ev.type == EV_SYN && ev.code == SYN_REPORT)
+    sync_key_evs(uidev);
+}
+
 int main(int argc, char **argv)
 {
   pthread_t xthread;
@@ -450,22 +543,24 @@ int main(int argc, char **argv)
     return -errno;
   }
 
+  // A read takes all the events there are (see evbatch.h).
+  evbatch batch = { .fd = fd };
   do {
-    struct input_event ev;
-    rc = libevdev_next_event(dev, LIBEVDEV_READ_FLAG_NORMAL|LIBEVDEV_READ_FLAG_BLOCKING, &ev);
-    if (rc == LIBEVDEV_READ_STATUS_SYNC) {
-      printf("Dropped\n");
-      while (rc == LIBEVDEV_READ_STATUS_SYNC) {
-        rc = libevdev_next_event(dev, LIBEVDEV_READ_FLAG_SYNC, &ev);
+    const struct input_event *frame;
+    size_t n;
+
+    rc = evbatch_read(&batch);
+    while ((n = evbatch_next_frame(&batch, &frame)) > 0) {
+      if (evbatch_is_drop(frame)) {
+        printf("Dropped\n");
+        continue;
       }
-      printf("Re-synced\n");
-    } else if (rc == LIBEVDEV_READ_STATUS_SUCCESS) {
-      if (ev.type == EV_KEY)
-        handle_key(ev);
+      for (size_t i = 0; i < n; i++)
+        handle_input_event(frame[i]);
     }
-  } while (rc == LIBEVDEV_READ_STATUS_SYNC || rc == LIBEVDEV_READ_STATUS_SUCCESS || rc == -EAGAIN);
+  } while (rc >= 0 || rc == -EAGAIN || rc == -EINTR);
 
-  if (rc != LIBEVDEV_READ_STATUS_SUCCESS && rc != -EAGAIN)
+  if (rc != -ENODEV)
     fprintf(stderr, "Failed to handle events: %s\n", strerror(-rc));
 
   rc = 0;
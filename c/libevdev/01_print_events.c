@@ -10,8 +10,12 @@
 // Usage example:
 //   $ print_events /dev/input/event6
 //
+// Or, with -r, records them to a file (see evtrace.h) instead, until
+// interrupted. Add -d for delta timestamps (a smaller file):
+//   $ print_events -r keys.evtrace -d /dev/input/event6
+//
 // Compile with:
-//   gcc `pkg-config --cflags libevdev` ./01_print_events.c `pkg-config --libs libevdev` -o foobar
+//   gcc `pkg-config --cflags libevdev` ./01_print_events.c `pkg-config --libs libevdev` -pthread -o foobar
 
 
 //#include "config.h"
@@ -26,6 +30,7 @@
 #include <sys/types.h>
 
 #include "libevdev/libevdev.h"
+#include "evtrace.h"
 
 static void
 print_abs_bits(struct libevdev *dev, int axis)
@@ -129,6 +134,52 @@ print_sync_event(struct input_event *ev)
     return 0;
 }
 
+// With -r, events are recorded (see evtrace.h) rather than printed.
+static evtrace_writer trace;
+static int recording = 0;
+
+// SIGINT/SIGTERM only interrupt the (blocking) read, so that the
+// recording gets finished.
+static void
+stop_recording(int sig)
+{
+}
+
+static int
+start_recording(const char *path, uint32_t flags)
+{
+    int err = evtrace_writer_open(&trace, path, flags);
+    if (err < 0) {
+        fprintf(stderr, "Failed to record to %s (%s)\n", path, strerror(-err));
+        return err;
+    }
+    recording = 1;
+
+    struct sigaction sa = { .sa_handler = stop_recording }; // no SA_RESTART
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    return 0;
+}
+
+static void
+finish_recording(void)
+{
+    if (!recording)
+        return;
+
+    int err = evtrace_writer_close(&trace);
+    if (err < 0)
+        fprintf(stderr, "Failed to write recording (%s)\n", strerror(-err));
+    else
+        fprintf(stderr, "Recorded %llu frames, %llu events\n",
+                (unsigned long long)trace.number_of_frames,
+                (unsigned long long)trace.number_of_events);
+    if (trace.dropped_frames)
+        fprintf(stderr, "Dropped %llu frames, %llu events (the disk could not keep up)\n",
+                (unsigned long long)trace.dropped_frames,
+                (unsigned long long)trace.dropped_events);
+}
+
 int
 main(int argc, char **argv)
 {
@@ -136,11 +187,27 @@ main(int argc, char **argv)
     const char *file;
     int fd;
     int rc = 1;
+    const char *trace_file = NULL;
+    uint32_t trace_flags = 0;
+    int opt;
 
-    if (argc < 2)
+    while ((opt = getopt(argc, argv, "r:d")) != -1) {
+        switch (opt) {
+        case 'r':
+            trace_file = optarg;
+            break;
+        case 'd':
+            trace_flags |= EVTRACE_DELTA_TIME;
+            break;
+        default:
+            goto out;
+        }
+    }
+
+    if (optind >= argc)
         goto out;
 
-    file = argv[1];
+    file = argv[optind];
     fd = open(file, O_RDONLY);
     if (fd < 0) {
         perror("Failed to open device");
@@ -164,23 +231,36 @@ main(int argc, char **argv)
     print_bits(dev);
     print_props(dev);
 
+    if (trace_file && start_recording(trace_file, trace_flags) < 0)
+        goto out;
+
     do {
         struct input_event ev;
         rc = libevdev_next_event(dev, LIBEVDEV_READ_FLAG_NORMAL|LIBEVDEV_READ_FLAG_BLOCKING, &ev);
-        if (rc == LIBEVDEV_READ_STATUS_SYNC) {
+        if (rc == LIBEVDEV_READ_STATUS_SYNC && recording) {
+            // The SYN_DROPPED, then the events re-syncing the state.
+            while (rc == LIBEVDEV_READ_STATUS_SYNC) {
+                evtrace_record(&trace, &ev);
+                rc = libevdev_next_event(dev, LIBEVDEV_READ_FLAG_SYNC, &ev);
+            }
+        } else if (rc == LIBEVDEV_READ_STATUS_SYNC) {
             printf("::::::::::::::::::::: dropped ::::::::::::::::::::::\n");
             while (rc == LIBEVDEV_READ_STATUS_SYNC) {
                 print_sync_event(&ev);
                 rc = libevdev_next_event(dev, LIBEVDEV_READ_FLAG_SYNC, &ev);
             }
             printf("::::::::::::::::::::: re-synced ::::::::::::::::::::::\n");
-        } else if (rc == LIBEVDEV_READ_STATUS_SUCCESS)
+        } else if (rc == LIBEVDEV_READ_STATUS_SUCCESS && recording)
+            evtrace_record(&trace, &ev);
+        else if (rc == LIBEVDEV_READ_STATUS_SUCCESS)
             print_event(&ev);
     } while (rc == LIBEVDEV_READ_STATUS_SYNC || rc == LIBEVDEV_READ_STATUS_SUCCESS || rc == -EAGAIN);
 
-    if (rc != LIBEVDEV_READ_STATUS_SUCCESS && rc != -EAGAIN)
+    if (rc != LIBEVDEV_READ_STATUS_SUCCESS && rc != -EAGAIN && !(recording && rc == -EINTR))
         fprintf(stderr, "Failed to handle events: %s\n", strerror(-rc));
 
+    finish_recording();
+
     rc = 0;
 out:
     libevdev_free(dev);
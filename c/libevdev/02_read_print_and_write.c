@@ -2,6 +2,9 @@
 // keyboard), thereby intercepting its events, and let every event
 // pass through as nothing happened, by sending it as it is using the
 // libevdev_uinput_write_event function.
+//
+// With -r file, the events are recorded to file (see evtrace.h)
+// rather than printed, until interrupted; -d makes timestamps deltas.
 
 // The template I've used is from
 // https://gitlab.freedesktop.org/libevdev/libevdev/blob/master/tools/libevdev-events.c
@@ -23,6 +26,7 @@
 #include <unistd.h>
 #include "libevdev/libevdev-uinput.h"
 #include "libevdev/libevdev.h"
+#include "evtrace.h"
 
 static void
 print_abs_bits(struct libevdev *dev, int axis)
@@ -126,6 +130,52 @@ print_sync_event(struct input_event *ev)
     return 0;
 }
 
+// With -r, events are recorded (see evtrace.h) rather than printed.
+static evtrace_writer trace;
+static int recording = 0;
+
+// SIGINT/SIGTERM only interrupt the (blocking) read, so that the
+// recording gets finished.
+static void
+stop_recording(int sig)
+{
+}
+
+static int
+start_recording(const char *path, uint32_t flags)
+{
+    int err = evtrace_writer_open(&trace, path, flags);
+    if (err < 0) {
+        fprintf(stderr, "Failed to record to %s (%s)\n", path, strerror(-err));
+        return err;
+    }
+    recording = 1;
+
+    struct sigaction sa = { .sa_handler = stop_recording }; // no SA_RESTART
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    return 0;
+}
+
+static void
+finish_recording(void)
+{
+    if (!recording)
+        return;
+
+    int err = evtrace_writer_close(&trace);
+    if (err < 0)
+        fprintf(stderr, "Failed to write recording (%s)\n", strerror(-err));
+    else
+        fprintf(stderr, "Recorded %llu frames, %llu events\n",
+                (unsigned long long)trace.number_of_frames,
+                (unsigned long long)trace.number_of_events);
+    if (trace.dropped_frames)
+        fprintf(stderr, "Dropped %llu frames, %llu events (the disk could not keep up)\n",
+                (unsigned long long)trace.dropped_frames,
+                (unsigned long long)trace.dropped_events);
+}
+
 static void send_key_ev_and_sync(const struct libevdev_uinput *uidev, unsigned int code, int value)
 {
     int err;
@@ -151,8 +201,24 @@ main(int argc, char **argv)
     const char *file;
     int fd;
     int rc = 1;
+    const char *trace_file = NULL;
+    uint32_t trace_flags = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:d")) != -1) {
+        switch (opt) {
+        case 'r':
+            trace_file = optarg;
+            break;
+        case 'd':
+            trace_flags |= EVTRACE_DELTA_TIME;
+            break;
+        default:
+            goto out;
+        }
+    }
 
-    if (argc < 2)
+    if (optind >= argc)
         goto out;
 
    usleep(200000); // let (KEY_ENTER), value 0 go through before
@@ -160,7 +226,7 @@ main(int argc, char **argv)
 
  
     
-    file = argv[1];
+    file = argv[optind];
     fd = open(file, O_RDONLY);
     if (fd < 0) {
         perror("Failed to open device");
@@ -204,16 +270,29 @@ main(int argc, char **argv)
     print_bits(dev);
     print_props(dev);
 
+    if (trace_file && start_recording(trace_file, trace_flags) < 0)
+        goto out;
+
     do {
         struct input_event ev;
         rc = libevdev_next_event(dev, LIBEVDEV_READ_FLAG_NORMAL|LIBEVDEV_READ_FLAG_BLOCKING, &ev);
-        if (rc == LIBEVDEV_READ_STATUS_SYNC) {
+        if (rc == LIBEVDEV_READ_STATUS_SYNC && recording) {
+            // The SYN_DROPPED, then the events re-syncing the state.
+            while (rc == LIBEVDEV_READ_STATUS_SYNC) {
+                evtrace_record(&trace, &ev);
+                rc = libevdev_next_event(dev, LIBEVDEV_READ_FLAG_SYNC, &ev);
+            }
+        } else if (rc == LIBEVDEV_READ_STATUS_SYNC) {
             printf("::::::::::::::::::::: dropped ::::::::::::::::::::::\n");
             while (rc == LIBEVDEV_READ_STATUS_SYNC) {
                 print_sync_event(&ev);
                 rc = libevdev_next_event(dev, LIBEVDEV_READ_FLAG_SYNC, &ev);
             }
             printf("::::::::::::::::::::: re-synced ::::::::::::::::::::::\n");
+        } else if (rc == LIBEVDEV_READ_STATUS_SUCCESS && recording) {
+            evtrace_record(&trace, &ev);
+            if (ev.type == EV_KEY)
+                send_key_ev_and_sync(uidev, ev.code, ev.value);
         } else if (rc == LIBEVDEV_READ_STATUS_SUCCESS) {
             if (ev.type == EV_KEY) {
                 printf("#### ev.type == EV_KEY\n ####");
@@ -225,9 +304,11 @@ main(int argc, char **argv)
         }
     } while (rc == LIBEVDEV_READ_STATUS_SYNC || rc == LIBEVDEV_READ_STATUS_SUCCESS || rc == -EAGAIN);
 
-    if (rc != LIBEVDEV_READ_STATUS_SUCCESS && rc != -EAGAIN)
+    if (rc != LIBEVDEV_READ_STATUS_SUCCESS && rc != -EAGAIN && !(recording && rc == -EINTR))
         fprintf(stderr, "Failed to handle events: %s\n", strerror(-rc));
 
+    finish_recording();
+
     rc = 0;
 out:
     libevdev_free(dev);
@@ -65,6 +65,7 @@
 #include <unistd.h>
 #include "libevdev/libevdev-uinput.h"
 #include "libevdev/libevdev.h"
+#include "evbatch.h"
 
 static void
 print_abs_bits(struct libevdev *dev, int axis)
@@ -168,21 +169,37 @@ print_sync_event(struct input_event *ev)
     return 0;
 }
 
-static void send_key_ev_and_sync(const struct libevdev_uinput *uidev, unsigned int code, int value)
+// Events produced while handling the current input frame. They are
+// written to uinput all at once, terminated by a single SYN_REPORT,
+// by sync_key_evs, when the input frame's own SYN_REPORT comes in.
+#define OUT_QUEUE_SIZE 64
+struct input_event out_queue[OUT_QUEUE_SIZE];
+unsigned int out_queue_size = 0;
+
+static void sync_key_evs(const struct libevdev_uinput *uidev)
 {
-    int err;
+    if (out_queue_size == 0)
+        return;
 
-    err = libevdev_uinput_write_event(uidev, EV_KEY, code, value);
-    if (err != 0) {
-        perror("Error in writing EV_KEY event\n");
-        exit(err);
-    }
-    err = libevdev_uinput_write_event(uidev, EV_SYN, SYN_REPORT, 0);
-    if (err != 0) {
-        perror("Error in writing EV_SYN, SYN_REPORT, 0.\n");
-        exit(err);
+    out_queue[out_queue_size++] = (struct input_event){ .type = EV_SYN, .code = SYN_REPORT, .value = 0 };
+
+    ssize_t size = out_queue_size * sizeof(struct input_event);
+    if (write(libevdev_uinput_get_fd(uidev), out_queue, size) != size) {
+        perror("Error in writing events\n");
+        exit(errno);
     }
 
+    out_queue_size = 0;
+}
+
+static void send_key_ev(const struct libevdev_uinput *uidev, unsigned int code, int value)
+{
+    // Keep room for the SYN_REPORT.
+    if (out_queue_size == OUT_QUEUE_SIZE - 1)
+        sync_key_evs(uidev);
+
+    out_queue[out_queue_size++] = (struct input_event){ .type = EV_KEY, .code = code, .value = value };
+
     printf("Sending %u %u\n", code, value);
 }
 
@@ -202,37 +219,37 @@ void handle_key(struct input_event ev) {
             f_1 = 1; f_2 = 0; f_0 = 0; // set keyboard state
 
             if (ctrl_1) {
-                send_key_ev_and_sync(uidev, KEY_RIGHTCTRL, 0); // fake ctrl0
-                send_key_ev_and_sync(uidev, KEY_RIGHT, 1);
+                send_key_ev(uidev, KEY_RIGHTCTRL, 0); // fake ctrl0
+                send_key_ev(uidev, KEY_RIGHT, 1);
             } else if (ctrl_2) {
-                send_key_ev_and_sync(uidev, KEY_RIGHTCTRL, 0); // fake ctrl0
-                send_key_ev_and_sync(uidev, KEY_RIGHT, 1);
+                send_key_ev(uidev, KEY_RIGHTCTRL, 0); // fake ctrl0
+                send_key_ev(uidev, KEY_RIGHT, 1);
             } else if (ctrl_0) {
-                send_key_ev_and_sync(uidev, ev.code, ev.value); // send original f1
+                send_key_ev(uidev, ev.code, ev.value); // send original f1
             }
 
         } else if (ev.value == 2) { // receiving f2
             f_2 = 1; f_1 = 0; f_0 = 0; // set keyboard state
 
             if (ctrl_1) {
-                send_key_ev_and_sync(uidev, KEY_RIGHT, 2); // send right2
+                send_key_ev(uidev, KEY_RIGHT, 2); // send right2
             } else if (ctrl_2) {
-                send_key_ev_and_sync(uidev, KEY_RIGHT, 2); // send right2
+                send_key_ev(uidev, KEY_RIGHT, 2); // send right2
             } else if (ctrl_0) {
-                send_key_ev_and_sync(uidev, ev.code, ev.value); // send original f2
+                send_key_ev(uidev, ev.code, ev.value); // send original f2
             }
 
         } else if (ev.value == 0) { // receiving f0
             f_0 = 1; f_1 = 0; f_2 = 0; // set keyboard state
 
             if (ctrl_1) {
-                send_key_ev_and_sync(uidev, KEY_RIGHT, 0); // send right0
-                send_key_ev_and_sync(uidev, KEY_RIGHTCTRL, 1); // restore ctrl (we might wanna save the actual old value) // when we will have more maps...
+                send_key_ev(uidev, KEY_RIGHT, 0); // send right0
+                send_key_ev(uidev, KEY_RIGHTCTRL, 1); // restore ctrl (we might wanna save the actual old value) // when we will have more maps...
             } else if (ctrl_2) {
-                send_key_ev_and_sync(uidev, KEY_RIGHT, 0); // send right0
-                send_key_ev_and_sync(uidev, KEY_RIGHTCTRL, 1); // restore ctrl (we might wanna save the actual old value) // when we will have more maps...
+                send_key_ev(uidev, KEY_RIGHT, 0); // send right0
+                send_key_ev(uidev, KEY_RIGHTCTRL, 1); // restore ctrl (we might wanna save the actual old value) // when we will have more maps...
             } else if (ctrl_0) {
-                send_key_ev_and_sync(uidev, ev.code, ev.value); // send original f0
+                send_key_ev(uidev, ev.code, ev.value); // send original f0
             }
 
         }
@@ -243,17 +260,17 @@ void handle_key(struct input_event ev) {
 
                 if (f_1) {
                     printf("receiving ctrl1 (in context f1)\n");
-                    send_key_ev_and_sync(uidev, KEY_RIGHTCTRL, 0); // fake ctrl0
-                    send_key_ev_and_sync(uidev, KEY_F, 0);
-                    send_key_ev_and_sync(uidev, KEY_RIGHT, 1); // send right1
+                    send_key_ev(uidev, KEY_RIGHTCTRL, 0); // fake ctrl0
+                    send_key_ev(uidev, KEY_F, 0);
+                    send_key_ev(uidev, KEY_RIGHT, 1); // send right1
                 } else if (f_2) {
                     printf("receiving ctrl1 (in context f2)\n");
-                    send_key_ev_and_sync(uidev, KEY_RIGHTCTRL, 0); // fake ctrl0
-                    send_key_ev_and_sync(uidev, KEY_F, 0);
-                    send_key_ev_and_sync(uidev, KEY_RIGHT, 1); // send right1
+                    send_key_ev(uidev, KEY_RIGHTCTRL, 0); // fake ctrl0
+                    send_key_ev(uidev, KEY_F, 0);
+                    send_key_ev(uidev, KEY_RIGHT, 1); // send right1
                 } else if (f_0) {
                     printf("receiving ctrl1 (in context f0)\n");
-                    send_key_ev_and_sync(uidev, ev.code, ev.value); // send original ctrl1
+                    send_key_ev(uidev, ev.code, ev.value); // send original ctrl1
                 }
 
             } else if (ev.value == 2) { // receiving ctrl2
@@ -261,16 +278,16 @@ void handle_key(struct input_event ev) {
 
                 if (f_1) {
                     if (!ctrl_0) { // might be impossible...
-                        //send_key_ev_and_sync(uidev, KEY_RIGHTCTRL, 0); // fake ctrl0
+                        //send_key_ev(uidev, KEY_RIGHTCTRL, 0); // fake ctrl0
                         printf("the alleged impossible is happening");
                     }
                 } else if (f_2) {
                     if (!ctrl_0) { // might be impossible...
-                        //send_key_ev_and_sync(uidev, KEY_RIGHTCTRL, 0); // fake ctrl0
+                        //send_key_ev(uidev, KEY_RIGHTCTRL, 0); // fake ctrl0
                         printf("the alleged impossible is happening");
                     }
                 } else if (f_0) {
-                    send_key_ev_and_sync(uidev, ev.code, ev.value); // send original ctrl2
+                    send_key_ev(uidev, ev.code, ev.value); // send original ctrl2
                 }
 
             } else if (ev.value == 0) { // receiving ctrl0
@@ -278,28 +295,38 @@ void handle_key(struct input_event ev) {
 
                 if (f_1) {
                     printf("receiving ctrl0 (in context f_1)\n");
-                    send_key_ev_and_sync(uidev, ev.code, ev.value); // send original ctrl0
+                    send_key_ev(uidev, ev.code, ev.value); // send original ctrl0
                     // we know that f was acting as right
-                    send_key_ev_and_sync(uidev, KEY_RIGHT, 0);
-                    send_key_ev_and_sync(uidev, KEY_F, 1); // make f acting as a f again
+                    send_key_ev(uidev, KEY_RIGHT, 0);
+                    send_key_ev(uidev, KEY_F, 1); // make f acting as a f again
                 } else if (f_2) {
                     printf("receiving ctrl0 (in context f_2)\n");
-                    send_key_ev_and_sync(uidev, ev.code, ev.value); // send original ctrl0
+                    send_key_ev(uidev, ev.code, ev.value); // send original ctrl0
                     // we know that f was acting as right
-                    send_key_ev_and_sync(uidev, KEY_RIGHT, 0);
-                    send_key_ev_and_sync(uidev, KEY_F, 1); // make f acting as a f again
+                    send_key_ev(uidev, KEY_RIGHT, 0);
+                    send_key_ev(uidev, KEY_F, 1); // make f acting as a f again
                 } else if (f_0) {
                     printf("receiving ctrl0 (in context f_0)\n");
-                    send_key_ev_and_sync(uidev, ev.code, ev.value); // send original ctrl0
+                    send_key_ev(uidev, ev.code, ev.value); // send original ctrl0
                 }
 
             }
         } else { // receving a key other than f or ctrl
-            send_key_ev_and_sync(uidev, ev.code, ev.value); // send original key
+            send_key_ev(uidev, ev.code, ev.value); // send original key
         }
     }
 }
 
+// Feed an input event to the engine.
+static void handle_input_event(struct input_event ev) {
+    if (ev.type == EV_KEY)
+        handle_key(ev);
+    else if (ev.type == EV_SYN && ev.code == SYN_REPORT)
+        sync_key_evs(uidev);
+}
+
+#ifndef REMAPPER_NO_MAIN
+
 int
 main(int argc, char **argv)
 {
@@ -358,26 +385,24 @@ main(int argc, char **argv)
     print_bits(dev);
     print_props(dev);
 
+    // A read takes all the events there are (see evbatch.h).
+    evbatch batch = { .fd = fd };
     do {
-        struct input_event ev;
-        rc = libevdev_next_event(dev, LIBEVDEV_READ_FLAG_NORMAL|LIBEVDEV_READ_FLAG_BLOCKING, &ev);
-        if (rc == LIBEVDEV_READ_STATUS_SYNC) {
-            printf("::::::::::::::::::::: dropped ::::::::::::::::::::::\n");
-            while (rc == LIBEVDEV_READ_STATUS_SYNC) {
-                print_sync_event(&ev);
-                rc = libevdev_next_event(dev, LIBEVDEV_READ_FLAG_SYNC, &ev);
-            }
-            printf("::::::::::::::::::::: re-synced ::::::::::::::::::::::\n");
-        } else if (rc == LIBEVDEV_READ_STATUS_SUCCESS) {
-            if (ev.type == EV_KEY) {
-                handle_key(ev);
-            } else {
-                ;
+        const struct input_event *frame;
+        size_t n;
+
+        rc = evbatch_read(&batch);
+        while ((n = evbatch_next_frame(&batch, &frame)) > 0) {
+            if (evbatch_is_drop(frame)) {
+                printf("::::::::::::::::::::: dropped ::::::::::::::::::::::\n");
+                continue;
             }
+            for (size_t i = 0; i < n; i++)
+                handle_input_event(frame[i]);
         }
-    } while (rc == LIBEVDEV_READ_STATUS_SYNC || rc == LIBEVDEV_READ_STATUS_SUCCESS || rc == -EAGAIN);
+    } while (rc >= 0 || rc == -EAGAIN || rc == -EINTR);
 
-    if (rc != LIBEVDEV_READ_STATUS_SUCCESS && rc != -EAGAIN)
+    if (rc != -ENODEV)
         fprintf(stderr, "Failed to handle events: %s\n", strerror(-rc));
 
     rc = 0;
@@ -386,3 +411,5 @@ out:
 
     return rc;
 }
+
+#endif // REMAPPER_NO_MAIN
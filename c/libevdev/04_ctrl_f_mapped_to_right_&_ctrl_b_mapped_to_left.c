@@ -28,6 +28,8 @@
 #include <unistd.h>
 #include "libevdev/libevdev-uinput.h"
 #include "libevdev/libevdev.h"
+#include "evbatch.h"
+#include "keystate.h"
 
 static void
 print_abs_bits(struct libevdev *dev, int axis)
@@ -131,21 +133,37 @@ print_sync_event(struct input_event *ev)
     return 0;
 }
 
-static void send_key_ev_and_sync(const struct libevdev_uinput *uidev, unsigned int code, int value)
+// Events produced while handling the current input frame. They are
+// written to uinput all at once, terminated by a single SYN_REPORT,
+// by sync_key_evs, when the input frame's own SYN_REPORT comes in.
+#define OUT_QUEUE_SIZE 64
+struct input_event out_queue[OUT_QUEUE_SIZE];
+unsigned int out_queue_size = 0;
+
+static void sync_key_evs(const struct libevdev_uinput *uidev)
 {
-    int err;
+    if (out_queue_size == 0)
+        return;
 
-    err = libevdev_uinput_write_event(uidev, EV_KEY, code, value);
-    if (err != 0) {
-        perror("Error in writing EV_KEY event\n");
-        exit(err);
-    }
-    err = libevdev_uinput_write_event(uidev, EV_SYN, SYN_REPORT, 0);
-    if (err != 0) {
-        perror("Error in writing EV_SYN, SYN_REPORT, 0.\n");
-        exit(err);
+    out_queue[out_queue_size++] = (struct input_event){ .type = EV_SYN, .code = SYN_REPORT, .value = 0 };
+
+    ssize_t size = out_queue_size * sizeof(struct input_event);
+    if (write(libevdev_uinput_get_fd(uidev), out_queue, size) != size) {
+        perror("Error in writing events\n");
+        exit(errno);
     }
 
+    out_queue_size = 0;
+}
+
+static void send_key_ev(const struct libevdev_uinput *uidev, unsigned int code, int value)
+{
+    // Keep room for the SYN_REPORT.
+    if (out_queue_size == OUT_QUEUE_SIZE - 1)
+        sync_key_evs(uidev);
+
+    out_queue[out_queue_size++] = (struct input_event){ .type = EV_KEY, .code = code, .value = value };
+
     printf("Sending %u %u\n", code, value);
 }
 
@@ -166,30 +184,16 @@ map maps[] = {
     { KEY_RIGHTCTRL, KEY_B, 0, KEY_LEFT },
 };
 
-typedef struct {
-    unsigned int code;
-    int value;
-} keyboard_key_state;
-
-keyboard_key_state keyboard[] = {
-    { KEY_RIGHTCTRL, 0 },
-    { KEY_F, 0 },
-    { KEY_B, 0 },
-};
+// State of the keyboard: the value (1, 2 or 0) of every key (see
+// keystate.h).
+keystate keyboard;
 
 void set_keyboard_state(struct input_event ev) {
-    for (int i = 0; i < sizeof(keyboard)/sizeof(keyboard_key_state); i++) {
-        if (keyboard[i].code == ev.code)
-            keyboard[i].value = ev.value;
-    }
+    keystate_set(&keyboard, ev.code, ev.value);
 }
 
 int kb_state_of(unsigned int k_code) {
-    for (int i = 0; i < sizeof(keyboard)/sizeof(keyboard_key_state); i++) {
-        if (keyboard[i].code == k_code)
-            return keyboard[i].value;
-    }
-    return -1;
+    return keystate_value(&keyboard, k_code);
 }
 
 struct libevdev_uinput *uidev;
@@ -267,45 +271,45 @@ void handle_key(struct input_event ev) {
                 // Not considering when a key is mapped more than once
                 // and
                 // not considering cases with mod_to.
-                send_key_ev_and_sync(uidev, map_of_key->mod_from, 0);
-                send_key_ev_and_sync(uidev, map_of_key->key_to, 1);
+                send_key_ev(uidev, map_of_key->mod_from, 0);
+                send_key_ev(uidev, map_of_key->key_to, 1);
             } else if (kb_state_of(map_of_key->mod_from) == 2) {
-                send_key_ev_and_sync(uidev, map_of_key->mod_from, 0);
-                send_key_ev_and_sync(uidev, map_of_key->key_to, 1);
+                send_key_ev(uidev, map_of_key->mod_from, 0);
+                send_key_ev(uidev, map_of_key->key_to, 1);
             } else if (kb_state_of(map_of_key->mod_from) == 0) {
-                send_key_ev_and_sync(uidev, ev.code, ev.value);
+                send_key_ev(uidev, ev.code, ev.value);
             }
         } else if (ev.value == 2) {
             if (kb_state_of(map_of_key->mod_from) == 1) {
-                send_key_ev_and_sync(uidev, map_of_key->key_to, 2);
+                send_key_ev(uidev, map_of_key->key_to, 2);
             } else if (kb_state_of(map_of_key->mod_from) == 2) {
-                send_key_ev_and_sync(uidev, map_of_key->key_to, 2);
+                send_key_ev(uidev, map_of_key->key_to, 2);
             } else if (kb_state_of(map_of_key->mod_from) == 0) {
-                send_key_ev_and_sync(uidev, ev.code, ev.value);
+                send_key_ev(uidev, ev.code, ev.value);
             }
         } else if (ev.value == 0) {
             if (kb_state_of(map_of_key->mod_from) == 1) {
-                send_key_ev_and_sync(uidev, map_of_key->key_to, 0);
-                send_key_ev_and_sync(uidev, map_of_key->mod_from, 1);
+                send_key_ev(uidev, map_of_key->key_to, 0);
+                send_key_ev(uidev, map_of_key->mod_from, 1);
             } else if (kb_state_of(map_of_key->mod_from) == 2) {
-                send_key_ev_and_sync(uidev, map_of_key->key_to, 0);
-                send_key_ev_and_sync(uidev, map_of_key->mod_from, 1);
+                send_key_ev(uidev, map_of_key->key_to, 0);
+                send_key_ev(uidev, map_of_key->mod_from, 1);
             } else if (kb_state_of(map_of_key->mod_from) == 0) {
-                send_key_ev_and_sync(uidev, ev.code, ev.value);
+                send_key_ev(uidev, ev.code, ev.value);
             }
         }
     } else if (map_of_mod) {
         if (ev.value == 1) {
             if (kb_state_of(map_of_mod->key_from) == 1)  {
-                send_key_ev_and_sync(uidev, map_of_mod->mod_from, 0);
-                send_key_ev_and_sync(uidev, map_of_mod->key_from, 0);
-                send_key_ev_and_sync(uidev, map_of_mod->key_to, 1);
+                send_key_ev(uidev, map_of_mod->mod_from, 0);
+                send_key_ev(uidev, map_of_mod->key_from, 0);
+                send_key_ev(uidev, map_of_mod->key_to, 1);
             } else if (kb_state_of(map_of_mod->key_from) == 2) {
-                send_key_ev_and_sync(uidev, map_of_mod->mod_from, 0);
-                send_key_ev_and_sync(uidev, map_of_mod->key_from, 0);
-                send_key_ev_and_sync(uidev, map_of_mod->key_to, 1);
+                send_key_ev(uidev, map_of_mod->mod_from, 0);
+                send_key_ev(uidev, map_of_mod->key_from, 0);
+                send_key_ev(uidev, map_of_mod->key_to, 1);
             } else if (kb_state_of(map_of_mod->key_from) == 0) {
-                send_key_ev_and_sync(uidev, ev.code, ev.value);
+                send_key_ev(uidev, ev.code, ev.value);
             }
         } else if (ev.value == 2) {
             if (kb_state_of(map_of_mod->key_from) == 1)  {
@@ -313,26 +317,36 @@ void handle_key(struct input_event ev) {
             } else if (kb_state_of(map_of_mod->key_from) == 2) {
                 printf("the alleged impossible is happening");
             } else if (kb_state_of(map_of_mod->key_from) == 0) {
-                send_key_ev_and_sync(uidev, ev.code, ev.value);
+                send_key_ev(uidev, ev.code, ev.value);
             }
         } else if (ev.value == 0) {
             if (kb_state_of(map_of_mod->key_from) == 1)  {
-                send_key_ev_and_sync(uidev, ev.code, ev.value);
-                send_key_ev_and_sync(uidev, map_of_mod->key_to, 0);
-                send_key_ev_and_sync(uidev, map_of_mod->key_from, 1);
+                send_key_ev(uidev, ev.code, ev.value);
+                send_key_ev(uidev, map_of_mod->key_to, 0);
+                send_key_ev(uidev, map_of_mod->key_from, 1);
             } else if (kb_state_of(map_of_mod->key_from) == 2) {
-                send_key_ev_and_sync(uidev, ev.code, ev.value);
-                send_key_ev_and_sync(uidev, map_of_mod->key_to, 0);
-                send_key_ev_and_sync(uidev, map_of_mod->key_from, 1);
+                send_key_ev(uidev, ev.code, ev.value);
+                send_key_ev(uidev, map_of_mod->key_to, 0);
+                send_key_ev(uidev, map_of_mod->key_from, 1);
             } else if (kb_state_of(map_of_mod->key_from) == 0) {
-                send_key_ev_and_sync(uidev, ev.code, ev.value);
+                send_key_ev(uidev, ev.code, ev.value);
             }
         }
     } else {
-        send_key_ev_and_sync(uidev, ev.code, ev.value);
+        send_key_ev(uidev, ev.code, ev.value);
     }
 }
 
+// Feed an input event to the engine.
+static void handle_input_event(struct input_event ev) {
+    if (ev.type == EV_KEY)
+        handle_key(ev);
+    else if (ev.type == EV_SYN && ev.code == SYN_REPORT)
+        sync_key_evs(uidev);
+}
+
+#ifndef REMAPPER_NO_MAIN
+
 int
 main(int argc, char **argv)
 {
@@ -396,27 +410,24 @@ main(int argc, char **argv)
     printf("mod_to: %d\n", maps[0].mod_to);
     printf("key_to: %d\n", maps[0].key_to);
 
+    // A read takes all the events there are (see evbatch.h).
+    evbatch batch = { .fd = fd };
     do {
-        struct input_event ev;
-        rc = libevdev_next_event(dev, LIBEVDEV_READ_FLAG_NORMAL|LIBEVDEV_READ_FLAG_BLOCKING, &ev);
-        if (rc == LIBEVDEV_READ_STATUS_SYNC) {
-            printf("::::::::::::::::::::: dropped ::::::::::::::::::::::\n");
-            while (rc == LIBEVDEV_READ_STATUS_SYNC) {
-                print_sync_event(&ev);
-                rc = libevdev_next_event(dev, LIBEVDEV_READ_FLAG_SYNC, &ev);
-            }
-            printf("::::::::::::::::::::: re-synced ::::::::::::::::::::::\n");
-        } else if (rc == LIBEVDEV_READ_STATUS_SUCCESS) {
-            if (ev.type == EV_KEY) {
-                //printf("about to call handle_key\n");
-                handle_key(ev);
-            } else {
-                ;
+        const struct input_event *frame;
+        size_t n;
+
+        rc = evbatch_read(&batch);
+        while ((n = evbatch_next_frame(&batch, &frame)) > 0) {
+            if (evbatch_is_drop(frame)) {
+                printf("::::::::::::::::::::: dropped ::::::::::::::::::::::\n");
+                continue;
             }
+            for (size_t i = 0; i < n; i++)
+                handle_input_event(frame[i]);
         }
-    } while (rc == LIBEVDEV_READ_STATUS_SYNC || rc == LIBEVDEV_READ_STATUS_SUCCESS || rc == -EAGAIN);
+    } while (rc >= 0 || rc == -EAGAIN || rc == -EINTR);
 
-    if (rc != LIBEVDEV_READ_STATUS_SUCCESS && rc != -EAGAIN)
+    if (rc != -ENODEV)
         fprintf(stderr, "Failed to handle events: %s\n", strerror(-rc));
 
     rc = 0;
@@ -425,3 +436,5 @@ out:
 
     return rc;
 }
+
+#endif // REMAPPER_NO_MAIN
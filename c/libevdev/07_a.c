@@ -97,6 +97,8 @@
 #include <unistd.h>
 #include "libevdev/libevdev-uinput.h"
 #include "libevdev/libevdev.h"
+#include "evbatch.h"
+#include "keystate.h"
 
 #include <X11/X.h>
 #include <X11/Xlib.h>
@@ -242,123 +244,89 @@ map maps[] = {
   // Escaping map [I usually bind it to C-q]
 };
 
-static void send_key_ev_and_sync(const struct libevdev_uinput *uidev, unsigned int code, int value)
+// Events produced while handling the current input frame. They are
+// written to uinput all at once, terminated by a single SYN_REPORT,
+// by sync_key_evs, when the input frame's own SYN_REPORT comes in.
+#define OUT_QUEUE_SIZE 64
+struct input_event out_queue[OUT_QUEUE_SIZE];
+unsigned int out_queue_size = 0;
+
+static void sync_key_evs(const struct libevdev_uinput *uidev)
 {
-  int err;
+  if (out_queue_size == 0)
+    return;
 
-  err = libevdev_uinput_write_event(uidev, EV_KEY, code, value);
-  if (err != 0) {
-    perror("Error in writing EV_KEY event\n");
-    exit(err);
-  }
-  err = libevdev_uinput_write_event(uidev, EV_SYN, SYN_REPORT, 0);
-  if (err != 0) {
-    perror("Error in writing EV_SYN, SYN_REPORT, 0.\n");
-    exit(err);
+  out_queue[out_queue_size++] = (struct input_event){ .type = EV_SYN, .code = SYN_REPORT, .value = 0 };
+
+  ssize_t size = out_queue_size * sizeof(struct input_event);
+  if (write(libevdev_uinput_get_fd(uidev), out_queue, size) != size) {
+    perror("Error in writing events\n");
+    exit(errno);
   }
 
+  out_queue_size = 0;
+}
+
+static void send_key_ev(const struct libevdev_uinput *uidev, unsigned int code, int value)
+{
+  // Keep room for the SYN_REPORT.
+  if (out_queue_size == OUT_QUEUE_SIZE - 1)
+    sync_key_evs(uidev);
+
+  out_queue[out_queue_size++] = (struct input_event){ .type = EV_KEY, .code = code, .value = value };
+
   printf("Sending %u %u\n", code, value);
 }
 
 // Take index of a map in maps and send mod_to + key_to of that map
 static void send_output(const struct libevdev_uinput *uidev, int i) {
   if (maps[i].mod_to)
-    send_key_ev_and_sync(uidev, maps[i].mod_to, 1);
+    send_key_ev(uidev, maps[i].mod_to, 1);
 }
 
-typedef struct {
-  unsigned int code;
-  int value;
-} keyboard_key_state;
-
-keyboard_key_state keyboard[] = {
-  { KEY_LEFTCTRL, 0 }, // 29
-  { KEY_RIGHTCTRL, 0 }, // 97
-  { KEY_LEFTALT, 0 }, // 56
-  { KEY_RIGHTALT, 0 },
-  { KEY_P, 0 }, // 25
-  { KEY_F, 0 }, // 33
-  { KEY_B, 0 }, // 48
-  { KEY_N, 0 }, // 49
-  { KEY_V, 0 },
-  { KEY_A, 0 },
-  { KEY_E, 0 },
-};
-// KEY_RIGHT     106
-// KEY_LEFT      105
-
+// State of the keyboard: the value (1, 2 or 0) of every key (see
+// keystate.h).
+keystate keyboard;
 
 // ## Represents the current state keyboard's keys state (new
 // version).  A key can be in either 1, or 2, or 0 state (value). Now
 // we also store the last time down (which gets registered on ev.value
 // 1).
-typedef struct {
-  unsigned int code; // Code of the key
-  int value;         // Status of key (either 1, or 2, or 0)
-  struct timespec last_time_down; // Last time value was set to 1
-} keyboard_key_state2;
-keyboard_key_state2 keyboard2[] = {
-  { KEY_LEFTCTRL, 0 }, // 29
-  { KEY_RIGHTCTRL, 0 }, // 97
-  { KEY_LEFTALT, 0 }, // 56
-  { KEY_RIGHTALT, 0 }, // 100
-  { KEY_CAPSLOCK, 0 }, // 58
-  { KEY_ENTER, 0 }, // 28
-  { KEY_RIGHT, 0 }, // 106
-  { KEY_SYSRQ, 0 }, // 99
-  { KEY_ESC, 0 }, // 1
-  { KEY_P, 0 }, // 25
-  { KEY_F, 0 }, // 33
-  { KEY_B, 0 }, // 48
-  { KEY_N, 0 }, // 49
-  { KEY_V, 0 }, // 47
-  { KEY_A, 0 }, // 30
-  { KEY_E, 0 }, // 18
-  { KEY_W, 0 }, // 17
-};
+keystate keyboard2;
+struct timespec last_time_down[KEY_CNT]; // Last time value was set to 1
 
 void print_keyboard2() {
-  for (int i = 0; i < sizeof(keyboard2)/sizeof(keyboard_key_state2); ++i) {
+  for (unsigned c = keyset_next(&keyboard2.down, 0); c < KEY_CNT; c = keyset_next(&keyboard2.down, c + 1)) {
     printf("########################################\n");
-    printf("Key code: %u\n", keyboard2[i].code);
-    printf("Key value: %d\n", keyboard2[i].value);
-    printf("Last time down: %lld.%09ld seconds\n", (long long)keyboard2[i].last_time_down.tv_sec, keyboard2[i].last_time_down.tv_nsec);
+    printf("Key code: %u\n", c);
+    printf("Key value: %d\n", keystate_value(&keyboard2, c));
+    printf("Last time down: %lld.%09ld seconds\n", (long long)last_time_down[c].tv_sec, last_time_down[c].tv_nsec);
     printf("########################################\n");
     printf("\n");
   }
 }
 
 void set_keyboard_state2(struct input_event ev) {
-  for (int i = 0; i < sizeof(keyboard2)/sizeof(keyboard_key_state2); i++) {
-    if (keyboard2[i].code == ev.code) {
-      keyboard2[i].value = ev.value;
-      if (ev.value == 1)
-        clock_gettime(CLOCK_MONOTONIC, &keyboard2[i].last_time_down);
-    }
-  }
+  keystate_set(&keyboard2, ev.code, ev.value);
+  if (ev.value == 1)
+    clock_gettime(CLOCK_MONOTONIC, &last_time_down[ev.code]);
 }
 
 void set_keyboard_state(struct input_event ev) {
-  for (int i = 0; i < sizeof(keyboard)/sizeof(keyboard_key_state); i++) {
-    if (keyboard[i].code == ev.code)
-      keyboard[i].value = ev.value;
-  }
+  keystate_set(&keyboard, ev.code, ev.value);
 }
 
 int kb_state_of(unsigned int k_code) {
-  for (int i = 0; i < sizeof(keyboard)/sizeof(keyboard_key_state); i++) {
-    if (keyboard[i].code == k_code)
-      return keyboard[i].value;
-  }
-  return -1;
+  return keystate_value(&keyboard, k_code);
 }
 
+// (0 for keys that are up, whatever the key: 0, the code of no key,
+// included. The table this used to search had -1 for the keys it did
+// not have, which some_jk_are_down_or_held took for down, so that
+// handle_key2's debug output said a janus key was down for any map
+// with no mod_from. It does not any more.)
 int kb_state_of2(unsigned int k_code) {
-  for (int i = 0; i < sizeof(keyboard2)/sizeof(keyboard_key_state2); i++) {
-    if (keyboard2[i].code == k_code)
-      return keyboard2[i].value;
-  }
-  return -1;
+  return keystate_value(&keyboard2, k_code);
 }
 
 struct libevdev_uinput *uidev;
@@ -449,51 +417,51 @@ void handle_key_merge(struct input_event ev) {
     if (ev.value == 1) {
       printf("we are in ev.value == 1 block\n");
       if (kb_state_of(map_of_key->mod_from) == 1) {
-	send_key_ev_and_sync(uidev, map_of_key->mod_from, 0);
+	send_key_ev(uidev, map_of_key->mod_from, 0);
 
         // # = IN PROGRESS: considering cases with mod_to.
-	if (map_of_key->mod_to)	  send_key_ev_and_sync(uidev, map_of_key->mod_to, 1);
+	if (map_of_key->mod_to)	  send_key_ev(uidev, map_of_key->mod_to, 1);
 
-        send_key_ev_and_sync(uidev, map_of_key->key_to, 1);
+        send_key_ev(uidev, map_of_key->key_to, 1);
       } else if (kb_state_of(map_of_key->mod_from) == 2) {
-        send_key_ev_and_sync(uidev, map_of_key->mod_from, 0);
+        send_key_ev(uidev, map_of_key->mod_from, 0);
 
         // # = IN PROGRESS: considering cases with mod_to.
 	if (map_of_key->mod_to) {
-	    send_key_ev_and_sync(uidev, map_of_key->mod_to, 1);
+	    send_key_ev(uidev, map_of_key->mod_to, 1);
 	}
 
-        send_key_ev_and_sync(uidev, map_of_key->key_to, 1);
+        send_key_ev(uidev, map_of_key->key_to, 1);
       } else if (kb_state_of(map_of_key->mod_from) == 0) {
-        send_key_ev_and_sync(uidev, ev.code, ev.value);
+        send_key_ev(uidev, ev.code, ev.value);
       }
     } else if (ev.value == 2) {
       if (kb_state_of(map_of_key->mod_from) == 1) {
-        send_key_ev_and_sync(uidev, map_of_key->key_to, 2);
+        send_key_ev(uidev, map_of_key->key_to, 2);
       } else if (kb_state_of(map_of_key->mod_from) == 2) {
-        send_key_ev_and_sync(uidev, map_of_key->key_to, 2);
+        send_key_ev(uidev, map_of_key->key_to, 2);
       } else if (kb_state_of(map_of_key->mod_from) == 0) {
-        send_key_ev_and_sync(uidev, ev.code, ev.value);
+        send_key_ev(uidev, ev.code, ev.value);
       }
     } else if (ev.value == 0) {
       if (kb_state_of(map_of_key->mod_from) == 1) {
-        send_key_ev_and_sync(uidev, map_of_key->key_to, 0);
+        send_key_ev(uidev, map_of_key->key_to, 0);
 
         // # = IN PROGRESS: considering cases with mod_to.
 	if (map_of_key->mod_to)
-	  send_key_ev_and_sync(uidev, map_of_key->mod_to, 0);
+	  send_key_ev(uidev, map_of_key->mod_to, 0);
 
-        send_key_ev_and_sync(uidev, map_of_key->mod_from, 1);
+        send_key_ev(uidev, map_of_key->mod_from, 1);
       } else if (kb_state_of(map_of_key->mod_from) == 2) {
-        send_key_ev_and_sync(uidev, map_of_key->key_to, 0);
+        send_key_ev(uidev, map_of_key->key_to, 0);
 
         // # = IN PROGRESS: considering cases with mod_to.
 	if (map_of_key->mod_to)
-	  send_key_ev_and_sync(uidev, map_of_key->mod_to, 0);
+	  send_key_ev(uidev, map_of_key->mod_to, 0);
 
-        send_key_ev_and_sync(uidev, map_of_key->mod_from, 1);
+        send_key_ev(uidev, map_of_key->mod_from, 1);
       } else if (kb_state_of(map_of_key->mod_from) == 0) {
-        send_key_ev_and_sync(uidev, ev.code, ev.value);
+        send_key_ev(uidev, ev.code, ev.value);
       }
     }
   } else if (map_of_mod) {
@@ -502,26 +470,26 @@ void handle_key_merge(struct input_event ev) {
       printf("we are in ev.value == 1  block\n");
       if (kb_state_of(map_of_mod->key_from) == 1)  {
 	printf("we are in kb_state_of(map_of_mod->key_from) == 1\n");
-        send_key_ev_and_sync(uidev, map_of_mod->mod_from, 0);
-        send_key_ev_and_sync(uidev, map_of_mod->key_from, 0);
+        send_key_ev(uidev, map_of_mod->mod_from, 0);
+        send_key_ev(uidev, map_of_mod->key_from, 0);
 
 	// # = IN PROGRESS: considering cases with mod_to.
 	if (map_of_mod->mod_to)
-	  send_key_ev_and_sync(uidev, map_of_mod->mod_to, 1);
+	  send_key_ev(uidev, map_of_mod->mod_to, 1);
 
-        send_key_ev_and_sync(uidev, map_of_mod->key_to, 1);
+        send_key_ev(uidev, map_of_mod->key_to, 1);
       } else if (kb_state_of(map_of_mod->key_from) == 2) {
         printf("we are in kb_state_of(map_of_mod->key_from) == 2\n");
-	send_key_ev_and_sync(uidev, map_of_mod->mod_from, 0);
-        send_key_ev_and_sync(uidev, map_of_mod->key_from, 0);
+	send_key_ev(uidev, map_of_mod->mod_from, 0);
+        send_key_ev(uidev, map_of_mod->key_from, 0);
 
 	// # = IN PROGRESS: considering cases with mod_to.
 	if (map_of_mod->mod_to)
-	  send_key_ev_and_sync(uidev, map_of_mod->mod_to, 1);
+	  send_key_ev(uidev, map_of_mod->mod_to, 1);
 
-        send_key_ev_and_sync(uidev, map_of_mod->key_to, 1);
+        send_key_ev(uidev, map_of_mod->key_to, 1);
       } else if (kb_state_of(map_of_mod->key_from) == 0) {
-        send_key_ev_and_sync(uidev, ev.code, ev.value);
+        send_key_ev(uidev, ev.code, ev.value);
       }
     } else if (ev.value == 2) {
       printf("we are in ev.value == 2  block\n");
@@ -530,34 +498,34 @@ void handle_key_merge(struct input_event ev) {
       } else if (kb_state_of(map_of_mod->key_from) == 2) {
         printf("the alleged impossible is happening");
       } else if (kb_state_of(map_of_mod->key_from) == 0) {
-        send_key_ev_and_sync(uidev, ev.code, ev.value);
+        send_key_ev(uidev, ev.code, ev.value);
       }
     } else if (ev.value == 0) {
       printf("we are in ev.value == 0  block\n");
       if (kb_state_of(map_of_mod->key_from) == 1)  {
-        send_key_ev_and_sync(uidev, ev.code, ev.value);
+        send_key_ev(uidev, ev.code, ev.value);
 
 	// # = IN PROGRESS: considering cases with mod_to.
 	if (map_of_mod->mod_to)
-	  send_key_ev_and_sync(uidev, map_of_mod->mod_to, 0);
+	  send_key_ev(uidev, map_of_mod->mod_to, 0);
 
-        send_key_ev_and_sync(uidev, map_of_mod->key_to, 0);
-        send_key_ev_and_sync(uidev, map_of_mod->key_from, 1);
+        send_key_ev(uidev, map_of_mod->key_to, 0);
+        send_key_ev(uidev, map_of_mod->key_from, 1);
       } else if (kb_state_of(map_of_mod->key_from) == 2) {
-        send_key_ev_and_sync(uidev, ev.code, ev.value);
+        send_key_ev(uidev, ev.code, ev.value);
 
 	// # = IN PROGRESS: considering cases with mod_to.
 	if (map_of_mod->mod_to)
-	  send_key_ev_and_sync(uidev, map_of_mod->mod_to, 0);
+	  send_key_ev(uidev, map_of_mod->mod_to, 0);
 
-        send_key_ev_and_sync(uidev, map_of_mod->key_to, 0);
-        send_key_ev_and_sync(uidev, map_of_mod->key_from, 1);
+        send_key_ev(uidev, map_of_mod->key_to, 0);
+        send_key_ev(uidev, map_of_mod->key_from, 1);
       } else if (kb_state_of(map_of_mod->key_from) == 0) {
-        send_key_ev_and_sync(uidev, ev.code, ev.value);
+        send_key_ev(uidev, ev.code, ev.value);
       }
     }
   } else {
-    send_key_ev_and_sync(uidev, ev.code, ev.value);
+    send_key_ev(uidev, ev.code, ev.value);
   }
 }
 
@@ -779,7 +747,7 @@ void handle_key2(struct input_event ev) {
           printf("send key 0\n");
       }
     } else if ((k_sm_i || m_sm_i) && // is a key/mod in single map
-               !k_sm_i->on_hold && // is not a janus key
+               !(k_sm_i && k_sm_i->on_hold) && // is not a janus key
                !k_cm_i) // is not in combo map
     {
       // ## K/M SINGLE MAP, NO COMBO MAP, NO JANUS ##########################
@@ -811,9 +779,9 @@ void handle_key2(struct input_event ev) {
           printf("send key 0\n");
       }
 
-    } else if ( (!k_cm_i && k_sm_i->on_hold)
+    } else if ( (!k_cm_i && k_sm_i && k_sm_i->on_hold)
                 ||
-                (!m_cm_i && m_sm_i->on_hold))
+                (!m_cm_i && m_sm_i && m_sm_i->on_hold))
     {
       // ## K/M JANUS, NOT IN COMBO MAP ##########################
       // Here I guess we should do what we do in janus key for janus
@@ -862,51 +830,51 @@ void handle_key(struct input_event ev) {
     if (ev.value == 1) {
       printf("we are in ev.value == 1 block\n");
       if (kb_state_of(map_of_key->mod_from) == 1) {
-	send_key_ev_and_sync(uidev, map_of_key->mod_from, 0);
+	send_key_ev(uidev, map_of_key->mod_from, 0);
 
         // # = IN PROGRESS: considering cases with mod_to.
-	if (map_of_key->mod_to)	  send_key_ev_and_sync(uidev, map_of_key->mod_to, 1);
+	if (map_of_key->mod_to)	  send_key_ev(uidev, map_of_key->mod_to, 1);
 
-        send_key_ev_and_sync(uidev, map_of_key->key_to, 1);
+        send_key_ev(uidev, map_of_key->key_to, 1);
       } else if (kb_state_of(map_of_key->mod_from) == 2) {
-        send_key_ev_and_sync(uidev, map_of_key->mod_from, 0);
+        send_key_ev(uidev, map_of_key->mod_from, 0);
 
         // # = IN PROGRESS: considering cases with mod_to.
 	if (map_of_key->mod_to) {
-	    send_key_ev_and_sync(uidev, map_of_key->mod_to, 1);
+	    send_key_ev(uidev, map_of_key->mod_to, 1);
 	}
 
-        send_key_ev_and_sync(uidev, map_of_key->key_to, 1);
+        send_key_ev(uidev, map_of_key->key_to, 1);
       } else if (kb_state_of(map_of_key->mod_from) == 0) {
-        send_key_ev_and_sync(uidev, ev.code, ev.value);
+        send_key_ev(uidev, ev.code, ev.value);
       }
     } else if (ev.value == 2) {
       if (kb_state_of(map_of_key->mod_from) == 1) {
-        send_key_ev_and_sync(uidev, map_of_key->key_to, 2);
+        send_key_ev(uidev, map_of_key->key_to, 2);
       } else if (kb_state_of(map_of_key->mod_from) == 2) {
-        send_key_ev_and_sync(uidev, map_of_key->key_to, 2);
+        send_key_ev(uidev, map_of_key->key_to, 2);
       } else if (kb_state_of(map_of_key->mod_from) == 0) {
-        send_key_ev_and_sync(uidev, ev.code, ev.value);
+        send_key_ev(uidev, ev.code, ev.value);
       }
     } else if (ev.value == 0) {
       if (kb_state_of(map_of_key->mod_from) == 1) {
-        send_key_ev_and_sync(uidev, map_of_key->key_to, 0);
+        send_key_ev(uidev, map_of_key->key_to, 0);
 
         // # = IN PROGRESS: considering cases with mod_to.
 	if (map_of_key->mod_to)
-	  send_key_ev_and_sync(uidev, map_of_key->mod_to, 0);
+	  send_key_ev(uidev, map_of_key->mod_to, 0);
 
-        send_key_ev_and_sync(uidev, map_of_key->mod_from, 1);
+        send_key_ev(uidev, map_of_key->mod_from, 1);
       } else if (kb_state_of(map_of_key->mod_from) == 2) {
-        send_key_ev_and_sync(uidev, map_of_key->key_to, 0);
+        send_key_ev(uidev, map_of_key->key_to, 0);
 
         // # = IN PROGRESS: considering cases with mod_to.
 	if (map_of_key->mod_to)
-	  send_key_ev_and_sync(uidev, map_of_key->mod_to, 0);
+	  send_key_ev(uidev, map_of_key->mod_to, 0);
 
-        send_key_ev_and_sync(uidev, map_of_key->mod_from, 1);
+        send_key_ev(uidev, map_of_key->mod_from, 1);
       } else if (kb_state_of(map_of_key->mod_from) == 0) {
-        send_key_ev_and_sync(uidev, ev.code, ev.value);
+        send_key_ev(uidev, ev.code, ev.value);
       }
     }
   } else if (map_of_mod) {
@@ -915,26 +883,26 @@ void handle_key(struct input_event ev) {
       printf("we are in ev.value == 1  block\n");
       if (kb_state_of(map_of_mod->key_from) == 1)  {
 	printf("we are in kb_state_of(map_of_mod->key_from) == 1\n");
-        send_key_ev_and_sync(uidev, map_of_mod->mod_from, 0);
-        send_key_ev_and_sync(uidev, map_of_mod->key_from, 0);
+        send_key_ev(uidev, map_of_mod->mod_from, 0);
+        send_key_ev(uidev, map_of_mod->key_from, 0);
 
 	// # = IN PROGRESS: considering cases with mod_to.
 	if (map_of_mod->mod_to)
-	  send_key_ev_and_sync(uidev, map_of_mod->mod_to, 1);
+	  send_key_ev(uidev, map_of_mod->mod_to, 1);
 
-        send_key_ev_and_sync(uidev, map_of_mod->key_to, 1);
+        send_key_ev(uidev, map_of_mod->key_to, 1);
       } else if (kb_state_of(map_of_mod->key_from) == 2) {
         printf("we are in kb_state_of(map_of_mod->key_from) == 2\n");
-	send_key_ev_and_sync(uidev, map_of_mod->mod_from, 0);
-        send_key_ev_and_sync(uidev, map_of_mod->key_from, 0);
+	send_key_ev(uidev, map_of_mod->mod_from, 0);
+        send_key_ev(uidev, map_of_mod->key_from, 0);
 
 	// # = IN PROGRESS: considering cases with mod_to.
 	if (map_of_mod->mod_to)
-	  send_key_ev_and_sync(uidev, map_of_mod->mod_to, 1);
+	  send_key_ev(uidev, map_of_mod->mod_to, 1);
 
-        send_key_ev_and_sync(uidev, map_of_mod->key_to, 1);
+        send_key_ev(uidev, map_of_mod->key_to, 1);
       } else if (kb_state_of(map_of_mod->key_from) == 0) {
-        send_key_ev_and_sync(uidev, ev.code, ev.value);
+        send_key_ev(uidev, ev.code, ev.value);
       }
     } else if (ev.value == 2) {
       printf("we are in ev.value == 2  block\n");
@@ -943,34 +911,34 @@ void handle_key(struct input_event ev) {
       } else if (kb_state_of(map_of_mod->key_from) == 2) {
         printf("the alleged impossible is happening");
       } else if (kb_state_of(map_of_mod->key_from) == 0) {
-        send_key_ev_and_sync(uidev, ev.code, ev.value);
+        send_key_ev(uidev, ev.code, ev.value);
       }
     } else if (ev.value == 0) {
       printf("we are in ev.value == 0  block\n");
       if (kb_state_of(map_of_mod->key_from) == 1)  {
-        send_key_ev_and_sync(uidev, ev.code, ev.value);
+        send_key_ev(uidev, ev.code, ev.value);
 
 	// # = IN PROGRESS: considering cases with mod_to.
 	if (map_of_mod->mod_to)
-	  send_key_ev_and_sync(uidev, map_of_mod->mod_to, 0);
+	  send_key_ev(uidev, map_of_mod->mod_to, 0);
 
-        send_key_ev_and_sync(uidev, map_of_mod->key_to, 0);
-        send_key_ev_and_sync(uidev, map_of_mod->key_from, 1);
+        send_key_ev(uidev, map_of_mod->key_to, 0);
+        send_key_ev(uidev, map_of_mod->key_from, 1);
       } else if (kb_state_of(map_of_mod->key_from) == 2) {
-        send_key_ev_and_sync(uidev, ev.code, ev.value);
+        send_key_ev(uidev, ev.code, ev.value);
 
 	// # = IN PROGRESS: considering cases with mod_to.
 	if (map_of_mod->mod_to)
-	  send_key_ev_and_sync(uidev, map_of_mod->mod_to, 0);
+	  send_key_ev(uidev, map_of_mod->mod_to, 0);
 
-        send_key_ev_and_sync(uidev, map_of_mod->key_to, 0);
-        send_key_ev_and_sync(uidev, map_of_mod->key_from, 1);
+        send_key_ev(uidev, map_of_mod->key_to, 0);
+        send_key_ev(uidev, map_of_mod->key_from, 1);
       } else if (kb_state_of(map_of_mod->key_from) == 0) {
-        send_key_ev_and_sync(uidev, ev.code, ev.value);
+        send_key_ev(uidev, ev.code, ev.value);
       }
     }
   } else {
-    send_key_ev_and_sync(uidev, ev.code, ev.value);
+    send_key_ev(uidev, ev.code, ev.value);
   }
 }
 
@@ -1086,6 +1054,16 @@ void *track_window() {
   }
 }
 
+// Feed an input event to the engine.
+static void handle_input_event(struct input_event ev) {
+  if (ev.type == EV_KEY)
+    handle_key2(ev);
+  else if (ev.type == EV_SYN && ev.code == SYN_REPORT)
+    sync_key_evs(uidev);
+}
+
+#ifndef REMAPPER_NO_MAIN
+
 int
 main(int argc, char **argv)
 {
@@ -1135,22 +1113,24 @@ main(int argc, char **argv)
     return -errno;
   }
 
+  // A read takes all the events there are (see evbatch.h).
+  evbatch batch = { .fd = fd };
   do {
-    struct input_event ev;
-    rc = libevdev_next_event(dev, LIBEVDEV_READ_FLAG_NORMAL|LIBEVDEV_READ_FLAG_BLOCKING, &ev);
-    if (rc == LIBEVDEV_READ_STATUS_SYNC) {
-      printf("Dropped\n");
-      while (rc == LIBEVDEV_READ_STATUS_SYNC) {
-        rc = libevdev_next_event(dev, LIBEVDEV_READ_FLAG_SYNC, &ev);
+    const struct input_event *frame;
+    size_t n;
+
+    rc = evbatch_read(&batch);
+    while ((n = evbatch_next_frame(&batch, &frame)) > 0) {
+      if (evbatch_is_drop(frame)) {
+        printf("Dropped\n");
+        continue;
       }
-      printf("Re-synced\n");
-    } else if (rc == LIBEVDEV_READ_STATUS_SUCCESS) {
-      if (ev.type == EV_KEY)
-        handle_key2(ev);
+      for (size_t i = 0; i < n; i++)
+        handle_input_event(frame[i]);
     }
-  } while (rc == LIBEVDEV_READ_STATUS_SYNC || rc == LIBEVDEV_READ_STATUS_SUCCESS || rc == -EAGAIN);
+  } while (rc >= 0 || rc == -EAGAIN || rc == -EINTR);
 
-  if (rc != LIBEVDEV_READ_STATUS_SUCCESS && rc != -EAGAIN)
+  if (rc != -ENODEV)
     fprintf(stderr, "Failed to handle events: %s\n", strerror(-rc));
 
   rc = 0;
@@ -1159,3 +1139,5 @@ main(int argc, char **argv)
 
   return rc;
 }
+
+#endif // REMAPPER_NO_MAIN
@@ -57,6 +57,8 @@
 #include <unistd.h>
 #include "libevdev/libevdev-uinput.h"
 #include "libevdev/libevdev.h"
+#include "evbatch.h"
+#include "keystate.h"
 
 #include <X11/X.h>
 #include <X11/Xlib.h>
@@ -140,88 +142,66 @@ char* mapped_window_class_names[] = {
   "Brave-browser",
 };
 
-static void send_key_ev_and_sync(const struct libevdev_uinput *uidev, unsigned int code, int value)
+// Events produced while handling the current input frame. They are
+// written to uinput all at once, terminated by a single SYN_REPORT,
+// by sync_key_evs, when the input frame's own SYN_REPORT comes in.
+#define OUT_QUEUE_SIZE 64
+struct input_event out_queue[OUT_QUEUE_SIZE];
+unsigned int out_queue_size = 0;
+
+static void sync_key_evs(const struct libevdev_uinput *uidev)
 {
-  int err;
+  if (out_queue_size == 0)
+    return;
 
-  err = libevdev_uinput_write_event(uidev, EV_KEY, code, value);
-  if (err != 0) {
-    perror("Error in writing EV_KEY event\n");
-    exit(err);
-  }
-  err = libevdev_uinput_write_event(uidev, EV_SYN, SYN_REPORT, 0);
-  if (err != 0) {
-    perror("Error in writing EV_SYN, SYN_REPORT, 0.\n");
-    exit(err);
+  out_queue[out_queue_size++] = (struct input_event){ .type = EV_SYN, .code = SYN_REPORT, .value = 0 };
+
+  ssize_t size = out_queue_size * sizeof(struct input_event);
+  if (write(libevdev_uinput_get_fd(uidev), out_queue, size) != size) {
+    perror("Error in writing events\n");
+    exit(errno);
   }
 
-  printf("Sending %u %u\n", code, value);
+  out_queue_size = 0;
 }
 
-typedef struct {
-  unsigned int code;
-  int value;
-} keyboard_key_state;
+static void send_key_ev(const struct libevdev_uinput *uidev, unsigned int code, int value)
+{
+  // Keep room for the SYN_REPORT.
+  if (out_queue_size == OUT_QUEUE_SIZE - 1)
+    sync_key_evs(uidev);
+
+  out_queue[out_queue_size++] = (struct input_event){ .type = EV_KEY, .code = code, .value = value };
 
+  printf("Sending %u %u\n", code, value);
+}
 
 // ## Represents the current state keyboard's keys state (new
 // version).  A key can be in either 1, or 2, or 0 state (value). Now
 // we also store the last time down (which gets registered on ev.value
-// 1).
-typedef struct {
-  unsigned int code; // Code of the key
-  int value;         // Status of key (either 1, or 2, or 0)
-  struct timespec last_time_down; // Last time value was set to 1
-} keyboard_key_state2;
-keyboard_key_state2 keyboard2[] = {
-  { KEY_LEFTCTRL, 0 }, // 29
-  { KEY_RIGHTCTRL, 0 }, // 97
-  { KEY_LEFTALT, 0 }, // 56
-  { KEY_RIGHTALT, 0 }, // 100
-  { KEY_CAPSLOCK, 0 }, // 58
-  { KEY_ENTER, 0 }, // 28
-  { KEY_RIGHT, 0 }, // 106
-  { KEY_SYSRQ, 0 }, // 99
-  { KEY_ESC, 0 }, // 1
-  { KEY_P, 0 }, // 25
-  { KEY_F, 0 }, // 33
-  { KEY_B, 0 }, // 48
-  { KEY_N, 0 }, // 49
-  { KEY_V, 0 }, // 47
-  { KEY_A, 0 }, // 30
-  { KEY_E, 0 }, // 18
-  { KEY_W, 0 }, // 17
-  { KEY_G, 0 }, // 34
-  { KEY_Q, 0 }, // 16
-};
+// 1). (See keystate.h.)
+keystate keyboard2;
+struct timespec last_time_down[KEY_CNT]; // Last time value was set to 1
 
 void print_keyboard2() {
-  for (int i = 0; i < sizeof(keyboard2)/sizeof(keyboard_key_state2); ++i) {
+  for (unsigned c = keyset_next(&keyboard2.down, 0); c < KEY_CNT; c = keyset_next(&keyboard2.down, c + 1)) {
     printf("########################################\n");
-    printf("Key code: %u\n", keyboard2[i].code);
-    printf("Key value: %d\n", keyboard2[i].value);
-    printf("Last time down: %lld.%09ld seconds\n", (long long)keyboard2[i].last_time_down.tv_sec, keyboard2[i].last_time_down.tv_nsec);
+    printf("Key code: %u\n", c);
+    printf("Key value: %d\n", keystate_value(&keyboard2, c));
+    printf("Last time down: %lld.%09ld seconds\n", (long long)last_time_down[c].tv_sec, last_time_down[c].tv_nsec);
     printf("########################################\n");
     printf("\n");
   }
 }
 
 void set_keyboard_state(struct input_event ev) {
-  for (int i = 0; i < sizeof(keyboard2)/sizeof(keyboard_key_state2); i++) {
-    if (keyboard2[i].code == ev.code) {
-      keyboard2[i].value = ev.value;
-      if (ev.value == 1)
-        clock_gettime(CLOCK_MONOTONIC, &keyboard2[i].last_time_down);
-    }
-  }
+  keystate_set(&keyboard2, ev.code, ev.value);
+  if (ev.value == 1)
+    clock_gettime(CLOCK_MONOTONIC, &last_time_down[ev.code]);
 }
 
 int physical_state_of(unsigned int k_code) {
-  for (int i = 0; i < sizeof(keyboard2)/sizeof(keyboard_key_state2); i++) {
-    if (keyboard2[i].code == k_code)
-      return keyboard2[i].value;
-  }
-  return -1;
+  return keystate_value(&keyboard2, k_code);
 }
 
 int primary_function_of_key_is_remapped(unsigned int k) {
@@ -677,12 +657,12 @@ void handle_key(struct input_event ev) {
   if (uniquely_active_combo_map_of_key) {
     printf("Handling key of one or more combo maps one of which is currently uniquely active.\n");
     if (ev.value == 1) {
-      //send_key_ev_and_sync(uidev, uniquely_active_combo_map_of_key->mod_from, 0);
+      //send_key_ev(uidev, uniquely_active_combo_map_of_key->mod_from, 0);
       if (uniquely_active_combo_map_of_key->mod_to)
-        //send_key_ev_and_sync(uidev, uniquely_active_combo_map_of_key->mod_to, 1);
+        //send_key_ev(uidev, uniquely_active_combo_map_of_key->mod_to, 1);
         ;
 
-      //send_key_ev_and_sync(uidev, primary_function_of(uniquely_active_combo_map_of_key->key_to), 1);
+      //send_key_ev(uidev, primary_function_of(uniquely_active_combo_map_of_key->key_to), 1);
     } else if (ev.value == 2) {
 
     } else if (ev.value == 0) {
@@ -743,7 +723,7 @@ void handle_key(struct input_event ev) {
   /*     // Do what we do in 06 + change wrt primary function */
   /*     // */
   /*     if (ev.value == 1) { */
-  /*       //send_key_ev_and_sync(uidev, map_of_key->mod_from, 0); */
+  /*       //send_key_ev(uidev, map_of_key->mod_from, 0); */
   /*       printf("<{([*])}>===> send mod_from (0)\n"); */
   /*       if (m_cm_i->mod_to) printf("<{([*])}>===> send mod_to (1)\n"); */
   /*       printf("<{([*])}>===> send key_to (1)\n"); */
@@ -879,6 +859,16 @@ void *track_window() {
   }
 }
 
+// Feed an input event to the engine.
+static void handle_input_event(struct input_event ev) {
+  if (ev.type == EV_KEY)
+    handle_key(ev);
+  else if (ev.type == EV_SYN && ev.code == SYN_REPORT)
+    sync_key_evs(uidev);
+}
+
+#ifndef REMAPPER_NO_MAIN
+
 int
 main(int argc, char **argv)
 {
@@ -929,22 +919,24 @@ main(int argc, char **argv)
     return -errno;
   }
 
+  // A read takes all the events there are (see evbatch.h).
+  evbatch batch = { .fd = fd };
   do {
-    struct input_event ev;
-    rc = libevdev_next_event(dev, LIBEVDEV_READ_FLAG_NORMAL|LIBEVDEV_READ_FLAG_BLOCKING, &ev);
-    if (rc == LIBEVDEV_READ_STATUS_SYNC) {
-      printf("Dropped\n");
-      while (rc == LIBEVDEV_READ_STATUS_SYNC) {
-        rc = libevdev_next_event(dev, LIBEVDEV_READ_FLAG_SYNC, &ev);
+    const struct input_event *frame;
+    size_t n;
+
+    rc = evbatch_read(&batch);
+    while ((n = evbatch_next_frame(&batch, &frame)) > 0) {
+      if (evbatch_is_drop(frame)) {
+        printf("Dropped\n");
+        continue;
       }
-      printf("Re-synced\n");
-    } else if (rc == LIBEVDEV_READ_STATUS_SUCCESS) {
-      if (ev.type == EV_KEY)
-        handle_key(ev);
+      for (size_t i = 0; i < n; i++)
+        handle_input_event(frame[i]);
     }
-  } while (rc == LIBEVDEV_READ_STATUS_SYNC || rc == LIBEVDEV_READ_STATUS_SUCCESS || rc == -EAGAIN);
+  } while (rc >= 0 || rc == -EAGAIN || rc == -EINTR);
 
-  if (rc != LIBEVDEV_READ_STATUS_SUCCESS && rc != -EAGAIN)
+  if (rc != -ENODEV)
     fprintf(stderr, "Failed to handle events: %s\n", strerror(-rc));
 
   rc = 0;
@@ -953,3 +945,5 @@ main(int argc, char **argv)
 
   return rc;
 }
+
+#endif // REMAPPER_NO_MAIN
@@ -34,10 +34,37 @@
   attributing certain keys a secondary function on hold. Originally
   performed by janus-key.]
 
+  (That is now janus_keys: a janus key gets a deadline max_delay after
+  it goes down, kept in a min-heap backing a timerfd, and takes its
+  secondary function when the deadline passes or another key is
+  pressed, whichever comes first.)
+
   ###### ###### ###### ###### ###### ######
 
   Compile with:
-  gcc -g `pkg-config --cflags libevdev` `pkg-config --libs libevdev x11` ./08.c `pkg-config --libs libevdev` -pthread -o 08
+  gcc -g `pkg-config --cflags libevdev` `pkg-config --libs libevdev xcb` ./08.c `pkg-config --libs libevdev` -pthread -o 08
+
+  For a release build (no debug output at all on the event path) add
+  -O2 -DNDEBUG, or pick a log level with -DLOG_LEVEL=LOG_LEVEL_NONE,
+  LOG_LEVEL_INFO or LOG_LEVEL_DEBUG.
+
+  Run with REMAPPER_CONFIG=<file> to read the maps from <file> (see
+  08.conf and parse_config) instead of using the ones compiled in. The
+  compiled keymap is cached in <file>.cache, and <file> is reloaded
+  whenever it changes.
+
+  Run with REMAPPER_FOCUS=static:<class> or socket:<path> to take the
+  focused window from somewhere else than X (see focus_provider).
+
+  Run with REMAPPER_TRACE=<file> to get a trace of input and output
+  key events written to <file> (by a separate thread).
+
+  Send SIGUSR1 to get the key-to-output latency histograms printed to
+  stderr. They are also printed at exit.
+
+  Run with REMAPPER_CONTROL=<path> to be able to look at (and switch)
+  the maps, the keys down, tracing and the latencies through a socket
+  at <path> while it runs (see the control socket).
 
   ###### ###### ###### ###### ###### ######
  */
@@ -48,6 +75,7 @@
 #include <linux/input-event-codes.h>
 #include <linux/input.h>
 #include <stddef.h> // ??
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
@@ -58,37 +86,262 @@
 #include <unistd.h>
 #include "libevdev/libevdev-uinput.h"
 #include "libevdev/libevdev.h"
-#include <X11/X.h>
-#include <X11/Xlib.h>
-#include <X11/Xatom.h>
-#include <X11/Xutil.h>
+#include "evbatch.h"
+#include "keystate.h"
+#include <xcb/xcb.h>
+#include <xcb/xcbext.h>
 #include <pthread.h>
+#include <signal.h>
+#include <dirent.h>
+#include <sys/epoll.h>
+#include <limits.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+
+// Log levels. Messages above LOG_LEVEL are compiled out, so that in a
+// release build handle_key never touches stdio.
+#define LOG_LEVEL_NONE  0
+#define LOG_LEVEL_INFO  1
+#define LOG_LEVEL_DEBUG 2
+
+#ifndef LOG_LEVEL
+#ifdef NDEBUG
+#define LOG_LEVEL LOG_LEVEL_INFO
+#else
+#define LOG_LEVEL LOG_LEVEL_DEBUG
+#endif
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define log_info(...) printf(__VA_ARGS__)
+#else
+#define log_info(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define log_debug(...) printf(__VA_ARGS__)
+#else
+#define log_debug(...) do {} while (0)
+#endif
+
+// Trace of the key events going in and out of the remapper.
+//
+// handle_key only pushes fixed-size records into a single-producer
+// single-consumer ring buffer; trace_thread drains it to the trace
+// file. If the ring is full the record is dropped (and counted)
+// rather than making the input thread wait.
+#define TRACE_RING_SIZE 4096 // must be a power of 2
+
+typedef struct {
+  struct timespec time; // CLOCK_MONOTONIC
+  char direction;       // 'i' for input, 'o' for output
+  unsigned short code;
+  int value;
+} trace_record;
+
+trace_record trace_ring[TRACE_RING_SIZE];
+_Atomic unsigned long trace_head = 0; // written by the input thread
+_Atomic unsigned long trace_tail = 0; // written by trace_thread
+_Atomic unsigned long trace_dropped = 0;
+atomic_bool tracing = 0;
+
+// Whether trace_thread is running (REMAPPER_TRACE), so that tracing
+// can be turned on and off (see the control socket).
+int trace_thread_started = 0;
+
+static void trace_key_ev(char direction, unsigned int code, int value) {
+  if (!atomic_load_explicit(&tracing, memory_order_relaxed))
+    return;
+
+  unsigned long head = atomic_load_explicit(&trace_head, memory_order_relaxed);
+  unsigned long tail = atomic_load_explicit(&trace_tail, memory_order_acquire);
+  if (head - tail == TRACE_RING_SIZE) {
+    atomic_fetch_add_explicit(&trace_dropped, 1, memory_order_relaxed);
+    return;
+  }
+
+  trace_record *r = &trace_ring[head & (TRACE_RING_SIZE - 1)];
+  clock_gettime(CLOCK_MONOTONIC, &r->time);
+  r->direction = direction;
+  r->code = code;
+  r->value = value;
+  atomic_store_explicit(&trace_head, head + 1, memory_order_release);
+}
+
+void *trace_thread(void *arg) {
+  FILE *file = arg;
+  unsigned long reported_dropped = 0;
+
+  while (1) {
+    unsigned long tail = atomic_load_explicit(&trace_tail, memory_order_relaxed);
+    unsigned long head = atomic_load_explicit(&trace_head, memory_order_acquire);
 
-// Keyboard key states lookup table.
+    for (; tail != head; tail++) {
+      trace_record *r = &trace_ring[tail & (TRACE_RING_SIZE - 1)];
+      fprintf(file, "%ld.%09ld %c %u %d\n",
+              (long)r->time.tv_sec, r->time.tv_nsec, r->direction, r->code, r->value);
+    }
+    atomic_store_explicit(&trace_tail, tail, memory_order_release);
+
+    unsigned long dropped = atomic_load_explicit(&trace_dropped, memory_order_relaxed);
+    if (dropped != reported_dropped) {
+      fprintf(file, "dropped %lu\n", dropped - reported_dropped);
+      reported_dropped = dropped;
+    }
+
+    fflush(file);
+    usleep(50000);
+  }
+}
+
+// Latency histograms.
+//
+// For each input frame we take the kernel's timestamp of its key
+// events (the device is switched to CLOCK_MONOTONIC) and, once the
+// frame's output has been written to uinput, record how long it took
+// in the histogram of the path the frame went through.
 //
-// Index n holds the value (1, 2 or 0) of the key whose code is n in
-// /usr/include/linux/input-event-codes.h
+// The histograms are HDR-style: values below 16ns have a bucket
+// each, above that each power of 2 is split in 16 sub-buckets (so a
+// bucket is at most ~6% wide).
+enum latency_path {
+  PATH_PASSTHROUGH, // key sent as is
+  PATH_SINGLE,      // key sent as its primary function
+  PATH_COMBO,       // key or mod of a uniquely active combo map
+  PATH_JANUS,       // janus key (secondary function)
+  PATH_REPEAT,      // key repeat (from when it was due)
+  PATH_COUNT,
+};
+
+char *latency_path_names[] = { "passthrough", "single map", "combo map", "janus", "repeat" };
+
+#define LATENCY_SUB_BITS 4
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+typedef struct {
+  uint64_t buckets[LATENCY_BUCKETS];
+  uint64_t count;
+  uint64_t max;
+} latency_histogram;
+
+latency_histogram latency_histograms[PATH_COUNT];
+
+// Timestamp and path of the input frame being handled.
+uint64_t frame_time_ns;
+enum latency_path frame_path = PATH_PASSTHROUGH;
+
+static unsigned latency_bucket(uint64_t ns) {
+  if (ns < LATENCY_SUB_BUCKETS)
+    return ns;
+  unsigned msb = 63 - __builtin_clzll(ns);
+  return (msb - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS
+         + ((ns >> (msb - LATENCY_SUB_BITS)) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+// Lowest value that falls in bucket b.
+static uint64_t latency_bucket_low(unsigned b) {
+  if (b < LATENCY_SUB_BUCKETS)
+    return b;
+  unsigned msb = b / LATENCY_SUB_BUCKETS + LATENCY_SUB_BITS - 1;
+  uint64_t sub = b % LATENCY_SUB_BUCKETS;
+  return (LATENCY_SUB_BUCKETS + sub) << (msb - LATENCY_SUB_BITS);
+}
+
+static void record_latency(enum latency_path path, uint64_t ns) {
+  latency_histogram *h = &latency_histograms[path];
+  h->buckets[latency_bucket(ns)]++;
+  h->count++;
+  if (ns > h->max)
+    h->max = ns;
+}
+
+static uint64_t monotonic_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Value below which `fraction` of the recorded latencies fall (lower
+// bound of its bucket).
+static uint64_t latency_percentile(latency_histogram *h, uint64_t count, double fraction) {
+  uint64_t seen = 0;
+  uint64_t target = fraction * count;
+  for (unsigned b = 0; b < LATENCY_BUCKETS; b++) {
+    seen += h->buckets[b];
+    if (seen > target)
+      return latency_bucket_low(b);
+  }
+  return h->max;
+}
+
+void dump_latency_histograms(FILE *file) {
+  fprintf(file, "%-12s %10s %10s %10s %10s %10s %10s\n",
+          "path", "count", "p50(us)", "p90(us)", "p99(us)", "p99.9(us)", "max(us)");
+  for (int p = 0; p < PATH_COUNT; p++) {
+    latency_histogram *h = &latency_histograms[p];
+    uint64_t count = h->count;
+    if (count == 0) {
+      fprintf(file, "%-12s %10d\n", latency_path_names[p], 0);
+      continue;
+    }
+    fprintf(file, "%-12s %10lu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+            latency_path_names[p],
+            count,
+            latency_percentile(h, count, 0.5) / 1000.0,
+            latency_percentile(h, count, 0.9) / 1000.0,
+            latency_percentile(h, count, 0.99) / 1000.0,
+            latency_percentile(h, count, 0.999) / 1000.0,
+            h->max / 1000.0);
+  }
+  fflush(file);
+}
+
+// Size of the per-key tables (janus state, logical down counts) and
+// of the dispatch tables. Key codes are indexes in them.
 //
 // I'm including up to 248. Should be enough.
-int keyboard[249];
+#define KEYBOARD_SIZE 249
+
+// Maximum number of input devices grabbed at once.
+#define MAX_DEVICES 16
 
-// 0 is the index of the default window map (in the window_maps array)
-// which represents the set of those key_maps which are valid in any
-// window, unless overruled by a specific window map.
-volatile unsigned int currently_focused_window = 0;
+// Maximum number of clients of the control socket at once.
+#define MAX_CONTROL_CLIENTS 8
 
 struct libevdev_uinput *uidev;
 
+// Where remapped events go: uidev (see uinput_sink), or memory when
+// benchmarking (see 08_bench.c).
+typedef struct output_sink {
+  // Write a frame of n events (the last one being its SYN_REPORT).
+  void (*write_frame)(struct output_sink *sink, const struct input_event *evs, size_t n);
+} output_sink;
+
+output_sink *sink;
+
 typedef struct {
   unsigned int mod_from;
   unsigned int key_from;
   unsigned int mod_to;
   unsigned int key_to;
+  // If not 0, what a combo map sends instead of mod_to and key_to:
+  // macro number `macro` (counting from 1) of the config. See macro.
+  unsigned int macro;
 } key_map;
 
+// repeat_delay and repeat_rate are those of the window's keys (see
+// config), or 0 and 0 for the config's.
 typedef struct {
   char* class_name;
   unsigned int size;
+  unsigned int repeat_delay;
+  unsigned int repeat_rate;
   key_map key_maps[];
 } window_map;
 
@@ -96,9 +349,68 @@ key_map **selected_key_maps;
 unsigned int selected_key_maps_size;
 unsigned int key_maps_of_default_window_map_are_set = 0;
 
+// A run of entries of one of the arenas of a dispatch_table (or of
+// the keymap's macro events).
+typedef struct {
+  unsigned short start;
+  unsigned short count;
+} dispatch_span;
+
+// Per-window dispatch table.
+//
+// There is one of these for each window map. It is compiled (into
+// the keymap, see below) from the merged default+window key_maps
+// (i.e., from what set_selected_key_maps selects for that window),
+// and it is indexed by key code, so that handle_key never has to
+// walk the key_maps.
+//
+// Each span lists its key_maps (or codes) in priority order, i.e.,
+// the same order in which the old code found them by looping
+// backwards over selected_key_maps.
+typedef struct {
+  // Primary function of each key.
+  unsigned short first_fun[KEYBOARD_SIZE];
+
+  // Combo maps (both mod_from and key_from set) by key_from and by
+  // mod_from. Both index the key_map array at offset `combos` of the
+  // keymap.
+  dispatch_span combos_by_key_from[KEYBOARD_SIZE];
+  dispatch_span combos_by_mod_from[KEYBOARD_SIZE];
+  uint32_t combos;
+
+  // Keys which are single-mapped to a code (via either key_to or
+  // mod_to), by that code. Index the unsigned short array at offset
+  // `sources` of the keymap.
+  dispatch_span sources_of[KEYBOARD_SIZE];
+  uint32_t sources;
+
+  // Key repeat (see key_repeat): the delay in milliseconds, and the
+  // interval in microseconds (0 if keys do not repeat).
+  uint32_t repeat_delay;
+  uint32_t repeat_interval;
+} dispatch_table;
+
+// Table of the currently focused window.
+//
+// 0 is the index of the default window map (in the window_maps
+// array) which represents the set of those key_maps which are valid
+// in any window, unless overruled by a specific window map. So this
+// points to the table of window map 0 unless a window with its own
+// window map is focused.
+//
+// set_currently_focused_window (called from the event loop when the
+// focus changes) points it to another table. The tables themselves are
+// never modified: a new config gets a new keymap.
+dispatch_table *active_dispatch_table;
+
+// Table in use for the key event being handled. Set once at the
+// beginning of handle_key.
+dispatch_table *dt;
+
 window_map default_map = {
   "Default",
-  12,
+  13,
+  0, 0,
   {
     //mod_from       key_from      mod_to         key_to
     { 0,             KEY_CAPSLOCK, 0,             KEY_ESC,       },
@@ -114,12 +426,14 @@ window_map default_map = {
     //{ KEY_SYSRQ,     0,            KEY_RIGHTALT,  0,             },
     { 0,             KEY_A,        0,             KEY_RIGHTCTRL, },
     { 0,             KEY_Q,        0,             KEY_F,         },
+    { KEY_RIGHTCTRL, KEY_K,        0,             0,             1 }, // macro kill-line
   }
 };
 
 window_map brave_map = {
   "Brave-browser",
   4,
+  0, 0,
   { // Just some random stuff for tests
     { KEY_RIGHTALT,  KEY_F,        KEY_RIGHTCTRL, KEY_LEFT, },
     { KEY_RIGHTCTRL, KEY_G,        0,             KEY_ESC,  },
@@ -131,6 +445,7 @@ window_map brave_map = {
 window_map foo_map = {
   "this-is-just-for-testing",
   6,
+  500, 10,
   { // Just some random stuff for tests
     { KEY_RIGHTALT,  KEY_F,        KEY_RIGHTCTRL, KEY_LEFT, },
     { KEY_RIGHTCTRL, KEY_G,        0,             KEY_ESC,  },
@@ -183,125 +498,589 @@ window_map* window_maps[] = {
   &foo_map,
 };
 
-void set_currently_focused_window(char* name) {
-  int currently_focused_window_next_value = 0;
+// Janus keys: keys which, besides their primary function (the one
+// the window maps give them), have a secondary function which they
+// take when held down. (What janus-key does.)
+typedef struct {
+  unsigned int key;
+  unsigned int secondary_function;
+} janus_key;
+
+janus_key janus_keys[] = {
+  // key             2nd function
+  {  KEY_CAPSLOCK,   KEY_LEFTALT   },
+  {  KEY_ENTER,      KEY_RIGHTALT  },
+};
 
-  // Start from second element, given that the first is the default
-  // map which always applies.
-  for (int i = 1; i < sizeof(window_maps)/sizeof(window_map*); i++) {
-    if (strcmp(name, window_maps[i]->class_name) == 0) {
-      currently_focused_window_next_value = i;
-      break;
-    }
+// Macros: sequences of chords, which a combo map can send instead of
+// mod_to and key_to. (Things like Emacs' C-k, which takes shift+end,
+// ctrl+x.)
+//
+// The chords are sent one after the other, each in a frame of its
+// own: its keys are pressed in order, then released in the reverse
+// order. The mod_from of the combo is released for the time being.
+typedef struct {
+  char *name;
+  unsigned int size;      // of codes
+  unsigned short codes[]; // the chords, each ended by a 0
+} macro;
+
+// Largest macro, in events (SYN_REPORTs included). A chord of k keys
+// takes 2k+1.
+#define MACRO_MAX_EVENTS 256
+
+// Most mods released around a macro (see play_macro).
+#define MACRO_MAX_HELD 8
+
+macro kill_line = {
+  "kill-line",
+  6,
+  { KEY_LEFTSHIFT, KEY_END, 0, KEY_LEFTCTRL, KEY_X, 0 },
+};
+
+macro* macros[] = {
+  &kill_line,
+};
+
+// Bindings: chords of any number of keys (ctrl+shift+z), and
+// sequences of them (as Emacs' C-x C-s), which send a macro.
+//
+// Each step of a binding is a chord: its last key going down while
+// the others (its mods) are down. As in combo maps, codes are primary
+// functions. Bindings apply in every window, and before the key maps
+// (see handle_sequence_key).
+//
+// None are compiled in: they take keys (and chords) away from the key
+// maps. See 08.conf for some.
+#define CHORD_MAX_KEYS 4
+#define SEQUENCE_MAX_STEPS 4
+
+// Most different mods in the chords of all the bindings.
+#define SEQUENCE_MAX_MODS MACRO_MAX_HELD
+
+typedef struct {
+  unsigned short keys[CHORD_MAX_KEYS]; // the mods, then the key; then 0s
+} chord;
+
+typedef struct {
+  chord steps[SEQUENCE_MAX_STEPS];
+  unsigned int number_of_steps;
+  unsigned int macro; // number of the macro it sends (counting from 1)
+} binding;
+
+// A config: window maps (the first being the default one), janus
+// keys, macros, bindings, max_delay, sequence_timeout and key repeat.
+//
+// max_delay is in milliseconds. A janus key takes its secondary
+// function as soon as it has been held down for max_delay, or as soon
+// as another key is pressed while it is down, whichever comes
+// first. Released before that, it sends its primary function.
+//
+// sequence_timeout is in milliseconds too: a sequence whose next step
+// does not come within it is given up (see handle_sequence_key).
+//
+// A key held down repeats after repeat_delay (in milliseconds),
+// repeat_rate times a second (not at all if 0), unless its window map
+// says otherwise. See key_repeat.
+typedef struct {
+  window_map **window_maps;
+  unsigned int number_of_window_maps;
+  janus_key *janus_keys;
+  unsigned int number_of_janus_keys;
+  macro **macros;
+  unsigned int number_of_macros;
+  binding *bindings;
+  unsigned int number_of_bindings;
+  unsigned int max_delay;
+  unsigned int sequence_timeout;
+  unsigned int repeat_delay;
+  unsigned int repeat_rate;
+} config;
+
+// The config compiled in, used when no config file is given.
+config builtin_config = {
+  window_maps,
+  sizeof(window_maps) / sizeof(window_maps[0]),
+  janus_keys,
+  sizeof(janus_keys) / sizeof(janus_keys[0]),
+  macros,
+  sizeof(macros) / sizeof(macros[0]),
+  NULL,
+  0,
+  300,
+  1000,
+  250,
+  30,
+};
+
+#define CLASS_NAME_SIZE 64
+
+typedef struct {
+  char class_name[CLASS_NAME_SIZE];
+  dispatch_table table;
+} compiled_window_map;
+
+// A slot of the keymap's table of window classes: an open-addressing
+// hash table (linear probing, at most half full) of the window maps
+// by class, so that finding the map of the focused window takes one
+// probe, as a rule, however many window maps there are. An empty slot
+// has window_map 0 (the default one, which no class leads to).
+typedef struct {
+  uint32_t hash; // of the class, see hash_class
+  uint32_t window_map;
+} window_class_slot;
+
+// A config compiled into what handle_key looks things up in.
+//
+// It is a single block of memory with no pointers in it (only offsets
+// from its beginning), so that it can be written to a cache file as
+// is, and mmap'd back from it without any parsing. See load_keymap.
+#define KEYMAP_MAGIC "08KEYMP5"
+
+// An edge of the trie bindings are compiled into: from node `node`,
+// the chord of key `key` with mods `mods` (bit i for the keymap's
+// sequence_mods[i]) leads to node `child`.
+//
+// The edges are in a hash table (open addressing, linear probing, at
+// most half full) by node, key and mods, so that following one takes
+// the same time however many bindings there are. An empty slot has
+// child 0 (the root, which is nobody's child).
+typedef struct {
+  unsigned short node;
+  unsigned short key;
+  unsigned short mods;
+  unsigned short child;
+} sequence_edge;
+
+typedef struct {
+  char magic[8];
+  uint32_t size;          // of the whole block
+  uint32_t keyboard_size; // KEYBOARD_SIZE it was compiled with
+
+  // Size and modification time of the config file it was compiled
+  // from (if any), so that a stale cache can be told apart.
+  int64_t config_size;
+  int64_t config_mtime_ns;
+
+  uint32_t max_delay;
+  uint32_t number_of_window_maps;
+  uint32_t window_maps;   // offset of compiled_window_map[]
+  uint32_t window_classes_mask; // slots in the window classes' table - 1
+  uint32_t window_classes;      // offset of window_class_slot[]
+  uint32_t number_of_janus_keys;
+  uint32_t janus_keys;    // offset of janus_key[]
+
+  // Macros, compiled into the events they send. Each of the spans
+  // (one per macro) is a run of the events.
+  uint32_t number_of_macros;
+  uint32_t macros;        // offset of dispatch_span[]
+  uint32_t number_of_macro_events;
+  uint32_t macro_events;  // offset of struct input_event[]
+
+  // Bindings, compiled into a trie: node 0 is the root, and each node
+  // has the macro it sends (0 for the nodes which are not the end of
+  // a binding).
+  uint32_t sequence_timeout;
+  uint32_t number_of_sequence_nodes;
+  uint32_t sequence_macros;      // offset of unsigned short[] (by node)
+  uint32_t sequence_edges_mask;  // slots in the edges' table - 1
+  uint32_t sequence_edges;       // offset of sequence_edge[]
+  uint32_t number_of_sequence_mods;
+  unsigned short sequence_mods[SEQUENCE_MAX_MODS];
+
+  // Bit of each mod of the bindings, plus 1 (0 for keys which are
+  // not).
+  unsigned char sequence_mod_bit[KEYBOARD_SIZE];
+
+  // Secondary function of each key (0 for keys which are not janus).
+  unsigned short secondary_fun[KEYBOARD_SIZE];
+} keymap;
+
+// The keymap in use. Replaced (between key events) when the config
+// file changes.
+keymap *km;
+
+#define KEYMAP_AT(type, offset) ((type *)((char *)km + (offset)))
+
+static compiled_window_map *compiled_window_maps() {
+  return KEYMAP_AT(compiled_window_map, km->window_maps);
+}
+
+static janus_key *compiled_janus_keys() {
+  return KEYMAP_AT(janus_key, km->janus_keys);
+}
+
+static dispatch_span *compiled_macros() {
+  return KEYMAP_AT(dispatch_span, km->macros);
+}
+
+static struct input_event *compiled_macro_events() {
+  return KEYMAP_AT(struct input_event, km->macro_events);
+}
+
+// FNV-1a.
+static uint32_t hash_class(const char *name) {
+  uint32_t h = 2166136261u;
+  for (; *name; name++)
+    h = (h ^ (unsigned char)*name) * 16777619u;
+  return h;
+}
+
+// Index of the window map of class name, or 0 (the default one) if
+// there is none.
+static unsigned int find_window_map(const char *name) {
+  uint32_t h = hash_class(name);
+  window_class_slot *slots = KEYMAP_AT(window_class_slot, km->window_classes);
+  compiled_window_map *cwm = compiled_window_maps();
+
+  for (uint32_t i = h & km->window_classes_mask; slots[i].window_map; i = (i + 1) & km->window_classes_mask) {
+    if (slots[i].hash == h && strcmp(cwm[slots[i].window_map].class_name, name) == 0)
+      return slots[i].window_map;
   }
+  return 0;
+}
+
+// Class of the focused window, kept so that the focused window's
+// table can be looked up again in a new keymap.
+char focused_window_class[CLASS_NAME_SIZE] = "";
+
+// Index of the window map of active_dispatch_table.
+unsigned int focused_window_map = 0;
+
+void set_currently_focused_window(char* name) {
+  if (name != focused_window_class)
+    snprintf(focused_window_class, sizeof(focused_window_class), "%s", name);
 
-  currently_focused_window = currently_focused_window_next_value;
-  printf("currently_focused_window set to %d\n", currently_focused_window_next_value);
+  // (The default map, 0, always applies: no class leads to it.)
+  int currently_focused_window_next_value = find_window_map(name);
+
+  compiled_window_map *cwm = compiled_window_maps();
+  focused_window_map = currently_focused_window_next_value;
+  active_dispatch_table = &cwm[currently_focused_window_next_value].table;
+  log_info("currently_focused_window set to %d\n", currently_focused_window_next_value);
+}
+
+// Where focus changes come from. Which provider, and its argument, is
+// given as REMAPPER_FOCUS=<name>[:<arg>] (default: x11):
+//
+// - x11: the _NET_ACTIVE_WINDOW of the X server (of DISPLAY), and the
+//   WM_CLASS of the window it names.
+// - static:<class>: the window map of <class>, for good (or the
+//   default one, with no class). For a session with no focus to track,
+//   or no way to track it.
+// - socket:<path>: classes pushed by another program (a compositor's
+//   plugin, a script, a test) to a Unix datagram socket at <path>.
+//
+// A provider gives the event loop a file descriptor, which is waited
+// on with the keyboards (SOURCE_FOCUS): a focus change is handled
+// between two key events, as one more event. Providers call
+// set_currently_focused_window, and nothing else of the engine.
+typedef struct focus_provider {
+  const char *name;
+  // Start tracking the focus. Return the fd to wait on (-1 if there is
+  // none: the focus never changes), or exit if it cannot be done.
+  int (*open)(struct focus_provider *provider, const char *arg);
+  // Called when the fd is readable (and once after open): make the
+  // focus changes that have come in.
+  void (*handle_events)(struct focus_provider *provider);
+} focus_provider;
+
+focus_provider *focus;
+
+// X state used to track the focused window.
+//
+// Nothing here waits on the X server: requests go out as cookies, and
+// their replies are picked up by handle_x_events when the connection
+// is readable, as the events are. A focus change costs one round trip
+// (_NET_ACTIVE_WINDOW) when the window's class is cached, two
+// (WM_CLASS as well) when it is not (see window_cache).
+xcb_connection_t *x_connection;
+xcb_window_t root_window;
+xcb_atom_t active_window_atom;
+
+// The requests in flight. A newer focus change supersedes the one
+// before it: its request is sent right away, and the older reply is
+// discarded (xcb frees it as it comes in).
+xcb_get_property_cookie_t active_window_cookie;
+int active_window_pending;
+xcb_get_property_cookie_t class_cookie;
+xcb_window_t class_window;
+int class_pending;
+
+// WM_CLASS is the instance name and then the class name, each ended by
+// a NUL: that much is read of it, in 4-byte units.
+#define WM_CLASS_LENGTH 64
+
+static void request_active_window() {
+  if (active_window_pending)
+    xcb_discard_reply(x_connection, active_window_cookie.sequence);
+  active_window_cookie = xcb_get_property(x_connection, 0, root_window, active_window_atom,
+                                          XCB_ATOM_WINDOW, 0, 1);
+  active_window_pending = 1;
 }
 
-void *track_window() {
-  Display* display;
-  XEvent xevent;
-  char *display_name = getenv("DISPLAY");
-  display = XOpenDisplay(display_name);
-  if (display == NULL) {
+static int open_display(focus_provider *provider, const char *arg) {
+  x_connection = xcb_connect(NULL, NULL);
+  if (xcb_connection_has_error(x_connection)) {
     printf("display null\n");
     exit(1);
   }
-  Window root_window = DefaultRootWindow(display);
-  Atom active_window_atom = XInternAtom(display, "_NET_ACTIVE_WINDOW", False);
-  XSelectInput(display, root_window, PropertyChangeMask);
-  // return values
-  Atom type_return;
-  int format_return;
-  unsigned long nitems_return;
-  unsigned long bytes_left;
-  unsigned char *data;
-
-  // Get name of the focused window window at startup
-  XGetWindowProperty(display,
-                     root_window,
-                     active_window_atom,
-                     0,
-                     1,
-                     False,
-                     XA_WINDOW,
-                     &type_return,   //should be XA_WINDOW
-                     &format_return, //should be 32
-                     &nitems_return, //should be 1 (zero if there is no such window)
-                     &bytes_left,    //should be 0 (i'm not sure but should be atomic read)
-                     &data           //should be non-null
-		     );
-  Window focused_window = *(Window *)data;
-  if (focused_window) {
-    char* window_name1;
-    if (XFetchName(display, focused_window, &window_name1) != 0) {
-      printf("The active window is: %s\n", window_name1);
-      XFree(window_name1);
-    }
-    XClassHint class_hint;
-    if (XGetClassHint(display, focused_window, &class_hint)) {
-      char *window_class = class_hint.res_class;
-      char *window_name2 = class_hint.res_name;
-      printf("res.class = %s\n", window_class);
-      printf("res.name = %s\n", window_name2);
-      printf("\n\n");
-
-      set_currently_focused_window(window_class);
-    }
-  }
-
-  // Get name of the focused window window when focus changes
-  while (1) {
-    XNextEvent(display, &xevent);
+  root_window = xcb_setup_roots_iterator(xcb_get_setup(x_connection)).data->root;
 
-    if (xevent.xproperty.atom != active_window_atom)
-      continue;
+  // (Both go out together: one round trip.)
+  xcb_intern_atom_cookie_t atom_cookie = xcb_intern_atom(x_connection, 0, strlen("_NET_ACTIVE_WINDOW"), "_NET_ACTIVE_WINDOW");
+  uint32_t event_mask = XCB_EVENT_MASK_PROPERTY_CHANGE;
+  xcb_change_window_attributes(x_connection, root_window, XCB_CW_EVENT_MASK, &event_mask);
 
-    XGetWindowProperty(display,
-                       root_window,
-                       active_window_atom,
-                       0,
-                       1,
-                       False,
-                       XA_WINDOW,
-                       &type_return,   //should be XA_WINDOW
-                       &format_return, //should be 32
-                       &nitems_return, //should be 1 (zero if there is no such window)
-                       &bytes_left,    //should be 0 (i'm not sure but should be atomic read)
-                       &data           //should be non-null
-		       );
-
-    Window focused_window = *(Window *)data;
-
-    if (focused_window == 0)
-      continue;
+  xcb_intern_atom_reply_t *atom = xcb_intern_atom_reply(x_connection, atom_cookie, NULL);
+  if (atom == NULL) {
+    printf("display null\n");
+    exit(1);
+  }
+  active_window_atom = atom->atom;
+  free(atom);
+
+  // The window focused now: its reply comes through handle_x_events
+  // like any other.
+  request_active_window();
+  xcb_flush(x_connection);
+  return xcb_get_file_descriptor(x_connection);
+}
 
-    char* window_name1;
-    if (XFetchName(display, focused_window, &window_name1) != 0) {
-      printf("The active window is: %s\n", window_name1);
-      XFree(window_name1);
-    }
-    XClassHint class_hint;
-    if (XGetClassHint(display, focused_window, &class_hint) == 0)
-      continue;
-    char *window_class = class_hint.res_class;
-    char *window_name2 = class_hint.res_name;
-    printf("res.class = %s\n", window_class);
-    printf("res.name = %s\n", window_name2);
-    printf("\n\n");
+// Classes of the windows focused lately, by window ID, so that
+// focusing a window again takes its map right away, on the reply
+// which says which window it is. Direct-mapped: a window takes the
+// place of the one before it in its slot.
+//
+// A hit is not the last word, though: X gives the IDs of a client
+// gone to the next client that connects, so the window may be a new
+// one of another app. Its class is asked for all the same (with the
+// request after it, no round trip of its own), and the map is put
+// right if the class has changed.
+#define WINDOW_CACHE_SIZE 64
 
-    set_currently_focused_window(window_class);
+typedef struct {
+  xcb_window_t id;
+  char class_name[CLASS_NAME_SIZE];
+} cached_window;
+
+cached_window window_cache[WINDOW_CACHE_SIZE];
+
+static cached_window *window_cache_slot(xcb_window_t id) {
+  // (The low bits of an ID are a counter of its client, the high ones
+  // tell the clients apart.)
+  return &window_cache[(id ^ id >> 21) % WINDOW_CACHE_SIZE];
+}
+
+// Set the focused window to window (by its cached class, if any), and
+// ask X for its class.
+static void focus_window(xcb_window_t window) {
+  cached_window *cached = window_cache_slot(window);
+  if (cached->id == window)
+    set_currently_focused_window(cached->class_name);
+
+  // (A class asked for before is of no use any more.)
+  if (class_pending)
+    xcb_discard_reply(x_connection, class_cookie.sequence);
+  class_cookie = xcb_get_property(x_connection, 0, window, XCB_ATOM_WM_CLASS,
+                                  XCB_ATOM_STRING, 0, WM_CLASS_LENGTH);
+  class_window = window;
+  class_pending = 1;
+}
+
+// The reply to a _NET_ACTIVE_WINDOW request.
+static void handle_active_window(xcb_get_property_reply_t *reply) {
+  if (reply == NULL || reply->format != 32 || xcb_get_property_value_length(reply) < 4)
+    return; // no window is focused
+
+  xcb_window_t window = *(xcb_window_t *)xcb_get_property_value(reply);
+  if (window != 0)
+    focus_window(window);
+}
+
+// class_window has no class (none that can be read): it takes the
+// default map, and whatever a window of its ID had before is
+// forgotten.
+static void focus_classless_window() {
+  cached_window *cached = window_cache_slot(class_window);
+  if (cached->id == class_window)
+    cached->id = 0;
+
+  set_currently_focused_window("");
+}
+
+// The reply to a WM_CLASS request.
+static void handle_window_class(xcb_get_property_reply_t *reply) {
+  if (reply == NULL || reply->format != 8) {
+    focus_classless_window();
+    return;
+  }
+
+  const char *value = xcb_get_property_value(reply);
+  int length = xcb_get_property_value_length(reply);
+  const char *instance_end = memchr(value, '\0', length);
+  if (instance_end == NULL) {
+    focus_classless_window();
+    return;
   }
+  const char *class_name = instance_end + 1;
+  int class_length = length - (class_name - value);
+  // (The NUL at the end may be missing.)
+  const char *class_end = memchr(class_name, '\0', class_length);
+  if (class_end)
+    class_length = class_end - class_name;
+  log_debug("res.class = %.*s\n", class_length, class_name);
+  log_debug("res.name = %s\n", value);
+
+  char name[CLASS_NAME_SIZE];
+  snprintf(name, sizeof(name), "%.*s", class_length, class_name);
+  cached_window *cached = window_cache_slot(class_window);
+  if (cached->id == class_window && strcmp(cached->class_name, name) == 0)
+    return; // (its map is in use already)
+  cached->id = class_window;
+  strcpy(cached->class_name, name);
+
+  set_currently_focused_window(cached->class_name);
 }
 
-void set_keyboard_state(struct input_event ev) {
-  keyboard[ev.code] = ev.value;
+// Pick up the replies that have come in. Return whether there were
+// any.
+static int poll_x_replies() {
+  int replied = 0;
+  void *reply;
+  xcb_generic_error_t *error;
+
+  if (active_window_pending &&
+      xcb_poll_for_reply(x_connection, active_window_cookie.sequence, &reply, &error)) {
+    active_window_pending = 0;
+    replied = 1;
+    handle_active_window(reply);
+    free(reply);
+    free(error);
+  }
+
+  if (class_pending &&
+      xcb_poll_for_reply(x_connection, class_cookie.sequence, &reply, &error)) {
+    class_pending = 0;
+    replied = 1;
+    handle_window_class(reply);
+    free(reply);
+    free(error);
+  }
+
+  return replied;
 }
 
-unsigned is_physically_down(int code) {
-  // 1 and 2 means down, 0 means up. so we can just return that value.
-  return keyboard[code];
+static void handle_x_event(xcb_generic_event_t *event) {
+  if ((event->response_type & ~0x80) == XCB_PROPERTY_NOTIFY &&
+      ((xcb_property_notify_event_t *)event)->atom == active_window_atom)
+    request_active_window();
+  free(event);
+}
+
+// Handle the X events and replies xcb has read (or can read without
+// blocking): the focus changes.
+//
+// Called when the X connection is readable. xcb reads whatever has
+// come in, events and replies alike, into its own queues, so we keep
+// going until both are empty, or epoll would not tell us about them.
+// The requests the events and replies lead to are sent on the way out.
+static void handle_x_events(focus_provider *provider) {
+  xcb_generic_event_t *event;
+
+  do {
+    while ((event = xcb_poll_for_event(x_connection)))
+      handle_x_event(event);
+  } while (poll_x_replies());
+
+  // (Polling for a reply may have read events.)
+  while ((event = xcb_poll_for_queued_event(x_connection)))
+    handle_x_event(event);
+
+  xcb_flush(x_connection);
+
+  if (xcb_connection_has_error(x_connection)) {
+    fprintf(stderr, "Lost the connection to X\n");
+    exit(1);
+  }
+}
+
+static int open_static_focus(focus_provider *provider, const char *arg) {
+  set_currently_focused_window(arg ? (char *)arg : "");
+  return -1;
+}
+
+// The socket of the socket provider. Each datagram is the class of
+// the window focused (a newline at the end is ignored), so a focus
+// change is a single message: e.g.
+//
+//   printf Brave-browser | socat - UNIX-SENDTO:<path>
+//
+// Whoever can write to the socket can switch window maps: put it in a
+// directory only the session's user can get to.
+int focus_socket_fd = -1;
+
+static int open_focus_socket(focus_provider *provider, const char *path) {
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  if (path == NULL || *path == '\0' || strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Expected REMAPPER_FOCUS=socket:<path>\n");
+    exit(1);
+  }
+  strcpy(addr.sun_path, path);
+
+  focus_socket_fd = socket(AF_UNIX, SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+  // (A socket left by an earlier run would be in the way.)
+  unlink(path);
+  if (focus_socket_fd < 0 || bind(focus_socket_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("Failed to open focus socket");
+    exit(1);
+  }
+  log_info("Waiting for focus changes on %s\n", path);
+  return focus_socket_fd;
+}
+
+// Only the last of the focus changes that have come in is made: the
+// ones before it would be undone before any key could use them.
+static void handle_focus_socket(focus_provider *provider) {
+  char class_name[CLASS_NAME_SIZE + 1];
+  ssize_t len, last = -1;
+
+  while ((len = recv(focus_socket_fd, class_name, sizeof(class_name) - 1, 0)) >= 0)
+    last = len;
+  if (errno != EAGAIN)
+    perror("Failed to read focus socket");
+  if (last < 0)
+    return;
+
+  // (recv leaves the buffer as the last datagram left it.)
+  class_name[last] = '\0';
+  if (last > 0 && class_name[last - 1] == '\n')
+    class_name[last - 1] = '\0';
+  set_currently_focused_window(class_name);
+}
+
+focus_provider focus_providers[] = {
+  { "x11", open_display, handle_x_events },
+  { "static", open_static_focus, NULL },
+  { "socket", open_focus_socket, handle_focus_socket },
+};
+
+// Start the provider spec (<name>[:<arg>]) names. Return the fd to
+// wait on, or -1.
+static int open_focus_provider(const char *spec) {
+  size_t name_length = strcspn(spec, ":");
+  const char *arg = spec[name_length] == ':' ? spec + name_length + 1 : NULL;
+
+  for (size_t i = 0; i < sizeof(focus_providers) / sizeof(focus_providers[0]); i++) {
+    if (strlen(focus_providers[i].name) == name_length
+        && strncmp(focus_providers[i].name, spec, name_length) == 0) {
+      focus = &focus_providers[i];
+      return focus->open(focus, arg);
+    }
+  }
+
+  fprintf(stderr, "No such focus provider: %s (x11, static or socket)\n", spec);
+  exit(1);
 }
 
 /* void set_keyboard2_state(struct input_event ev) { */
@@ -314,10 +1093,10 @@ unsigned is_physically_down(int code) {
 /*   } */
 /* } */
 
-static void set_selected_key_maps() {
-  unsigned int i = currently_focused_window;
+static void set_selected_key_maps(config *c, unsigned int i) {
+  window_map **window_maps = c->window_maps;
 
-  if (!key_maps_of_default_window_map_are_set) { // we want to do this only once
+  if (!key_maps_of_default_window_map_are_set) { // we want to do this only once (per config)
       for (size_t j = 0; j < window_maps[0]->size; j++) {
         selected_key_maps[j] = &window_maps[0]->key_maps[j];
       }
@@ -336,31 +1115,106 @@ static void set_selected_key_maps() {
 }
 
 // Return primary function of code
-//
-// loop backwards
 unsigned first_fun(unsigned code) {
-  for (size_t i = selected_key_maps_size-1; i != SIZE_MAX; i--) {
-    if ((selected_key_maps[i]->key_from == code
-         &&
-         !selected_key_maps[i]->mod_from)
-        ||
-        (selected_key_maps[i]->mod_from == code
-         &&
-         !selected_key_maps[i]->key_from))
-      {
-        if (selected_key_maps[i]->key_to) {
-          return selected_key_maps[i]->key_to;
-        } else if (selected_key_maps[i]->mod_to) {
-          return selected_key_maps[i]->mod_to;
-        } else {
-          fprintf(stderr, "first_fun: Error. There is neither a key_to nor a mod_to\n");
-        }
-      }
-  }
+  if (code >= KEYBOARD_SIZE)
+    return code;
+  return dt->first_fun[code];
+};
+
+#define KEYBOARD_WORDS ((KEYBOARD_SIZE + 63) / 64)
 
-  return code;
+enum janus_state {
+  JANUS_UP,
+  JANUS_PENDING, // down, function not decided yet
+  JANUS_HELD,    // down, with its secondary function
 };
 
+// State of the keys of a keyboard. Each input device has its own.
+typedef struct {
+  // The value (1, 2 or 0) each key had last, as set_keyboard_state
+  // got it (see keystate.h).
+  keystate physical;
+
+  // Kept up to date by set_keyboard_state, from physical.
+  //
+  // Key n is in logically_down when at least one physically down key
+  // has n as its primary function; logically_down_count[n] says how
+  // many.
+  keyset logically_down;
+  unsigned char logically_down_count[KEYBOARD_SIZE];
+
+  // State of each janus key (JANUS_UP, JANUS_PENDING or JANUS_HELD),
+  // and how many are JANUS_PENDING. Janus keys do not go through
+  // set_keyboard_state: they only count as logically down (as their
+  // secondary function) once held.
+  //
+  // held_as is the secondary function a JANUS_HELD key was held as
+  // (which is what it releases, even if the config has changed
+  // since).
+  unsigned char janus[KEYBOARD_SIZE];
+  unsigned short held_as[KEYBOARD_SIZE];
+  unsigned int pending_janus_keys;
+
+  // Table logically_down has been computed with.
+  dispatch_table *dt;
+} key_state;
+
+// State of the keyboard the key event being handled comes from. Set
+// by the event loop before calling handle_key.
+key_state *ks;
+
+unsigned is_physically_down(int code) {
+  // 1 and 2 means down, 0 means up. so we can just return that value.
+  return keystate_value(&ks->physical, code);
+}
+
+static void logically_press_fun(unsigned f) {
+  if (ks->logically_down_count[f]++ == 0)
+    keyset_add(&ks->logically_down, f);
+}
+
+static void logically_release_fun(unsigned f) {
+  if (--ks->logically_down_count[f] == 0)
+    keyset_remove(&ks->logically_down, f);
+}
+
+static void logically_press(unsigned code) {
+  logically_press_fun(first_fun(code));
+}
+
+static void logically_release(unsigned code) {
+  logically_release_fun(first_fun(code));
+}
+
+void set_keyboard_state(struct input_event ev) {
+  unsigned was_down = keystate_is_down(&ks->physical, ev.code);
+  unsigned is_down = ev.value != 0;
+
+  keystate_set(&ks->physical, ev.code, ev.value);
+
+  if (is_down && !was_down)
+    logically_press(ev.code);
+  else if (!is_down && was_down)
+    logically_release(ev.code);
+}
+
+// The primary functions of the keys depend on dt, so logically_down
+// must be recomputed (from the physical state) when dt changes.
+static void recompute_logically_down() {
+  memset(&ks->logically_down, 0, sizeof(ks->logically_down));
+  memset(ks->logically_down_count, 0, sizeof(ks->logically_down_count));
+  ks->dt = dt;
+
+  const keyset *down = &ks->physical.down;
+  for (unsigned c = keyset_next(down, 0); c < KEY_CNT; c = keyset_next(down, c + 1))
+    logically_press(c);
+
+  for (size_t c = 0; c < KEYBOARD_SIZE; c++) {
+    if (ks->janus[c] == JANUS_HELD)
+      logically_press_fun(ks->held_as[c]);
+  }
+}
+
 unsigned is_logically_down_first(unsigned code) {
   // A key is considered logically down, if there is a single key
   // mapped to it which is physically down.
@@ -466,38 +1320,32 @@ unsigned is_in_array(unsigned *arr, unsigned size, unsigned code) {
 // 3rd sketch
 // looping backward seems the right thing to do
 // TODO: test with non-default window map
+//
+// (The backward loop now happens once, when the dispatch table is
+// compiled: sources_of[code] is already in that order.)
 unsigned is_logically_down(unsigned code) {
 
+  if (code >= KEYBOARD_SIZE)
+    return 0;
+
+  // Held janus keys are down as their secondary function.
+  janus_key *jk = compiled_janus_keys();
+  for (size_t j = 0; j < km->number_of_janus_keys; j++) {
+    if (ks->janus[jk[j].key] == JANUS_HELD && ks->held_as[jk[j].key] == code)
+      return jk[j].key;
+  }
+
   if (first_fun(code) == code) {
     if (is_physically_down(code)) {
       return code;
     }
   }
 
-  for (size_t i = selected_key_maps_size-1; i != SIZE_MAX; i--) {
-    if (selected_key_maps[i]->key_to == code
-        && selected_key_maps[i]->key_from
-        && !selected_key_maps[i]->mod_from
-        && is_physically_down(selected_key_maps[i]->key_from))
-      return selected_key_maps[i]->key_from;
-
-    if (selected_key_maps[i]->key_to == code
-        && !selected_key_maps[i]->key_from
-        && selected_key_maps[i]->mod_from
-        && is_physically_down(selected_key_maps[i]->mod_from))
-      return selected_key_maps[i]->mod_from;
-
-    if (selected_key_maps[i]->mod_to == code
-        && !selected_key_maps[i]->key_from
-        && selected_key_maps[i]->mod_from
-        && is_physically_down(selected_key_maps[i]->mod_from))
-      return selected_key_maps[i]->mod_from;
-
-    if (selected_key_maps[i]->mod_to == code
-        && selected_key_maps[i]->key_from
-        && !selected_key_maps[i]->mod_from
-        && is_physically_down(selected_key_maps[i]->key_from))
-      return selected_key_maps[i]->key_from;
+  unsigned short *sources = KEYMAP_AT(unsigned short, dt->sources);
+  dispatch_span s = dt->sources_of[code];
+  for (size_t i = s.start; i < s.start + s.count; i++) {
+    if (is_physically_down(sources[i]))
+      return sources[i];
   }
 
   return 0;
@@ -530,16 +1378,18 @@ unsigned is_key_from_in_more_than_one_selected_keymap_with_mod_from_logically_do
 
 // nokild: no-other-key-is-logically-down (besides first fun of
 // mod_from and first fun of key_from)
+//
+// I.e., logically_down must have no keys but mod_from and key_from.
 unsigned nokild(unsigned mod_from, unsigned key_from) {
+  keyset allowed = {0};
 
-  for (size_t i = 0; i < 249; i++) {
-    if (keyboard[i]) {
-      if (first_fun(i) != mod_from
-          && first_fun(i) != key_from) {
-        return 0;
-      }
-    }
-  }
+  if (mod_from < KEYBOARD_SIZE)
+    keyset_add(&allowed, mod_from);
+  if (key_from < KEYBOARD_SIZE)
+    keyset_add(&allowed, key_from);
+
+  if (!keyset_none_but(&ks->logically_down, &allowed))
+    return 0;
 
   // At the moment if there are more than one key down which bound to
   // key_from, this function return true. We might want to change
@@ -610,24 +1460,49 @@ static key_map* is_key_in_uniquely_active_combo_map(unsigned code) {
   // let's loop backwards so we just take the first match if any
   // (because the non-default window map, whose key maps have
   // precedence, comes later, if present)
-  for(size_t i = selected_key_maps_size-1; i != SIZE_MAX; i--) {
+  //
+  // (combos_by_key_from is already in that order.)
+  unsigned f = first_fun(code);
+  if (f >= KEYBOARD_SIZE)
+    return 0;
 
-    if (selected_key_maps[i]->key_from == first_fun(code)) {
+  key_map *combos = KEYMAP_AT(key_map, dt->combos);
+  dispatch_span s = dt->combos_by_key_from[f];
+  for (size_t i = s.start; i < s.start + s.count; i++) {
 
-      if (selected_key_maps[i]->mod_from) {
+    if (is_logically_down(combos[i].mod_from)) {
 
-        if (is_logically_down(selected_key_maps[i]->mod_from)) {
+      if (nokild(combos[i].mod_from, code)) {
+        return &combos[i];
+      } else {
+        return 0; // if we are here there can't be any other
+        // relevant combo map, so return 0. (we are only dealing with
+        // combo maps of two keys for now)
+      }
 
-          if (nokild(selected_key_maps[i]->mod_from, code)) {
-            return selected_key_maps[i];
-          } else {
-            return 0; // if we are here there can't be any other
-            // relevant combo map, so return 0. (we are only dealing with
-            // combo maps of two keys for now)
-          }
+    }
 
-        }
+  }
+
+  return 0;
+}
+
+// analogously to is_key_in_uniquely_active_combo_map
+static key_map* is_mod_in_uniquely_active_combo_map(unsigned code) {
+  unsigned f = first_fun(code);
+  if (f >= KEYBOARD_SIZE)
+    return 0;
+
+  key_map *combos = KEYMAP_AT(key_map, dt->combos);
+  dispatch_span s = dt->combos_by_mod_from[f];
+  for (size_t i = s.start; i < s.start + s.count; i++) {
 
+    if (is_logically_down(combos[i].key_from)) {
+
+      if (nokild(code, combos[i].key_from)) {
+        return &combos[i];
+      } else {
+        return 0;
       }
 
     }
@@ -637,69 +1512,537 @@ static key_map* is_key_in_uniquely_active_combo_map(unsigned code) {
   return 0;
 }
 
-// analogously to is_key_in_uniquely_active_combo_map
-static key_map* is_mod_in_uniquely_active_combo_map(unsigned code) {
+// Janus keys whose function is not decided yet, in a min-heap by
+// deadline (the time they take their secondary function, unless
+// something else decides first). timer_fd is always armed for the
+// earliest deadline, or for an earlier one (see arm_timer).
+//
+// There is at most one entry per janus key per device, so the heap
+// is tiny, and entries are looked for linearly when they have to be
+// removed before their deadline.
+typedef struct {
+  uint64_t deadline; // ns, CLOCK_MONOTONIC
+  key_state *ks;
+  unsigned short code;
+} janus_deadline;
+
+janus_deadline *janus_heap;
+unsigned int janus_heap_size = 0;
+
+int timer_fd = -1;
+
+// When the sequence being typed is given up (0 if none is). See
+// handle_sequence_key.
+uint64_t sequence_deadline = 0;
+
+// Key repeat. The keyboards' own repeats (value 2) are dropped (see
+// handle_key); instead, the key last sent down repeats, as the kernel
+// would repeat it: from the window's repeat_delay after it was sent
+// down, every repeat_interval, until it is sent up or another key is
+// sent down. A repeat is written as is: the mapping was done once, for
+// the press.
+//
+// A combo sending a macro repeats the macro instead, for as long as
+// its key and mod are down (see repeat_macro).
+typedef struct {
+  unsigned short code;  // key repeating, or
+  unsigned int macro;   // macro repeating (0 if none),
+  unsigned short mod;   // played with mod held, while key and mod are
+  unsigned short key;   // down on ks
+  key_state *ks;
+  uint64_t interval;    // ns
+  uint64_t deadline;    // of the next repeat (0 if none)
+} key_repeat;
+
+key_repeat repeat;
+
+// What timer_fd is armed for (0 if it is not).
+uint64_t timer_deadline = 0;
+
+static void janus_heap_swap(unsigned int a, unsigned int b) {
+  janus_deadline tmp = janus_heap[a];
+  janus_heap[a] = janus_heap[b];
+  janus_heap[b] = tmp;
+}
 
-  for (size_t i = selected_key_maps_size-1; i != SIZE_MAX; i--) {
+static void janus_heap_push(janus_deadline d) {
+  unsigned int i = janus_heap_size++;
+  janus_heap[i] = d;
+  while (i > 0 && janus_heap[(i - 1) / 2].deadline > janus_heap[i].deadline) {
+    janus_heap_swap(i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
 
-    if (selected_key_maps[i]->mod_from == first_fun(code)) {
+static void janus_heap_remove(unsigned int i) {
+  janus_heap[i] = janus_heap[--janus_heap_size];
 
-      if (selected_key_maps[i]->key_from) {
+  while (i > 0 && janus_heap[(i - 1) / 2].deadline > janus_heap[i].deadline) {
+    janus_heap_swap(i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+  for (;;) {
+    unsigned int min = i;
+    unsigned int l = 2 * i + 1, r = 2 * i + 2;
+    if (l < janus_heap_size && janus_heap[l].deadline < janus_heap[min].deadline)
+      min = l;
+    if (r < janus_heap_size && janus_heap[r].deadline < janus_heap[min].deadline)
+      min = r;
+    if (min == i)
+      break;
+    janus_heap_swap(i, min);
+    i = min;
+  }
+}
 
-        if (is_logically_down(selected_key_maps[i]->key_from)) {
+// Arm timer_fd for the earliest deadline, of the janus keys', the
+// sequence's or the repeat's.
+//
+// The timer is only ever moved earlier. A deadline which goes away (a
+// janus key tapped, a key released) leaves it to expire for nothing,
+// and a later one waits for it to: handle_timer arms it again. Most
+// key presses then cost no timerfd_settime, although nearly all of
+// them set a repeat deadline.
+static void arm_timer() {
+  uint64_t deadline = sequence_deadline;
+
+  if (janus_heap_size > 0 && (deadline == 0 || janus_heap[0].deadline < deadline))
+    deadline = janus_heap[0].deadline;
+  if (repeat.deadline && (deadline == 0 || repeat.deadline < deadline))
+    deadline = repeat.deadline;
+
+  if (deadline == 0 || (timer_deadline && timer_deadline <= deadline))
+    return;
+
+  struct itimerspec spec = {0};
+  spec.it_value.tv_sec = deadline / 1000000000;
+  spec.it_value.tv_nsec = deadline % 1000000000;
+  if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0)
+    perror("Failed to arm timer");
+  timer_deadline = deadline;
+}
 
-          if (nokild(code, selected_key_maps[i]->key_from)) {
-            return selected_key_maps[i];
-          } else {
-            return 0;
-          }
+// Stop repeating (the timer may still expire for it).
+static void stop_repeat() {
+  repeat.code = 0;
+  repeat.macro = 0;
+  repeat.deadline = 0;
+}
 
-        }
+// Start repeating: from repeat_delay (of the focused window) from now
+// on, if the window's keys repeat at all.
+static void start_repeat(key_repeat r) {
+  dispatch_table *t = active_dispatch_table;
+  repeat = r;
+  repeat.deadline = 0;
+  if (t->repeat_interval == 0)
+    return;
+  repeat.interval = (uint64_t)t->repeat_interval * 1000;
+  repeat.deadline = frame_time_ns + (uint64_t)t->repeat_delay * 1000000;
+  arm_timer();
+}
 
-      }
+// Events produced while handling the current input frame. They are
+// written to uinput all at once, terminated by a single SYN_REPORT,
+// by sync_key_evs, when the input frame's own SYN_REPORT comes in.
+#define OUT_QUEUE_SIZE 64
+struct input_event out_queue[OUT_QUEUE_SIZE];
+unsigned int out_queue_size = 0;
+
+static void sync_key_evs(output_sink *sink)
+{
+  if (out_queue_size == 0)
+    return;
+
+  out_queue[out_queue_size++] = (struct input_event){ .type = EV_SYN, .code = SYN_REPORT, .value = 0 };
+
+  sink->write_frame(sink, out_queue, out_queue_size);
+
+  record_latency(frame_path, monotonic_ns() - frame_time_ns);
+  frame_path = PATH_PASSTHROUGH;
+
+  out_queue_size = 0;
+}
+
+static void send_key_ev(output_sink *sink, unsigned int code, int value)
+{
+  // Keep room for the SYN_REPORT.
+  if (out_queue_size == OUT_QUEUE_SIZE - 1)
+    sync_key_evs(sink);
+
+  out_queue[out_queue_size++] = (struct input_event){ .type = EV_KEY, .code = code, .value = value };
+
+  if (value == 1)
+    start_repeat((key_repeat){ .code = code });
+  else if (value == 0 && code == repeat.code)
+    stop_repeat();
+
+  trace_key_ev('o', code, value);
+  log_debug("Sending %u %u\n", code, value);
+}
+
+// Where a macro is put together before it is written: a frame
+// releasing the mods which triggered it, the macro's own frames, and
+// a frame pressing the mods again. (Preallocated, so that playing a
+// macro allocates nothing.)
+struct input_event macro_out[MACRO_MAX_EVENTS + 2 * MACRO_MAX_HELD + 2];
+
+// Play macro number macro (counting from 1), with a single write,
+// the n_held mods held released for the time being.
+static void play_macro(output_sink *sink, unsigned int macro, const unsigned short *held, size_t n_held) {
+  // What the input frame sent so far goes first.
+  sync_key_evs(sink);
+
+  dispatch_span mc = compiled_macros()[macro - 1];
+  struct input_event syn = { .type = EV_SYN, .code = SYN_REPORT, .value = 0 };
+  size_t n = 0;
+
+  for (size_t i = 0; i < n_held; i++)
+    macro_out[n++] = (struct input_event){ .type = EV_KEY, .code = held[i], .value = 0 };
+  if (n_held)
+    macro_out[n++] = syn;
+  memcpy(&macro_out[n], &compiled_macro_events()[mc.start], mc.count * sizeof(struct input_event));
+  n += mc.count;
+  for (size_t i = 0; i < n_held; i++)
+    macro_out[n++] = (struct input_event){ .type = EV_KEY, .code = held[i], .value = 1 };
+  if (n_held)
+    macro_out[n++] = syn;
+
+  sink->write_frame(sink, macro_out, n);
+  record_latency(PATH_COMBO, monotonic_ns() - frame_time_ns);
+
+  for (size_t i = 0; i < n; i++)
+    if (macro_out[i].type == EV_KEY)
+      trace_key_ev('o', macro_out[i].code, macro_out[i].value);
+  log_debug("Played macro %u (%zu events)\n", macro, n);
+}
 
+// Janus key code of ks has been held: give it its secondary function.
+static void hold_janus_key(unsigned code) {
+  ks->janus[code] = JANUS_HELD;
+  ks->held_as[code] = km->secondary_fun[code];
+  ks->pending_janus_keys--;
+  logically_press_fun(ks->held_as[code]);
+  send_key_ev(sink, ks->held_as[code], 1);
+  frame_path = PATH_JANUS;
+}
+
+// Decide all the pending janus keys of ks: they are all held if
+// hold, forgotten (without sending anything) otherwise.
+static void decide_pending_janus_keys(int hold) {
+  for (unsigned int i = 0; i < janus_heap_size && ks->pending_janus_keys > 0; ) {
+    if (janus_heap[i].ks != ks) {
+      i++;
+      continue;
+    }
+    unsigned code = janus_heap[i].code;
+    janus_heap_remove(i);
+    if (hold) {
+      hold_janus_key(code);
+    } else {
+      ks->janus[code] = JANUS_UP;
+      ks->pending_janus_keys--;
     }
+    // (Removing may have moved an entry of ks to before i: start
+    // over.)
+    i = 0;
+  }
+  arm_timer();
+}
+
+// Handle ev if it is a janus key's, and return 1. Otherwise, return
+// 0, having first held the janus keys ev decides.
+static int handle_janus_key(struct input_event ev) {
+  if (ev.value == 1 && ks->pending_janus_keys > 0)
+    decide_pending_janus_keys(1);
 
+  unsigned char state = ks->janus[ev.code];
+
+  if (!km->secondary_fun[ev.code] && state == JANUS_UP)
+    return 0;
+
+  if (ev.value == 1 && state == JANUS_UP) {
+    // Nothing to send until we know which function it has.
+    ks->janus[ev.code] = JANUS_PENDING;
+    ks->pending_janus_keys++;
+    janus_heap_push((janus_deadline){
+        .deadline = frame_time_ns + (uint64_t)km->max_delay * 1000000,
+        .ks = ks,
+        .code = ev.code });
+    arm_timer();
+  } else if (ev.value == 0 && state == JANUS_PENDING) {
+    // Tapped: send the primary function. (Press and release in frames
+    // of their own, as if they came from a real tap.)
+    for (unsigned int i = 0; i < janus_heap_size; i++) {
+      if (janus_heap[i].ks == ks && janus_heap[i].code == ev.code) {
+        janus_heap_remove(i);
+        break;
+      }
+    }
+    arm_timer();
+    ks->janus[ev.code] = JANUS_UP;
+    ks->pending_janus_keys--;
+    frame_path = PATH_JANUS;
+    send_key_ev(sink, first_fun(ev.code), 1);
+    sync_key_evs(sink);
+    frame_path = PATH_JANUS;
+    send_key_ev(sink, first_fun(ev.code), 0);
+  } else if (ev.value == 0 && state == JANUS_HELD) {
+    ks->janus[ev.code] = JANUS_UP;
+    logically_release_fun(ks->held_as[ev.code]);
+    send_key_ev(sink, ks->held_as[ev.code], 0);
+    frame_path = PATH_JANUS;
   }
 
-  return 0;
+  return 1;
 }
 
-static void send_key_ev_and_sync(const struct libevdev_uinput *uidev, unsigned int code, int value)
-{
-  int err;
+// Hold the janus keys whose deadline is now or before. Called when
+// timer_fd expires.
+static void expire_janus_keys(uint64_t now) {
+  while (janus_heap_size > 0 && janus_heap[0].deadline <= now) {
+    janus_deadline d = janus_heap[0];
+    janus_heap_remove(0);
+
+    ks = d.ks;
+    dt = active_dispatch_table;
+    if (ks->dt != dt)
+      recompute_logically_down();
+
+    // The secondary function is due since the deadline, so that is
+    // what latency is measured from.
+    frame_time_ns = d.deadline;
+    hold_janus_key(d.code);
+    sync_key_evs(sink);
+  }
+
+  arm_timer();
+}
+
+// A step of a sequence, as typed.
+typedef struct {
+  unsigned short mods; // bits, as in sequence_edge
+  unsigned short key;
+} sequence_step;
+
+// Where typing is in the bindings' trie: at node sequence_node (0,
+// the root, if nowhere), having typed sequence_typed (on keyboard
+// sequence_ks) to get there.
+unsigned int sequence_node = 0;
+sequence_step sequence_typed[SEQUENCE_MAX_STEPS];
+unsigned int sequence_depth = 0;
+key_state *sequence_ks;
+
+// Keys whose press went into a binding: their repeats and release go
+// nowhere either.
+keyset sequence_swallowed;
+
+// Mods of the bindings (but f) which are down, as sequence_edge bits.
+static unsigned sequence_mods_down(unsigned f) {
+  unsigned mods = 0;
+  for (size_t i = 0; i < km->number_of_sequence_mods; i++)
+    if (km->sequence_mods[i] != f && keyset_has(&ks->logically_down, km->sequence_mods[i]))
+      mods |= 1 << i;
+  return mods;
+}
+
+// Slot of the edge (node, key, mods) in the table edges (of mask + 1
+// slots): where it is, or the empty one where it would go.
+static sequence_edge *find_sequence_edge(sequence_edge *edges, unsigned mask,
+                                         unsigned node, unsigned key, unsigned mods) {
+  unsigned i = ((node << 16 | key) * 2654435761u ^ mods * 40503u) & mask;
+  while (edges[i].child && !(edges[i].node == node && edges[i].key == key && edges[i].mods == mods))
+    i = (i + 1) & mask;
+  return &edges[i];
+}
+
+// Node the chord (key, mods) leads to from node, or 0.
+static unsigned sequence_child(unsigned node, unsigned key, unsigned mods) {
+  return find_sequence_edge(KEYMAP_AT(sequence_edge, km->sequence_edges), km->sequence_edges_mask,
+                            node, key, mods)->child;
+}
+
+static void reset_sequence() {
+  sequence_node = 0;
+  sequence_depth = 0;
+  sequence_deadline = 0;
+  arm_timer();
+}
+
+// Give up the sequence being typed: send its steps as they were typed
+// (the mods which are not down any more pressed around each key).
+static void replay_sequence() {
+  for (size_t i = 0; i < sequence_depth; i++) {
+    sequence_step step = sequence_typed[i];
+    unsigned mods = step.mods & ~sequence_mods_down(0);
+
+    for (size_t b = 0; b < km->number_of_sequence_mods; b++)
+      if (mods & (1 << b))
+        send_key_ev(sink, km->sequence_mods[b], 1);
+    send_key_ev(sink, step.key, 1);
+    send_key_ev(sink, step.key, 0);
+    for (size_t b = 0; b < km->number_of_sequence_mods; b++)
+      if (mods & (1 << b))
+        send_key_ev(sink, km->sequence_mods[b], 0);
+  }
+  log_debug("Sequence given up (%u steps)\n", sequence_depth);
+  reset_sequence();
+}
+
+// Handle ev if it is (part of) a step of a binding, and return 1.
+// Otherwise return 0, having given up the sequence being typed, if
+// ev does not go on with it.
+//
+// This is one hash table lookup per key press (two if a sequence is
+// given up), however many bindings there are. A press which is not a
+// step leaves the sequence as it is if its key is a mod of the
+// bindings, as mods come and go between steps.
+static int handle_sequence_key(struct input_event ev) {
+  if (keyset_has(&sequence_swallowed, ev.code)) {
+    if (ev.value == 0)
+      keyset_remove(&sequence_swallowed, ev.code);
+    return 1;
+  }
+
+  if (ev.value != 1 || km->number_of_sequence_nodes <= 1)
+    return 0;
+
+  unsigned f = first_fun(ev.code);
+  unsigned mods = sequence_mods_down(f);
+  unsigned child = sequence_child(sequence_node, f, mods);
+
+  if (child == 0 && sequence_node != 0) {
+    if (km->sequence_mod_bit[f])
+      return 0;
+    replay_sequence();
+    child = sequence_child(0, f, mods);
+  }
+  if (child == 0)
+    return 0;
 
-  err = libevdev_uinput_write_event(uidev, EV_KEY, code, value);
-  if (err != 0) {
-    perror("Error in writing EV_KEY event\n");
-    exit(err);
+  keyset_add(&sequence_swallowed, ev.code);
+  frame_path = PATH_COMBO;
+
+  unsigned short macro = KEYMAP_AT(unsigned short, km->sequence_macros)[child];
+  if (macro) {
+    unsigned short held[SEQUENCE_MAX_MODS];
+    size_t n_held = 0;
+    for (size_t b = 0; b < km->number_of_sequence_mods; b++)
+      if (mods & (1 << b))
+        held[n_held++] = km->sequence_mods[b];
+    reset_sequence();
+    play_macro(sink, macro, held, n_held);
+    return 1;
   }
-  err = libevdev_uinput_write_event(uidev, EV_SYN, SYN_REPORT, 0);
-  if (err != 0) {
-    perror("Error in writing EV_SYN, SYN_REPORT, 0.\n");
-    exit(err);
+
+  sequence_typed[sequence_depth++] = (sequence_step){ .mods = mods, .key = f };
+  sequence_node = child;
+  sequence_ks = ks;
+  sequence_deadline = frame_time_ns + (uint64_t)km->sequence_timeout * 1000000;
+  arm_timer();
+  return 1;
+}
+
+// Give up the sequence being typed if its deadline is now or before.
+// Called when timer_fd expires.
+static void expire_sequence(uint64_t now) {
+  if (sequence_deadline == 0 || sequence_deadline > now)
+    return;
+
+  ks = sequence_ks;
+  dt = active_dispatch_table;
+  if (ks->dt != dt)
+    recompute_logically_down();
+
+  frame_time_ns = sequence_deadline;
+  replay_sequence();
+  sync_key_evs(sink);
+}
+
+// Send the repeat due now or before, if any. Called when timer_fd
+// expires.
+static void expire_repeat(uint64_t now) {
+  if (repeat.deadline == 0 || repeat.deadline > now)
+    return;
+
+  frame_time_ns = repeat.deadline;
+  // (One repeat, however late: a burst of them would be of no use.)
+  repeat.deadline += repeat.interval;
+  if (repeat.deadline <= now)
+    repeat.deadline = now + repeat.interval;
+
+  if (repeat.macro) {
+    ks = repeat.ks;
+    dt = active_dispatch_table;
+    if (ks->dt != dt)
+      recompute_logically_down();
+    if (!is_physically_down(repeat.key) || !is_logically_down(repeat.mod)) {
+      stop_repeat();
+      return;
+    }
+    play_macro(sink, repeat.macro, &repeat.mod, 1);
+  } else {
+    frame_path = PATH_REPEAT;
+    send_key_ev(sink, repeat.code, 2);
+    sync_key_evs(sink);
   }
 
-  printf("Sending %u %u\n", code, value);
+  arm_timer();
+}
+
+// Act on the deadlines (of janus keys, of the sequence and of the
+// repeat) which are now or before.
+static void expire_deadlines(uint64_t now) {
+  if (janus_heap_size > 0 && janus_heap[0].deadline <= now)
+    expire_janus_keys(now);
+  if (sequence_deadline && sequence_deadline <= now)
+    expire_sequence(now);
+  if (repeat.deadline && repeat.deadline <= now)
+    expire_repeat(now);
+  arm_timer();
 }
 
 void handle_key(struct input_event ev) {
-  printf("%i (%i)\n", ev.code, ev.value);
+  // Keys repeat as they are sent (see key_repeat), not as they come.
+  if (ev.value == 2)
+    return;
+
+  trace_key_ev('i', ev.code, ev.value);
+  log_debug("%i (%i)\n", ev.code, ev.value);
+
+  // All the events of a frame have the same timestamp.
+  frame_time_ns = (uint64_t)ev.input_event_sec * 1000000000 + (uint64_t)ev.input_event_usec * 1000;
 
+  // Keys we have no table entries for are just sent through.
+  if (ev.code >= KEYBOARD_SIZE) {
+    send_key_ev(sink, ev.code, ev.value);
+    return;
+  }
+
+  dt = active_dispatch_table;
+  if (ks->dt != dt)
+    recompute_logically_down();
+
+  // (Whatever it sends, a key pressed stops the one repeating.)
+  if (ev.value == 1)
+    stop_repeat();
+
+  if (handle_janus_key(ev))
+    return;
 
   // Update keyboard state
   set_keyboard_state(ev);
 
+  if (handle_sequence_key(ev))
+    return;
+
   // Update keyboard2 state
   // set_keyboard2_state(ev);
 
-  set_selected_key_maps();
-  // Should the setting of the key_maps be performed by the track_window fun?
-
 
 
 
-  printf("Primary fun: %d\n", first_fun(ev.code));
+  log_debug("Primary fun: %d\n", first_fun(ev.code));
 
 
 
@@ -715,21 +2058,23 @@ void handle_key(struct input_event ev) {
   /*   printf("KEY_RIGHTCTRL is NOT logically down!\n"); */
   /* } */
 
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
   if (is_physically_down(KEY_RIGHTALT)) {
-    printf("KEY_RIGHTALT is physically down!\n");
+    log_debug("KEY_RIGHTALT is physically down!\n");
   } else {
-    printf("KEY_RIGHTALT is NOT physically down!\n");
+    log_debug("KEY_RIGHTALT is NOT physically down!\n");
   }
   if (is_logically_down(KEY_RIGHTALT)) {
-    printf("KEY_RIGHTALT is logically down!\n");
+    log_debug("KEY_RIGHTALT is logically down!\n");
   } else {
-    printf("KEY_RIGHTALT is NOT logically down!\n");
+    log_debug("KEY_RIGHTALT is NOT logically down!\n");
   }
   if (nokild(KEY_RIGHTALT, KEY_F)) {
-    printf("nokild(KEY_RIGHTALT, KEY_F)\n");
+    log_debug("nokild(KEY_RIGHTALT, KEY_F)\n");
   } else {
-    printf("NOT nokild(KEY_RIGHTALT, KEY_F)\n");
+    log_debug("NOT nokild(KEY_RIGHTALT, KEY_F)\n");
   }
+#endif
   /* printf("There are %d selected key_maps\n", selected_key_maps_size); */
   /* for (size_t i = 0; i < selected_key_maps_size; i++) */
   /*   printf("KEY MAP: mod_from %d, key_from %d, mod_to %d, key_to %d\n", */
@@ -740,33 +2085,49 @@ void handle_key(struct input_event ev) {
 
 
 
+  // Key a combo sends down: it, rather than the key pressed (which
+  // goes out last, below), is what repeats.
+  unsigned int combo_key_to = 0;
+
   // ######
   key_map* uniquely_active_combo_map_of_key = is_key_in_uniquely_active_combo_map(ev.code);
+  if (uniquely_active_combo_map_of_key && uniquely_active_combo_map_of_key->macro) {
+    // The macro takes the place of the key (and repeats as it
+    // would). The release is sent through, in case the key went down
+    // before the mod did.
+    if (ev.value == 1) {
+      key_repeat r = {
+        .macro = uniquely_active_combo_map_of_key->macro,
+        .mod = uniquely_active_combo_map_of_key->mod_from,
+        .key = ev.code,
+        .ks = ks,
+      };
+      play_macro(sink, r.macro, &r.mod, 1);
+      start_repeat(r);
+      return;
+    }
+    uniquely_active_combo_map_of_key = 0;
+  }
   if (uniquely_active_combo_map_of_key) {
-    printf("IS_KEY_IN_UNIQUELY_ACTIVE_COMBO_MAP\n");
+    log_debug("IS_KEY_IN_UNIQUELY_ACTIVE_COMBO_MAP\n");
     if (ev.value == 1) {
 
       if (is_logically_down(uniquely_active_combo_map_of_key->mod_from)) { // mod_from 1|2
         if (uniquely_active_combo_map_of_key->mod_to) {
-          send_key_ev_and_sync(uidev, uniquely_active_combo_map_of_key->mod_to, 1);
+          send_key_ev(sink, uniquely_active_combo_map_of_key->mod_to, 1);
         }
-        send_key_ev_and_sync(uidev, uniquely_active_combo_map_of_key->key_to, 1);
-      }
-
-    } else if (ev.value == 2) {
-
-      if (is_logically_down(uniquely_active_combo_map_of_key->mod_from)) { // mod_from 1|2
-        send_key_ev_and_sync(uidev, uniquely_active_combo_map_of_key->key_to, 1);
+        send_key_ev(sink, uniquely_active_combo_map_of_key->key_to, 1);
+        combo_key_to = uniquely_active_combo_map_of_key->key_to;
       }
 
     } else {
 
       if (is_logically_down(uniquely_active_combo_map_of_key->mod_from)) { // mod_from 1|2
-        send_key_ev_and_sync(uidev, uniquely_active_combo_map_of_key->key_to, 0);
+        send_key_ev(sink, uniquely_active_combo_map_of_key->key_to, 0);
         if (uniquely_active_combo_map_of_key->mod_to) {
-          send_key_ev_and_sync(uidev, uniquely_active_combo_map_of_key->mod_to, 0);
+          send_key_ev(sink, uniquely_active_combo_map_of_key->mod_to, 0);
         }
-        send_key_ev_and_sync(uidev, uniquely_active_combo_map_of_key->mod_from, 0);
+        send_key_ev(sink, uniquely_active_combo_map_of_key->mod_from, 0);
       }
 
     }
@@ -774,32 +2135,32 @@ void handle_key(struct input_event ev) {
 
   // ######
   key_map* uniquely_active_combo_map_of_mod = is_mod_in_uniquely_active_combo_map(ev.code);
+  // (A macro is only played when its key comes after its mod.)
+  if (uniquely_active_combo_map_of_mod && uniquely_active_combo_map_of_mod->macro)
+    uniquely_active_combo_map_of_mod = 0;
   if (uniquely_active_combo_map_of_mod) {
-    printf("IS_MOD_IN_UNIQUELY_ACTIVE_COMBO_MAP\n");
+    log_debug("IS_MOD_IN_UNIQUELY_ACTIVE_COMBO_MAP\n");
     if (ev.value == 1) {
 
       if (is_logically_down(uniquely_active_combo_map_of_mod->key_from)) { // key_from 1|2
-        send_key_ev_and_sync(uidev, uniquely_active_combo_map_of_mod->mod_from, 0);
-        send_key_ev_and_sync(uidev, uniquely_active_combo_map_of_mod->key_from, 0);
+        send_key_ev(sink, uniquely_active_combo_map_of_mod->mod_from, 0);
+        send_key_ev(sink, uniquely_active_combo_map_of_mod->key_from, 0);
         if (uniquely_active_combo_map_of_mod->mod_to) {
-          send_key_ev_and_sync(uidev, uniquely_active_combo_map_of_mod->mod_to, 0);
+          send_key_ev(sink, uniquely_active_combo_map_of_mod->mod_to, 0);
         }
-        send_key_ev_and_sync(uidev, uniquely_active_combo_map_of_mod->key_to, 1);
+        send_key_ev(sink, uniquely_active_combo_map_of_mod->key_to, 1);
+        combo_key_to = uniquely_active_combo_map_of_mod->key_to;
       }
 
-    } else if (ev.value == 2) {
-
-      printf("The alleged impossible is happening\n");
-
     } else {
 
       if (is_logically_down(uniquely_active_combo_map_of_mod->key_from)) { // key_from 1|2
-        send_key_ev_and_sync(uidev, uniquely_active_combo_map_of_mod->mod_from, 0);
+        send_key_ev(sink, uniquely_active_combo_map_of_mod->mod_from, 0);
         if (uniquely_active_combo_map_of_mod->mod_to) {
-          send_key_ev_and_sync(uidev, uniquely_active_combo_map_of_mod->mod_to, 0);
+          send_key_ev(sink, uniquely_active_combo_map_of_mod->mod_to, 0);
         }
-        send_key_ev_and_sync(uidev, uniquely_active_combo_map_of_mod->key_to, 0);
-        send_key_ev_and_sync(uidev, uniquely_active_combo_map_of_mod->key_from, 1);
+        send_key_ev(sink, uniquely_active_combo_map_of_mod->key_to, 0);
+        send_key_ev(sink, uniquely_active_combo_map_of_mod->key_from, 1);
       }
 
     }
@@ -807,13 +2168,24 @@ void handle_key(struct input_event ev) {
 
   // ######
   // key/mod of non-uniquely-active map
-  send_key_ev_and_sync(uidev, first_fun(ev.code), ev.value);
+  send_key_ev(sink, first_fun(ev.code), ev.value);
+  if (combo_key_to)
+    start_repeat((key_repeat){ .code = combo_key_to });
+
+  enum latency_path path = uniquely_active_combo_map_of_key || uniquely_active_combo_map_of_mod
+                           ? PATH_COMBO
+                           : first_fun(ev.code) != ev.code
+                           ? PATH_SINGLE
+                           : PATH_PASSTHROUGH;
+  if (path > frame_path)
+    frame_path = path;
 }
 
 
 
-unsigned int compute_max_size_of_selected_key_maps() {
-  unsigned int number_of_all_window_maps = sizeof(window_maps) / sizeof(window_maps[0]);
+unsigned int compute_max_size_of_selected_key_maps(config *c) {
+  unsigned int number_of_all_window_maps = c->number_of_window_maps;
+  window_map **window_maps = c->window_maps;
 
   if (number_of_all_window_maps == 1) // there is only the default window map
     return window_maps[0]->size;
@@ -829,87 +2201,1793 @@ unsigned int compute_max_size_of_selected_key_maps() {
   return window_maps[0]->size + size_of_biggest_non_default_w_map;
 }
 
-int main(int argc, char **argv)
-{
-  // Set initial keyboard state
-  memset(keyboard, 0, sizeof(keyboard));
+static void check_code(unsigned code) {
+  if (code >= KEYBOARD_SIZE) {
+    fprintf(stderr, "Key code %u in config is out of range (max %d)\n", code, KEYBOARD_SIZE - 1);
+    exit(1);
+  }
+}
 
-  // Start tracking windows
-  pthread_t xthread;
-  int thread_return_value;
-  thread_return_value = pthread_create(&xthread, NULL, track_window, NULL);
+// Lay out the spans of one arena given how many entries each code
+// needs. Return the total.
+static unsigned layout_spans(dispatch_span *spans, unsigned *counts) {
+  unsigned total = 0;
+  for (size_t c = 0; c < KEYBOARD_SIZE; c++) {
+    spans[c].start = total;
+    spans[c].count = 0;
+    total += counts[c];
+  }
+  return total;
+}
+
+// A keymap being compiled. It grows (and so moves) as things are
+// added to it, which is why everything in it is referred to by
+// offset.
+typedef struct {
+  char *block;
+  uint32_t size;
+  uint32_t capacity;
+} keymap_builder;
+
+#define BUILDER_AT(b, type, offset) ((type *)((b)->block + (offset)))
+
+// Add size zeroed bytes to the keymap and return their offset.
+static uint32_t keymap_alloc(keymap_builder *b, size_t size) {
+  size = (size + 7) & ~(size_t)7;
+  while (b->size + size > b->capacity) {
+    b->capacity = b->capacity ? 2 * b->capacity : 65536;
+    b->block = realloc(b->block, b->capacity);
+  }
+  memset(b->block + b->size, 0, size);
+  uint32_t offset = b->size;
+  b->size += size;
+  return offset;
+}
+
+// Compile the dispatch table of window map i of c (into the
+// compiled_window_map at offset cwm) from the key_maps selected for
+// it. Return -1 if it does not fit in a table.
+static int compile_dispatch_table(config *conf, keymap_builder *b, uint32_t cwm, unsigned int i) {
+  unsigned by_key_from[KEYBOARD_SIZE] = {0};
+  unsigned by_mod_from[KEYBOARD_SIZE] = {0};
+  unsigned sources[KEYBOARD_SIZE] = {0};
+
+  set_selected_key_maps(conf, i);
+
+  dispatch_table *t = &BUILDER_AT(b, compiled_window_map, cwm)->table;
+
+  for (size_t c = 0; c < KEYBOARD_SIZE; c++)
+    t->first_fun[c] = c;
+
+  window_map *wm = conf->window_maps[i];
+  unsigned int delay = wm->repeat_delay ? wm->repeat_delay : conf->repeat_delay;
+  unsigned int rate = wm->repeat_delay ? wm->repeat_rate : conf->repeat_rate;
+  t->repeat_delay = delay;
+  t->repeat_interval = rate ? 1000000 / rate : 0;
+
+  // Count (and compute first_fun: looping forward, the last match
+  // wins, which is what first_fun used to find looping backwards).
+  for (size_t j = 0; j < selected_key_maps_size; j++) {
+    key_map *m = selected_key_maps[j];
+    check_code(m->mod_from);
+    check_code(m->key_from);
+    check_code(m->mod_to);
+    check_code(m->key_to);
+    if (m->macro > conf->number_of_macros || (m->macro && !(m->mod_from && m->key_from))) {
+      fprintf(stderr, "Window map %s has a bad macro (%u)\n", conf->window_maps[i]->class_name, m->macro);
+      return -1;
+    }
+
+    if (m->mod_from && m->key_from) {
+      by_key_from[m->key_from]++;
+      by_mod_from[m->mod_from]++;
+    } else if (m->mod_from || m->key_from) {
+      unsigned from = m->key_from ? m->key_from : m->mod_from;
+      if (m->key_to) {
+        t->first_fun[from] = m->key_to;
+      } else if (m->mod_to) {
+        t->first_fun[from] = m->mod_to;
+      } else {
+        fprintf(stderr, "first_fun: Error. There is neither a key_to nor a mod_to\n");
+      }
+
+      if (m->key_to)
+        sources[m->key_to]++;
+      if (m->mod_to && m->mod_to != m->key_to)
+        sources[m->mod_to]++;
+    }
+  }
+
+  unsigned combos_size = layout_spans(t->combos_by_key_from, by_key_from);
+  layout_spans(t->combos_by_mod_from, by_mod_from);
+  unsigned sources_size = layout_spans(t->sources_of, sources);
+
+  // (Spans are unsigned shorts.)
+  if (2 * combos_size > USHRT_MAX || sources_size > USHRT_MAX) {
+    fprintf(stderr, "Window map %s has too many key maps\n", conf->window_maps[i]->class_name);
+    return -1;
+  }
+
+  uint32_t combos_offset = keymap_alloc(b, 2 * combos_size * sizeof(key_map));
+  uint32_t sources_offset = keymap_alloc(b, sources_size * sizeof(unsigned short));
+
+  t = &BUILDER_AT(b, compiled_window_map, cwm)->table;
+  t->combos = combos_offset;
+  t->sources = sources_offset;
+  key_map *combos = BUILDER_AT(b, key_map, combos_offset);
+  unsigned short *srcs = BUILDER_AT(b, unsigned short, sources_offset);
+
+  // Fill, looping backwards, so that each span is in priority order.
+  for (size_t j = selected_key_maps_size-1; j != SIZE_MAX; j--) {
+    key_map *m = selected_key_maps[j];
+    dispatch_span *s;
+
+    if (m->mod_from && m->key_from) {
+      s = &t->combos_by_key_from[m->key_from];
+      combos[s->start + s->count++] = *m;
+      s = &t->combos_by_mod_from[m->mod_from];
+      combos[combos_size + s->start + s->count++] = *m;
+    } else if (m->mod_from || m->key_from) {
+      unsigned from = m->key_from ? m->key_from : m->mod_from;
+      if (m->key_to) {
+        s = &t->sources_of[m->key_to];
+        srcs[s->start + s->count++] = from;
+      }
+      if (m->mod_to && m->mod_to != m->key_to) {
+        s = &t->sources_of[m->mod_to];
+        srcs[s->start + s->count++] = from;
+      }
+    }
+  }
+
+  // combos_by_mod_from lives in the second half of `combos`.
+  for (size_t c = 0; c < KEYBOARD_SIZE; c++)
+    t->combos_by_mod_from[c].start += combos_size;
+
+  return 0;
+}
+
+// Number of events macro mc is compiled into.
+static unsigned macro_events(macro *mc) {
+  unsigned n = 0;
+  for (size_t i = 0; i < mc->size; i++)
+    n += mc->codes[i] ? 2 : 1;
+  return n;
+}
+
+// Compile macro mc into evs (macro_events(mc) of them): each chord is
+// its presses, its releases (last first) and a SYN_REPORT.
+static void compile_macro(macro *mc, struct input_event *evs) {
+  size_t n = 0;
+  size_t chord = 0;
+  for (size_t i = 0; i < mc->size; i++) {
+    if (mc->codes[i]) {
+      evs[n++] = (struct input_event){ .type = EV_KEY, .code = mc->codes[i], .value = 1 };
+      continue;
+    }
+    for (size_t j = i; j-- > chord;)
+      evs[n++] = (struct input_event){ .type = EV_KEY, .code = mc->codes[j], .value = 0 };
+    evs[n++] = (struct input_event){ .type = EV_SYN, .code = SYN_REPORT, .value = 0 };
+    chord = i + 1;
+  }
+}
+
+// Compile the bindings of c into the trie of the keymap of b. Return
+// -1 (having said why) if they do not make one.
+static int compile_bindings(config *c, keymap_builder *b) {
+  unsigned max_nodes = 1;
+  for (size_t j = 0; j < c->number_of_bindings; j++)
+    max_nodes += c->bindings[j].number_of_steps;
+  if (max_nodes > USHRT_MAX) {
+    fprintf(stderr, "Too many bindings\n");
+    return -1;
+  }
+
+  unsigned slots = 2;
+  while (slots < 2 * max_nodes)
+    slots *= 2;
+  uint32_t macros_offset = keymap_alloc(b, max_nodes * sizeof(unsigned short));
+  uint32_t edges_offset = keymap_alloc(b, slots * sizeof(sequence_edge));
+
+  keymap *k = BUILDER_AT(b, keymap, 0);
+  unsigned short *macros = BUILDER_AT(b, unsigned short, macros_offset);
+  sequence_edge *edges = BUILDER_AT(b, sequence_edge, edges_offset);
+  unsigned char *has_children = calloc(max_nodes, 1);
+  unsigned nodes = 1;
+  const char *error = NULL;
+
+  for (size_t j = 0; j < c->number_of_bindings && error == NULL; j++) {
+    binding *bd = &c->bindings[j];
+    if (bd->number_of_steps == 0 || bd->number_of_steps > SEQUENCE_MAX_STEPS
+        || bd->macro == 0 || bd->macro > c->number_of_macros) {
+      error = "bad binding";
+      break;
+    }
+
+    unsigned node = 0;
+    for (size_t st = 0; st < bd->number_of_steps; st++) {
+      chord *ch = &bd->steps[st];
+      unsigned n = 0;
+      while (n < CHORD_MAX_KEYS && ch->keys[n])
+        n++;
+      if (n == 0) {
+        error = "empty chord";
+        break;
+      }
+      unsigned key = ch->keys[n - 1];
+      check_code(key);
+
+      unsigned mods = 0;
+      for (size_t i = 0; i + 1 < n; i++) {
+        unsigned mod = ch->keys[i];
+        check_code(mod);
+        if (mod == key) {
+          error = "chord with its key among its mods";
+          break;
+        }
+        if (!k->sequence_mod_bit[mod]) {
+          if (k->number_of_sequence_mods == SEQUENCE_MAX_MODS) {
+            error = "too many different mods in bindings";
+            break;
+          }
+          k->sequence_mods[k->number_of_sequence_mods] = mod;
+          k->sequence_mod_bit[mod] = ++k->number_of_sequence_mods;
+        }
+        mods |= 1 << (k->sequence_mod_bit[mod] - 1);
+      }
+      if (error)
+        break;
+
+      if (macros[node]) {
+        error = "binding which goes on from another one";
+        break;
+      }
+      sequence_edge *e = find_sequence_edge(edges, slots - 1, node, key, mods);
+      if (e->child == 0)
+        *e = (sequence_edge){ .node = node, .key = key, .mods = mods, .child = nodes++ };
+      has_children[node] = 1;
+      node = e->child;
+    }
+
+    if (error == NULL && (has_children[node] || macros[node]))
+      error = "binding which is the beginning of another one (or the same)";
+    if (error == NULL)
+      macros[node] = bd->macro;
+  }
+
+  free(has_children);
+  if (error) {
+    fprintf(stderr, "Bindings: %s\n", error);
+    return -1;
+  }
+
+  k->sequence_timeout = c->sequence_timeout;
+  k->number_of_sequence_nodes = nodes;
+  k->sequence_macros = macros_offset;
+  k->sequence_edges_mask = slots - 1;
+  k->sequence_edges = edges_offset;
+  return 0;
+}
+
+// Put the n window maps (compiled at offset cwms of b) but the
+// default one in the table slots (of mask + 1) by class. Where two
+// have the same class, the first one is kept.
+static void intern_window_classes(keymap_builder *b, uint32_t cwms, unsigned int n,
+                                  window_class_slot *slots, uint32_t mask) {
+  compiled_window_map *cwm = BUILDER_AT(b, compiled_window_map, cwms);
+
+  for (uint32_t j = 1; j < n; j++) {
+    uint32_t h = hash_class(cwm[j].class_name);
+    uint32_t i = h & mask;
+    while (slots[i].window_map
+           && !(slots[i].hash == h && strcmp(cwm[slots[i].window_map].class_name, cwm[j].class_name) == 0))
+      i = (i + 1) & mask;
+    if (slots[i].window_map == 0)
+      slots[i] = (window_class_slot){ .hash = h, .window_map = j };
+  }
+}
+
+// Compile c into a (malloc'd) keymap. config_size and config_mtime_ns
+// identify the config file c comes from, if any. Return NULL on
+// failure.
+static keymap *compile_keymap(config *c, int64_t config_size, int64_t config_mtime_ns) {
+  keymap_builder b = {0};
 
   // Allocate space for holding active key_maps (those key_maps which
-  // are in place given the currently selected window)
-  unsigned int max_size_of_selected_key_maps = compute_max_size_of_selected_key_maps();
-  printf("size_of_selected_key_maps: %d\n", max_size_of_selected_key_maps);
-  selected_key_maps = malloc(max_size_of_selected_key_maps * sizeof(key_map*));
+  // are in place given the window being compiled)
+  unsigned int max_size_of_selected_key_maps = compute_max_size_of_selected_key_maps(c);
+  log_debug("size_of_selected_key_maps: %d\n", max_size_of_selected_key_maps);
+  selected_key_maps = realloc(selected_key_maps, max_size_of_selected_key_maps * sizeof(key_map*));
+  key_maps_of_default_window_map_are_set = 0;
+
+  keymap_alloc(&b, sizeof(keymap));
+  uint32_t window_maps_offset = keymap_alloc(&b, c->number_of_window_maps * sizeof(compiled_window_map));
+  uint32_t janus_keys_offset = keymap_alloc(&b, c->number_of_janus_keys * sizeof(janus_key));
+
+  unsigned number_of_macro_events = 0;
+  for (size_t j = 0; j < c->number_of_macros; j++) {
+    macro *mc = c->macros[j];
+    for (size_t i = 0; i < mc->size; i++)
+      check_code(mc->codes[i]);
+    if (mc->size == 0 || mc->codes[mc->size - 1] != 0 || macro_events(mc) > MACRO_MAX_EVENTS) {
+      fprintf(stderr, "Macro %s is empty or too long\n", mc->name);
+      free(b.block);
+      return NULL;
+    }
+    number_of_macro_events += macro_events(mc);
+  }
+  // (Spans are unsigned shorts.)
+  if (number_of_macro_events > USHRT_MAX) {
+    fprintf(stderr, "Too many macros\n");
+    free(b.block);
+    return NULL;
+  }
+  if (compile_bindings(c, &b) < 0) {
+    free(b.block);
+    return NULL;
+  }
 
-  // Do libevdev stuff and call handle key at each key event
-  struct libevdev *dev = NULL;
-  const char *file;
-  int fd;
-  int rc = 1;
+  uint32_t macros_offset = keymap_alloc(&b, c->number_of_macros * sizeof(dispatch_span));
+  uint32_t macro_events_offset = keymap_alloc(&b, number_of_macro_events * sizeof(struct input_event));
 
-  if (argc < 2)
-    goto out;
+  for (size_t j = 0, start = 0; j < c->number_of_macros; j++) {
+    dispatch_span *span = &BUILDER_AT(&b, dispatch_span, macros_offset)[j];
+    span->start = start;
+    span->count = macro_events(c->macros[j]);
+    compile_macro(c->macros[j], &BUILDER_AT(&b, struct input_event, macro_events_offset)[start]);
+    start += span->count;
+  }
 
-  usleep(200000); // let (KEY_ENTER), value 0 go through before
-  // (Probably better: We could just send KEY_ENTER 0 instead)
+  for (size_t i = 0; i < c->number_of_window_maps; i++) {
+    uint32_t cwm = window_maps_offset + i * sizeof(compiled_window_map);
+    snprintf(BUILDER_AT(&b, compiled_window_map, cwm)->class_name, CLASS_NAME_SIZE, "%s", c->window_maps[i]->class_name);
+    if (compile_dispatch_table(c, &b, cwm, i) < 0) {
+      free(b.block);
+      return NULL;
+    }
+  }
 
-  file = argv[1];
-  fd = open(file, O_RDONLY);
-  if (fd < 0) {
-    perror("Failed to open device");
-    goto out;
+  uint32_t slots = 2;
+  while (slots < 2 * c->number_of_window_maps)
+    slots *= 2;
+  uint32_t window_classes_offset = keymap_alloc(&b, slots * sizeof(window_class_slot));
+  intern_window_classes(&b, window_maps_offset, c->number_of_window_maps,
+                        BUILDER_AT(&b, window_class_slot, window_classes_offset), slots - 1);
+
+  keymap *k = (keymap *)b.block;
+  memcpy(k->magic, KEYMAP_MAGIC, sizeof(k->magic));
+  k->size = b.size;
+  k->keyboard_size = KEYBOARD_SIZE;
+  k->config_size = config_size;
+  k->config_mtime_ns = config_mtime_ns;
+  k->max_delay = c->max_delay;
+  k->number_of_window_maps = c->number_of_window_maps;
+  k->window_maps = window_maps_offset;
+  k->window_classes_mask = slots - 1;
+  k->window_classes = window_classes_offset;
+  k->number_of_janus_keys = c->number_of_janus_keys;
+  k->janus_keys = janus_keys_offset;
+  k->number_of_macros = c->number_of_macros;
+  k->macros = macros_offset;
+  k->number_of_macro_events = number_of_macro_events;
+  k->macro_events = macro_events_offset;
+
+  for (size_t j = 0; j < c->number_of_janus_keys; j++) {
+    janus_key *jk = &c->janus_keys[j];
+    check_code(jk->key);
+    check_code(jk->secondary_function);
+    BUILDER_AT(&b, janus_key, janus_keys_offset)[j] = *jk;
+    k->secondary_fun[jk->key] = jk->secondary_function;
   }
 
-  rc = libevdev_new_from_fd(fd, &dev);
-  if (rc < 0) {
-    fprintf(stderr, "Failed to init libevdev (%s)\n", strerror(-rc));
-    goto out;
+  return k;
+}
+
+// Config file (given with REMAPPER_CONFIG), if any, and its cache: the
+// keymap compiled from it, at the same path plus ".cache".
+char *config_path;
+char config_cache_path[PATH_MAX];
+
+// Whether km is mmap'd (from the cache) rather than malloc'd.
+int km_is_mapped = 0;
+
+static void free_keymap(keymap *k, int mapped) {
+  if (mapped)
+    munmap(k, k->size);
+  else
+    free(k);
+}
+
+static void free_config(config *c) {
+  for (size_t i = 0; i < c->number_of_window_maps; i++) {
+    free(c->window_maps[i]->class_name);
+    free(c->window_maps[i]);
+  }
+  free(c->window_maps);
+  free(c->janus_keys);
+  for (size_t i = 0; i < c->number_of_macros; i++) {
+    free(c->macros[i]->name);
+    free(c->macros[i]);
+  }
+  free(c->macros);
+  free(c->bindings);
+  free(c);
+}
+
+// Parse a key code: either its name in input-event-codes.h, with or
+// without the KEY_ (e.g. CAPSLOCK or KEY_CAPSLOCK; 1 is KEY_1), or
+// its number, or - for none. Return -1 if it is none of those.
+static int parse_code(const char *word, unsigned int *code) {
+  if (strcmp(word, "-") == 0) {
+    *code = 0;
+    return 0;
   }
 
-  int err;
-  int uifd;
+  char name[64];
+  snprintf(name, sizeof(name), "%s%s", strncmp(word, "KEY_", 4) == 0 ? "" : "KEY_", word);
+  int c = libevdev_event_code_from_name(EV_KEY, name);
 
-  uifd = open("/dev/uinput", O_RDWR);
-  if (uifd < 0) {
-    printf("uifd < 0 (Do you have the right privileges?)\n");
-    return -errno;
+  unsigned long n = c;
+  if (c < 0) {
+    char *end;
+    n = strtoul(word, &end, 10);
+    if (end == word || *end != '\0')
+      return -1;
   }
 
-  err = libevdev_uinput_create_from_device(dev, uifd, &uidev);
-  if (err != 0)
-    return err;
+  if (n >= KEYBOARD_SIZE)
+    return -1;
+  *code = n;
+  return 0;
+}
 
-  int grab = libevdev_grab(dev, LIBEVDEV_GRAB);
-  if (grab < 0) {
-    printf("grab < 0\n");
-    return -errno;
+// Number (counting from 1) of the macro of c called name, or 0.
+static unsigned int find_macro(config *c, const char *name) {
+  for (size_t i = 0; i < c->number_of_macros; i++)
+    if (strcmp(c->macros[i]->name, name) == 0)
+      return i + 1;
+  return 0;
+}
+
+// Parse macro name, made of the n chords (e.g. LEFTSHIFT+END). Return
+// it (malloc'd), or NULL having set *error to what is wrong with it.
+static macro *parse_macro(const char *name, char **chords, int n, const char **error) {
+  unsigned short codes[MACRO_MAX_EVENTS];
+  unsigned int size = 0;
+  unsigned int events = 0;
+
+  for (int i = 0; i < n; i++) {
+    for (char *k = strtok(chords[i], "+"); k; k = strtok(NULL, "+")) {
+      unsigned int code;
+      if (parse_code(k, &code) < 0 || code == 0) {
+        *error = "bad key in macro";
+        return NULL;
+      }
+      if ((events += 2) > MACRO_MAX_EVENTS) {
+        *error = "macro too long";
+        return NULL;
+      }
+      codes[size++] = code;
+    }
+    if (size == 0 || codes[size - 1] == 0) {
+      *error = "empty chord in macro";
+      return NULL;
+    }
+    if ((events += 1) > MACRO_MAX_EVENTS) {
+      *error = "macro too long";
+      return NULL;
+    }
+    codes[size++] = 0;
   }
 
-  do {
-    struct input_event ev;
-    rc = libevdev_next_event(dev, LIBEVDEV_READ_FLAG_NORMAL|LIBEVDEV_READ_FLAG_BLOCKING, &ev);
-    if (rc == LIBEVDEV_READ_STATUS_SYNC) {
-      printf("Dropped\n");
-      while (rc == LIBEVDEV_READ_STATUS_SYNC) {
-        rc = libevdev_next_event(dev, LIBEVDEV_READ_FLAG_SYNC, &ev);
+  macro *mc = malloc(sizeof(macro) + size * sizeof(unsigned short));
+  mc->name = strdup(name);
+  mc->size = size;
+  memcpy(mc->codes, codes, size * sizeof(unsigned short));
+  return mc;
+}
+
+// Parse binding words (of n), e.g. RIGHTCTRL+X RIGHTCTRL+S @save, of
+// c into *bd. Return NULL, or what is wrong with it.
+static const char *parse_binding(config *c, char **words, int n, binding *bd) {
+  if (n < 2 || words[n - 1][0] != '@')
+    return "expected bind <chord>... @<macro>";
+  if (n - 1 > SEQUENCE_MAX_STEPS)
+    return "too many chords in binding";
+  if ((bd->macro = find_macro(c, words[n - 1] + 1)) == 0)
+    return "no such macro";
+
+  for (int i = 0; i < n - 1; i++) {
+    chord *ch = &bd->steps[bd->number_of_steps++];
+    unsigned int size = 0;
+    for (char *k = strtok(words[i], "+"); k; k = strtok(NULL, "+")) {
+      unsigned int code;
+      if (parse_code(k, &code) < 0 || code == 0)
+        return "bad key in chord";
+      if (size == CHORD_MAX_KEYS)
+        return "too many keys in chord";
+      ch->keys[size++] = code;
+    }
+    if (size == 0)
+      return "empty chord";
+  }
+  return NULL;
+}
+
+// Parse config file path. The format is:
+//
+//   # Comment
+//   max_delay 300
+//   janus CAPSLOCK LEFTALT       (key, secondary function)
+//   macro kill-line LEFTSHIFT+END LEFTCTRL+X
+//                                (name, chords)
+//   sequence_timeout 1000
+//   bind RIGHTCTRL+X RIGHTCTRL+S @save
+//                                (chords, macro)
+//   repeat 250 30                (delay in ms, rate per second)
+//
+//   [Default]                    (window class)
+//   - CAPSLOCK - ESC             (mod_from key_from mod_to key_to)
+//   RIGHTALT F RIGHTCTRL RIGHT
+//   RIGHTCTRL K - @kill-line     (a combo map sending a macro)
+//
+//   [Brave-browser]
+//   repeat 500 10                (for this window's keys only)
+//   ...
+//
+// The first window map must be [Default], and macros must come
+// before the key maps and bindings which send them. Return NULL (having said why)
+// if the file cannot be read or is not valid.
+static config *parse_config(const char *path) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    perror("Failed to open config");
+    return NULL;
+  }
+
+  config *c = calloc(1, sizeof(config));
+  c->max_delay = builtin_config.max_delay;
+  c->sequence_timeout = builtin_config.sequence_timeout;
+  c->repeat_delay = builtin_config.repeat_delay;
+  c->repeat_rate = builtin_config.repeat_rate;
+  unsigned int window_maps_capacity = 0;
+  unsigned int key_maps_capacity = 0;
+  unsigned int janus_keys_capacity = 0;
+  unsigned int macros_capacity = 0;
+  unsigned int bindings_capacity = 0;
+
+  char line[512];
+  int line_number = 0;
+  const char *error = NULL;
+
+  while (error == NULL && fgets(line, sizeof(line), file)) {
+    line_number++;
+
+    char *comment = strchr(line, '#');
+    if (comment)
+      *comment = '\0';
+
+    char *p = line + strspn(line, " \t");
+    if (*p == '[') {
+      char *end = strchr(p, ']');
+      if (end == NULL || end == p + 1 || end - p - 1 >= CLASS_NAME_SIZE) {
+        error = "bad window class";
+        break;
+      }
+      *end = '\0';
+      if (c->number_of_window_maps == 0 && strcmp(p + 1, "Default") != 0) {
+        error = "the first window map must be [Default]";
+        break;
+      }
+      if (c->number_of_window_maps == window_maps_capacity) {
+        window_maps_capacity = window_maps_capacity ? 2 * window_maps_capacity : 8;
+        c->window_maps = realloc(c->window_maps, window_maps_capacity * sizeof(window_map*));
       }
-      printf("Re-synced\n");
-    } else if (rc == LIBEVDEV_READ_STATUS_SUCCESS) {
-      if (ev.type == EV_KEY)
-        handle_key(ev);
+      window_map *wm = calloc(1, sizeof(window_map));
+      wm->class_name = strdup(p + 1);
+      c->window_maps[c->number_of_window_maps++] = wm;
+      key_maps_capacity = 0;
+      continue;
     }
-  } while (rc == LIBEVDEV_READ_STATUS_SYNC || rc == LIBEVDEV_READ_STATUS_SUCCESS || rc == -EAGAIN);
 
-  if (rc != LIBEVDEV_READ_STATUS_SUCCESS && rc != -EAGAIN)
-    fprintf(stderr, "Failed to handle events: %s\n", strerror(-rc));
+    char *words[MACRO_MAX_EVENTS / 3 + 3];
+    int n = 0;
+    for (char *w = strtok(p, " \t\r\n"); w && n < sizeof(words) / sizeof(words[0]); w = strtok(NULL, " \t\r\n"))
+      words[n++] = w;
 
-  rc = 0;
- out:
-  libevdev_free(dev);
+    if (n == 0)
+      continue;
 
-  return rc;
-}
+    if (strcmp(words[0], "max_delay") == 0) {
+      char *end;
+      if (n != 2 || (c->max_delay = strtoul(words[1], &end, 10), *end != '\0'))
+        error = "expected max_delay <milliseconds>";
+    } else if (strcmp(words[0], "sequence_timeout") == 0) {
+      char *end;
+      if (n != 2 || (c->sequence_timeout = strtoul(words[1], &end, 10), *end != '\0'))
+        error = "expected sequence_timeout <milliseconds>";
+    } else if (strcmp(words[0], "repeat") == 0) {
+      // (Of the window map it is in, if any.)
+      unsigned int *delay = &c->repeat_delay, *rate = &c->repeat_rate;
+      if (c->number_of_window_maps > 0) {
+        delay = &c->window_maps[c->number_of_window_maps - 1]->repeat_delay;
+        rate = &c->window_maps[c->number_of_window_maps - 1]->repeat_rate;
+      }
+      char *end1, *end2;
+      if (n != 3 || (*delay = strtoul(words[1], &end1, 10), *end1 != '\0') || *delay == 0
+          || (*rate = strtoul(words[2], &end2, 10), *end2 != '\0') || *rate > 1000000)
+        error = "expected repeat <milliseconds> <per second>";
+    } else if (strcmp(words[0], "bind") == 0) {
+      binding bd = {0};
+      if ((error = parse_binding(c, words + 1, n - 1, &bd)))
+        break;
+      if (c->number_of_bindings == bindings_capacity) {
+        bindings_capacity = bindings_capacity ? 2 * bindings_capacity : 8;
+        c->bindings = realloc(c->bindings, bindings_capacity * sizeof(binding));
+      }
+      c->bindings[c->number_of_bindings++] = bd;
+    } else if (strcmp(words[0], "janus") == 0) {
+      janus_key jk;
+      if (n != 3 || parse_code(words[1], &jk.key) < 0 || parse_code(words[2], &jk.secondary_function) < 0
+          || !jk.key || !jk.secondary_function) {
+        error = "expected janus <key> <secondary function>";
+        break;
+      }
+      if (c->number_of_janus_keys == janus_keys_capacity) {
+        janus_keys_capacity = janus_keys_capacity ? 2 * janus_keys_capacity : 8;
+        c->janus_keys = realloc(c->janus_keys, janus_keys_capacity * sizeof(janus_key));
+      }
+      c->janus_keys[c->number_of_janus_keys++] = jk;
+    } else if (strcmp(words[0], "macro") == 0) {
+      if (n < 3 || find_macro(c, words[1])) {
+        error = "expected macro <new name> <chord>...";
+        break;
+      }
+      macro *mc = parse_macro(words[1], words + 2, n - 2, &error);
+      if (mc == NULL)
+        break;
+      if (c->number_of_macros == macros_capacity) {
+        macros_capacity = macros_capacity ? 2 * macros_capacity : 8;
+        c->macros = realloc(c->macros, macros_capacity * sizeof(macro*));
+      }
+      c->macros[c->number_of_macros++] = mc;
+    } else {
+      key_map m = {0};
+      int sends_macro = n == 4 && words[3][0] == '@';
+      if (n != 4 || parse_code(words[0], &m.mod_from) < 0 || parse_code(words[1], &m.key_from) < 0
+          || parse_code(words[2], &m.mod_to) < 0 || (!sends_macro && parse_code(words[3], &m.key_to) < 0)) {
+        error = "expected <mod_from> <key_from> <mod_to> <key_to>";
+        break;
+      }
+      if (sends_macro && (!m.mod_from || !m.key_from || m.mod_to)) {
+        error = "a macro is sent by a combo map, with no mod_to";
+        break;
+      }
+      if (sends_macro && (m.macro = find_macro(c, words[3] + 1)) == 0) {
+        error = "no such macro";
+        break;
+      }
+      if (!m.mod_from && !m.key_from) {
+        error = "neither a mod_from nor a key_from";
+        break;
+      }
+      if (!(m.mod_from && m.key_from) && !m.mod_to && !m.key_to) {
+        error = "neither a key_to nor a mod_to";
+        break;
+      }
+      if (c->number_of_window_maps == 0) {
+        error = "key map before any window map";
+        break;
+      }
+      window_map *wm = c->window_maps[c->number_of_window_maps - 1];
+      if (wm->size == key_maps_capacity) {
+        key_maps_capacity = key_maps_capacity ? 2 * key_maps_capacity : 16;
+        wm = realloc(wm, sizeof(window_map) + key_maps_capacity * sizeof(key_map));
+        c->window_maps[c->number_of_window_maps - 1] = wm;
+      }
+      wm->key_maps[wm->size++] = m;
+    }
+  }
+
+  fclose(file);
+
+  if (error == NULL && c->number_of_window_maps == 0)
+    error = "no [Default] window map";
+
+  if (error) {
+    fprintf(stderr, "%s:%d: %s\n", path, line_number, error);
+    free_config(c);
+    return NULL;
+  }
+
+  return c;
+}
+
+// Write k to the cache file. (To a temporary file first, so that
+// nobody ever mmaps half a cache.)
+static void write_keymap_cache(keymap *k) {
+  char tmp_path[PATH_MAX + 8];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", config_cache_path);
+
+  int fd = open(tmp_path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+  if (fd < 0) {
+    perror("Failed to write config cache");
+    return;
+  }
+
+  int ok = write(fd, k, k->size) == k->size;
+  close(fd);
+
+  if (!ok || rename(tmp_path, config_cache_path) < 0) {
+    perror("Failed to write config cache");
+    unlink(tmp_path);
+  }
+}
+
+// Whether span s of an arena of entries of entry_size bytes, at
+// offset in a keymap of size bytes, is inside of it.
+static int is_span_in_keymap(dispatch_span s, uint32_t offset, size_t entry_size, size_t size) {
+  return offset <= size && (uint64_t)s.start + s.count <= (size - offset) / entry_size;
+}
+
+// Whether every offset, span, index and key code of k (of size bytes)
+// leads inside of it, and of the tables indexed by key code: what
+// handle_key takes for granted of a keymap it compiled itself. (Just
+// so that a cache from a different build, or a damaged one, cannot
+// make us read outside of it.)
+static int is_keymap_sound(keymap *k, size_t size) {
+  if ((k->window_maps | k->window_classes | k->janus_keys | k->macros | k->macro_events
+       | k->sequence_macros | k->sequence_edges) & 7
+      || k->window_maps + (uint64_t)k->number_of_window_maps * sizeof(compiled_window_map) > size
+      || k->window_classes + ((uint64_t)k->window_classes_mask + 1) * sizeof(window_class_slot) > size
+      || (k->window_classes_mask & (k->window_classes_mask + 1)) != 0
+      || k->janus_keys + (uint64_t)k->number_of_janus_keys * sizeof(janus_key) > size
+      || k->macros + (uint64_t)k->number_of_macros * sizeof(dispatch_span) > size
+      || k->macro_events + (uint64_t)k->number_of_macro_events * sizeof(struct input_event) > size
+      || k->sequence_macros + (uint64_t)k->number_of_sequence_nodes * sizeof(unsigned short) > size
+      || k->sequence_edges + ((uint64_t)k->sequence_edges_mask + 1) * sizeof(sequence_edge) > size
+      || (k->sequence_edges_mask & (k->sequence_edges_mask + 1)) != 0
+      || k->number_of_sequence_mods > SEQUENCE_MAX_MODS
+      || k->number_of_sequence_nodes == 0
+      || k->number_of_window_maps == 0)
+    return 0;
+
+  char *base = (char *)k;
+
+  compiled_window_map *cwms = (compiled_window_map *)(base + k->window_maps);
+  for (size_t i = 0; i < k->number_of_window_maps; i++) {
+    dispatch_table *t = &cwms[i].table;
+    if (memchr(cwms[i].class_name, '\0', CLASS_NAME_SIZE) == NULL)
+      return 0;
+
+    for (size_t c = 0; c < KEYBOARD_SIZE; c++)
+      if (t->first_fun[c] >= KEYBOARD_SIZE
+          || !is_span_in_keymap(t->combos_by_key_from[c], t->combos, sizeof(key_map), size)
+          || !is_span_in_keymap(t->combos_by_mod_from[c], t->combos, sizeof(key_map), size)
+          || !is_span_in_keymap(t->sources_of[c], t->sources, sizeof(unsigned short), size))
+        return 0;
+
+    // The entries the spans lead to. (Both are arrays of them, up to
+    // the end of the spans which go the furthest.)
+    size_t combos_size = 0, sources_size = 0;
+    for (size_t c = 0; c < KEYBOARD_SIZE; c++) {
+      if (t->combos_by_key_from[c].start + t->combos_by_key_from[c].count > combos_size)
+        combos_size = t->combos_by_key_from[c].start + t->combos_by_key_from[c].count;
+      if (t->combos_by_mod_from[c].start + t->combos_by_mod_from[c].count > combos_size)
+        combos_size = t->combos_by_mod_from[c].start + t->combos_by_mod_from[c].count;
+      if (t->sources_of[c].start + t->sources_of[c].count > sources_size)
+        sources_size = t->sources_of[c].start + t->sources_of[c].count;
+    }
+    if ((t->combos | t->sources) & 7)
+      return 0;
+    key_map *combos = (key_map *)(base + t->combos);
+    for (size_t j = 0; j < combos_size; j++)
+      if (combos[j].mod_from >= KEYBOARD_SIZE || combos[j].key_from >= KEYBOARD_SIZE
+          || combos[j].mod_to >= KEYBOARD_SIZE || combos[j].key_to >= KEYBOARD_SIZE
+          || combos[j].macro > k->number_of_macros)
+        return 0;
+    unsigned short *sources = (unsigned short *)(base + t->sources);
+    for (size_t j = 0; j < sources_size; j++)
+      if (sources[j] >= KEYBOARD_SIZE)
+        return 0;
+  }
+
+  window_class_slot *slots = (window_class_slot *)(base + k->window_classes);
+  for (size_t i = 0; i <= k->window_classes_mask; i++)
+    if (slots[i].window_map >= k->number_of_window_maps)
+      return 0;
+
+  janus_key *janus = (janus_key *)(base + k->janus_keys);
+  for (size_t j = 0; j < k->number_of_janus_keys; j++)
+    if (janus[j].key >= KEYBOARD_SIZE || janus[j].secondary_function >= KEYBOARD_SIZE)
+      return 0;
+  for (size_t c = 0; c < KEYBOARD_SIZE; c++)
+    if (k->secondary_fun[c] >= KEYBOARD_SIZE || k->sequence_mod_bit[c] > k->number_of_sequence_mods)
+      return 0;
+
+  dispatch_span *macros = (dispatch_span *)(base + k->macros);
+  for (size_t j = 0; j < k->number_of_macros; j++)
+    if (macros[j].count > MACRO_MAX_EVENTS
+        || macros[j].start + macros[j].count > k->number_of_macro_events)
+      return 0;
+  struct input_event *macro_events = (struct input_event *)(base + k->macro_events);
+  for (size_t j = 0; j < k->number_of_macro_events; j++)
+    if (!(macro_events[j].type == EV_KEY && macro_events[j].code < KEYBOARD_SIZE)
+        && !(macro_events[j].type == EV_SYN && macro_events[j].code == SYN_REPORT))
+      return 0;
+
+  unsigned short *sequence_macros = (unsigned short *)(base + k->sequence_macros);
+  for (size_t j = 0; j < k->number_of_sequence_nodes; j++)
+    if (sequence_macros[j] > k->number_of_macros)
+      return 0;
+  sequence_edge *edges = (sequence_edge *)(base + k->sequence_edges);
+  for (size_t j = 0; j <= k->sequence_edges_mask; j++)
+    if (edges[j].child >= k->number_of_sequence_nodes || edges[j].node >= k->number_of_sequence_nodes)
+      return 0;
+  for (size_t j = 0; j < k->number_of_sequence_mods; j++)
+    if (k->sequence_mods[j] >= KEYBOARD_SIZE)
+      return 0;
+
+  return 1;
+}
+
+// Whether k (of size bytes, read from the cache) is a keymap compiled
+// by us, from the config file as it is now.
+static int is_keymap_up_to_date(keymap *k, size_t size, struct stat *config_stat) {
+  if (memcmp(k->magic, KEYMAP_MAGIC, sizeof(k->magic)) != 0
+      || k->size != size
+      || k->keyboard_size != KEYBOARD_SIZE
+      || k->config_size != config_stat->st_size
+      || k->config_mtime_ns != config_stat->st_mtim.tv_sec * 1000000000LL + config_stat->st_mtim.tv_nsec)
+    return 0;
+
+  if (!is_keymap_sound(k, size)) {
+    fprintf(stderr, "Config cache %s is damaged, recompiling\n", config_cache_path);
+    return 0;
+  }
+
+  return 1;
+}
+
+// Load the keymap of the config file: mmap its cache if that is up to
+// date, otherwise parse and compile the config file, and write the
+// cache for next time. Set *mapped to whether the keymap is mmap'd.
+// Return NULL (having said why) on failure.
+static keymap *load_keymap(int *mapped) {
+  struct stat config_stat;
+  if (stat(config_path, &config_stat) < 0) {
+    perror("Failed to stat config");
+    return NULL;
+  }
+
+  int fd = open(config_cache_path, O_RDONLY|O_CLOEXEC);
+  if (fd >= 0) {
+    struct stat cache_stat;
+    keymap *k = MAP_FAILED;
+    if (fstat(fd, &cache_stat) == 0 && cache_stat.st_size >= sizeof(keymap))
+      k = mmap(NULL, cache_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (k != MAP_FAILED) {
+      if (is_keymap_up_to_date(k, cache_stat.st_size, &config_stat)) {
+        *mapped = 1;
+        return k;
+      }
+      munmap(k, cache_stat.st_size);
+    }
+  }
+
+  config *c = parse_config(config_path);
+  if (c == NULL)
+    return NULL;
+  keymap *k = compile_keymap(c,
+                             config_stat.st_size,
+                             config_stat.st_mtim.tv_sec * 1000000000LL + config_stat.st_mtim.tv_nsec);
+  free_config(c);
+  if (k == NULL)
+    return NULL;
+
+  write_keymap_cache(k);
+  *mapped = 0;
+  return k;
+}
+
+// The janus heap has room for every janus key of every device.
+static void size_janus_heap() {
+  janus_heap = realloc(janus_heap, MAX_DEVICES * (km->number_of_janus_keys + 1) * sizeof(janus_deadline));
+}
+
+// Name of our uinput device. (Also how we recognize it in /dev/input,
+// so as not to grab it.)
+#define UINPUT_NAME "08 remapper keyboard"
+
+// Sources of events of the event loop (epoll_event.data.u32). Client
+// i of the control socket is SOURCE_CLIENT + i, input device i is
+// SOURCE_DEVICE + i.
+enum event_source {
+  SOURCE_FOCUS,
+  SOURCE_TIMER,
+  SOURCE_SIGNAL,
+  SOURCE_INOTIFY,
+  SOURCE_CONTROL,
+  SOURCE_CLIENT,
+  SOURCE_DEVICE = SOURCE_CLIENT + MAX_CONTROL_CLIENTS,
+};
+
+int epfd;
+
+static void add_to_epoll(int fd, unsigned int source) {
+  struct epoll_event epev = { .events = EPOLLIN, .data.u32 = source };
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &epev) < 0) {
+    perror("epoll_ctl");
+    exit(1);
+  }
+}
+
+// Where input events come from: a device (see evdev_source), or
+// memory when benchmarking (see 08_bench.c).
+typedef struct input_source {
+  // Set *ev to the next event and return 0. Return -EAGAIN if there
+  // are no more events for now, or the error.
+  int (*next_event)(struct input_source *source, struct input_event *ev);
+} input_source;
+
+// Feed an input event to the engine.
+static void handle_input_event(struct input_event ev) {
+  if (ev.type == EV_KEY)
+    handle_key(ev);
+  else if (ev.type == EV_SYN && ev.code == SYN_REPORT)
+    sync_key_evs(sink);
+}
+
+// Handle all the events source has. Return -EAGAIN once it has no
+// more, or the error.
+static int handle_input_events(input_source *source) {
+  struct input_event ev;
+  int rc;
+
+  while ((rc = source->next_event(source, &ev)) == 0)
+    handle_input_event(ev);
+
+  return rc;
+}
+
+// A key event made up by us (rather than read from a device), stamped
+// with the current time.
+static struct input_event synthetic_key_ev(unsigned int code, int value) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (struct input_event){
+    .input_event_sec = now.tv_sec,
+    .input_event_usec = now.tv_nsec / 1000,
+    .type = EV_KEY,
+    .code = code,
+    .value = value,
+  };
+}
+
+// Events of a (non-blocking) evdev device, read a batch at a time
+// and handed out a frame at a time (see evbatch.h).
+typedef struct {
+  input_source source;
+  struct libevdev *dev;
+  evbatch batch;
+  const struct input_event *frame;
+  size_t frame_size;
+  size_t next; // in frame
+  key_state *state; // of the device, for resyncs
+  struct input_event resync[KEYBOARD_SIZE + 1]; // (a key at most once)
+} evdev_source;
+
+// After a SYN_DROPPED: the events lost, as far as keys go. Throw away
+// whatever is left of the events (as libevdev does), ask the device
+// which keys are down, and make a frame of releases and then presses
+// of the keys the engine has wrong. It goes through the engine like
+// any other frame, so remapped keys, combos and janus keys are
+// released (or pressed) as they would have been. Return its size.
+//
+// Janus keys down (pending or held) never get to physical (see
+// handle_janus_key), so they count as down here by their janus
+// state: one released meanwhile is released, and one still down is
+// not pressed again.
+static size_t resync_frame(evdev_source *s) {
+  keyset down = {0};
+  size_t n = 0;
+
+  keyset was = s->state->physical.down;
+  for (unsigned c = 0; c < KEYBOARD_SIZE; c++) {
+    if (s->state->janus[c] != JANUS_UP)
+      keyset_add(&was, c);
+  }
+
+  evbatch_drain(&s->batch);
+  if (ioctl(s->batch.fd, EVIOCGKEY(sizeof(down.words)), down.words) < 0) {
+    perror("Failed to get the state of the keys");
+    return 0;
+  }
+
+  for (int value = 0; value <= 1; value++) {
+    for (size_t w = 0; w < KEYBOARD_WORDS; w++) {
+      uint64_t bits = value ? down.words[w] & ~was.words[w] : was.words[w] & ~down.words[w];
+      if (w == KEYBOARD_WORDS - 1 && KEYBOARD_SIZE % 64)
+        bits &= (UINT64_C(1) << (KEYBOARD_SIZE % 64)) - 1;
+      while (bits) {
+        s->resync[n++] = synthetic_key_ev(w * 64 + __builtin_ctzll(bits), value);
+        bits &= bits - 1;
+      }
+    }
+  }
+
+  log_info("Re-synced (%zu keys)\n", n);
+  if (n > 0)
+    s->resync[n++] = (struct input_event){
+      .input_event_sec = s->resync[0].input_event_sec,
+      .input_event_usec = s->resync[0].input_event_usec,
+      .type = EV_SYN,
+      .code = SYN_REPORT,
+    };
+  return n;
+}
+
+static int next_evdev_event(input_source *source, struct input_event *ev) {
+  evdev_source *s = (evdev_source *)source;
+
+  while (s->next == s->frame_size) {
+    s->next = 0;
+    s->frame_size = evbatch_next_frame(&s->batch, &s->frame);
+    if (s->frame_size > 0) {
+      if (evbatch_is_drop(s->frame)) {
+        log_info("Dropped\n");
+        s->frame = s->resync;
+        s->frame_size = resync_frame(s);
+      }
+      continue;
+    }
+
+    // After a read that took all there was, do not read again just to
+    // get -EAGAIN: epoll says when there is more.
+    if (s->batch.drained) {
+      s->batch.drained = 0;
+      return -EAGAIN;
+    }
+    int rc = evbatch_read(&s->batch);
+    if (rc < 0)
+      return rc;
+  }
+
+  *ev = s->frame[s->next++];
+  return 0;
+}
+
+// Input devices (keyboards) we have grabbed. They all write to the
+// same uidev, but each has its own key state.
+//
+// devices[i] is the device whose events come with SOURCE_DEVICE + i,
+// so getting from an epoll event to its device is an index.
+
+typedef struct {
+  char path[64];
+  int fd;
+  evdev_source source;
+  key_state state;
+} input_device;
+
+input_device *devices[MAX_DEVICES];
+
+// Whether to grab every keyboard that shows up in /dev/input (when no
+// device is given on the command line).
+int hotplug = 0;
+
+static unsigned int number_of_devices() {
+  unsigned int n = 0;
+  for (size_t i = 0; i < MAX_DEVICES; i++)
+    if (devices[i])
+      n++;
+  return n;
+}
+
+static int is_keyboard(struct libevdev *dev) {
+  return libevdev_has_event_code(dev, EV_KEY, KEY_A)
+         && libevdev_has_event_code(dev, EV_KEY, KEY_Z)
+         && libevdev_has_event_code(dev, EV_KEY, KEY_ENTER);
+}
+
+// Open and grab the device at path, unless we already have it. If
+// only_keyboards, devices which are not keyboards are skipped quietly.
+static void add_device(const char *path, int only_keyboards) {
+  int slot = -1;
+
+  for (int i = 0; i < MAX_DEVICES; i++) {
+    if (devices[i] && strcmp(devices[i]->path, path) == 0)
+      return;
+    if (!devices[i] && slot < 0)
+      slot = i;
+  }
+  if (slot < 0) {
+    fprintf(stderr, "Too many devices, not grabbing %s\n", path);
+    return;
+  }
+
+  int fd = open(path, O_RDONLY|O_NONBLOCK|O_CLOEXEC);
+  if (fd < 0) {
+    if (!only_keyboards)
+      perror("Failed to open device");
+    return;
+  }
+
+  struct libevdev *dev = NULL;
+  int rc = libevdev_new_from_fd(fd, &dev);
+  if (rc < 0) {
+    fprintf(stderr, "Failed to init libevdev (%s)\n", strerror(-rc));
+    close(fd);
+    return;
+  }
+
+  if (strcmp(libevdev_get_name(dev), UINPUT_NAME) == 0
+      || (only_keyboards && !is_keyboard(dev))) {
+    libevdev_free(dev);
+    close(fd);
+    return;
+  }
+
+  // Have the kernel timestamp events with the clock we measure
+  // latencies with.
+  rc = libevdev_set_clock_id(dev, CLOCK_MONOTONIC);
+  if (rc < 0) {
+    fprintf(stderr, "Failed to set clock (%s)\n", strerror(-rc));
+    libevdev_free(dev);
+    close(fd);
+    return;
+  }
+
+  int grab = libevdev_grab(dev, LIBEVDEV_GRAB);
+  if (grab < 0) {
+    printf("grab < 0\n");
+    libevdev_free(dev);
+    close(fd);
+    return;
+  }
+
+  input_device *d = calloc(1, sizeof(input_device));
+  snprintf(d->path, sizeof(d->path), "%s", path);
+  d->fd = fd;
+  d->source = (evdev_source){ { next_evdev_event }, dev, { .fd = fd } };
+  d->source.state = &d->state;
+  devices[slot] = d;
+  add_to_epoll(fd, SOURCE_DEVICE + slot);
+
+  log_info("Grabbed %s (%s)\n", path, libevdev_get_name(dev));
+}
+
+// Forget device i (it has been unplugged, or reading from it failed).
+static void remove_device(int i) {
+  input_device *d = devices[i];
+
+  // Release whatever is still down on it, so that nothing stays
+  // stuck on uidev. (Janus keys still pending never sent anything.)
+  ks = &d->state;
+  decide_pending_janus_keys(0);
+  // (Nor did a sequence being typed on it.)
+  if (sequence_depth > 0 && sequence_ks == ks)
+    reset_sequence();
+  if (repeat.macro && repeat.ks == ks)
+    stop_repeat();
+  for (size_t c = 0; c < KEYBOARD_SIZE; c++) {
+    if (ks->janus[c] == JANUS_HELD)
+      handle_key(synthetic_key_ev(c, 0));
+  }
+  const keyset *down = &ks->physical.down;
+  for (unsigned c = keyset_next(down, 0); c < KEY_CNT; c = keyset_next(down, c + 1))
+    handle_key(synthetic_key_ev(c, 0));
+  sync_key_evs(sink);
+
+  epoll_ctl(epfd, EPOLL_CTL_DEL, d->fd, NULL);
+  libevdev_free(d->source.dev);
+  close(d->fd);
+  devices[i] = NULL;
+
+  log_info("Removed %s\n", d->path);
+  free(d);
+}
+
+static void handle_device_events(int i) {
+  ks = &devices[i]->state;
+
+  int rc = handle_input_events(&devices[i]->source.source);
+  if (rc != -EAGAIN) {
+    if (rc != -ENODEV)
+      fprintf(stderr, "Failed to handle events: %s\n", strerror(-rc));
+    remove_device(i);
+  }
+}
+
+// Grab all the keyboards already in /dev/input.
+static void scan_devices() {
+  DIR *dir = opendir("/dev/input");
+  if (dir == NULL) {
+    perror("Failed to open /dev/input");
+    return;
+  }
+
+  struct dirent *entry;
+  while ((entry = readdir(dir))) {
+    if (strncmp(entry->d_name, "event", 5) != 0)
+      continue;
+    char path[64];
+    snprintf(path, sizeof(path), "/dev/input/%s", entry->d_name);
+    add_device(path, 1);
+  }
+
+  closedir(dir);
+}
+
+// Switch to the keymap of the config file as it is now. If it cannot
+// be loaded, the current one stays.
+//
+// The switch happens between two key events (there is no other
+// thread looking at km). Keys which are down stay down: they are
+// released according to the new keymap, except for janus keys,
+// which release the function they were held as. (Janus keys still
+// pending are held first, by the old keymap.) The key repeating, if
+// any, stops.
+static void reload_config() {
+  int mapped;
+  uint64_t start = monotonic_ns();
+  keymap *new_km = load_keymap(&mapped);
+  if (new_km == NULL) {
+    fprintf(stderr, "Keeping the current config\n");
+    return;
+  }
+
+  frame_time_ns = monotonic_ns();
+  for (size_t i = 0; i < MAX_DEVICES; i++) {
+    if (devices[i] && devices[i]->state.pending_janus_keys > 0) {
+      ks = &devices[i]->state;
+      dt = active_dispatch_table;
+      if (ks->dt != dt)
+        recompute_logically_down();
+      decide_pending_janus_keys(1);
+      sync_key_evs(sink);
+    }
+  }
+  // The trie is replaced too: give up the sequence being typed.
+  expire_sequence(UINT64_MAX);
+  stop_repeat();
+
+  free_keymap(km, km_is_mapped);
+  km = new_km;
+  km_is_mapped = mapped;
+  size_janus_heap();
+  set_currently_focused_window(focused_window_class);
+
+  // (So that handle_key recomputes them.)
+  for (size_t i = 0; i < MAX_DEVICES; i++) {
+    if (devices[i])
+      devices[i]->state.dt = NULL;
+  }
+
+  log_info("Loaded %s (%s) in %llu us\n",
+           config_path, mapped ? "cached" : "compiled",
+           (unsigned long long)(monotonic_ns() - start) / 1000);
+}
+
+// inotify watches: /dev/input (for new keyboards, if hotplug) and the
+// directory of the config file (if any). The config file is watched
+// through its directory because editors tend to replace the file
+// rather than write to it.
+int inotify_fd = -1;
+int dev_input_wd = -1;
+int config_wd = -1;
+char *config_file_name;
+
+// Grab the keyboards that show up in /dev/input (we watch for
+// IN_ATTRIB too, because udev may only make the node readable after
+// it has been created), and reload the config file when it changes.
+static void handle_inotify() {
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t len;
+  int config_changed = 0;
+
+  while ((len = read(inotify_fd, buf, sizeof(buf))) > 0) {
+    for (char *p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+      struct inotify_event *event = (struct inotify_event *)p;
+      if (event->len == 0)
+        continue;
+      if (event->wd == config_wd) {
+        if (strcmp(event->name, config_file_name) == 0)
+          config_changed = 1;
+        continue;
+      }
+      if (event->wd != dev_input_wd || strncmp(event->name, "event", 5) != 0)
+        continue;
+      char path[64];
+      snprintf(path, sizeof(path), "/dev/input/%s", event->name);
+      add_device(path, 1);
+    }
+  }
+
+  // (Once, however many events the change took.)
+  if (config_changed)
+    reload_config();
+}
+
+// Create uidev, the device all the grabbed keyboards write to. It
+// can send every key (but no buttons, so that it is not taken for a
+// mouse or a joystick).
+static int create_uinput_device() {
+  struct libevdev *template = libevdev_new();
+  libevdev_set_name(template, UINPUT_NAME);
+  libevdev_enable_event_type(template, EV_SYN);
+  libevdev_enable_event_type(template, EV_KEY);
+  for (unsigned int code = 1; code <= KEY_MAX; code++) {
+    if (code < BTN_MISC
+        || (code >= KEY_OK && code < BTN_DPAD_UP)
+        || (code > BTN_DPAD_RIGHT && code < BTN_TRIGGER_HAPPY))
+      libevdev_enable_event_code(template, EV_KEY, code, NULL);
+  }
+
+  int uifd = open("/dev/uinput", O_RDWR);
+  if (uifd < 0) {
+    printf("uifd < 0 (Do you have the right privileges?)\n");
+    return -errno;
+  }
+
+  int err = libevdev_uinput_create_from_device(template, uifd, &uidev);
+  libevdev_free(template);
+  return err;
+}
+
+static void write_uinput_frame(output_sink *sink, const struct input_event *evs, size_t n) {
+  ssize_t size = n * sizeof(struct input_event);
+  if (write(libevdev_uinput_get_fd(uidev), evs, size) != size) {
+    perror("Error in writing events\n");
+    exit(errno);
+  }
+}
+
+output_sink uinput_sink = { write_uinput_frame };
+
+static void handle_timer() {
+  uint64_t expirations;
+  if (read(timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+    perror("Failed to read timer");
+
+  timer_deadline = 0;
+  expire_deadlines(monotonic_ns());
+}
+
+// SIGUSR1 dumps the latency histograms, SIGINT and SIGTERM dump them
+// and stop the event loop. Return whether to keep going.
+static int handle_signal(int signal_fd) {
+  struct signalfd_siginfo info;
+
+  while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+    dump_latency_histograms(stderr);
+    if (info.ssi_signo != SIGUSR1)
+      return 0;
+  }
+
+  return 1;
+}
+
+// Control socket (REMAPPER_CONTROL=<path>): a Unix stream socket to
+// ask the remapper what it is doing, and to tell it a few things,
+// while it runs. A request is a line, and its reply is lines ended by
+// an empty one (errors start with "error:"):
+//
+//   maps              the window map in use: its key repeat, its
+//                     keys' primary functions, its combos, and the
+//                     janus keys (as in the config, macros by number)
+//   keys              what is down on each device: physically,
+//                     logically, and the janus keys held or pending
+//   profile [class]   the window map in use, or use that of class
+//                     instead (until the focus changes)
+//   trace [on|off]    whether key events are traced (to
+//                     REMAPPER_TRACE), or start or stop tracing them
+//   latency           the latency histograms, as SIGUSR1 dumps them
+//
+// E.g.
+//
+//   echo keys | socat - UNIX-CONNECT:<path>
+//
+// Clients are served by the event loop, between two input frames, and
+// are never waited for: a client whose reply does not fit in the
+// socket's buffer (it is not reading them) is dropped. As with the
+// focus socket, whoever can connect can switch window maps.
+#define CONTROL_LINE_SIZE 256
+#define CONTROL_REPLY_SIZE 65536
+
+typedef struct {
+  int fd;
+  char line[CONTROL_LINE_SIZE]; // (part of) the request coming in
+  size_t size;
+} control_client;
+
+int control_fd = -1;
+control_client *control_clients[MAX_CONTROL_CLIENTS];
+char control_reply[CONTROL_REPLY_SIZE];
+
+static void open_control_socket(const char *path) {
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  if (*path == '\0' || strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Bad REMAPPER_CONTROL: %s\n", path);
+    exit(1);
+  }
+  strcpy(addr.sun_path, path);
+
+  control_fd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+  unlink(path);
+  if (control_fd < 0 || bind(control_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+      || listen(control_fd, MAX_CONTROL_CLIENTS) < 0) {
+    perror("Failed to open control socket");
+    exit(1);
+  }
+  add_to_epoll(control_fd, SOURCE_CONTROL);
+  log_info("Listening for control requests on %s\n", path);
+}
+
+static void accept_control_clients() {
+  int fd;
+  // (Clients are read and written with MSG_DONTWAIT: their sockets
+  // need not be non-blocking.)
+  while ((fd = accept(control_fd, NULL, NULL)) >= 0) {
+    int slot = 0;
+    while (slot < MAX_CONTROL_CLIENTS && control_clients[slot])
+      slot++;
+    if (slot == MAX_CONTROL_CLIENTS) {
+      close(fd);
+      continue;
+    }
+    control_clients[slot] = calloc(1, sizeof(control_client));
+    control_clients[slot]->fd = fd;
+    add_to_epoll(fd, SOURCE_CLIENT + slot);
+  }
+}
+
+static void remove_control_client(int i) {
+  epoll_ctl(epfd, EPOLL_CTL_DEL, control_clients[i]->fd, NULL);
+  close(control_clients[i]->fd);
+  free(control_clients[i]);
+  control_clients[i] = NULL;
+}
+
+// Print code as the config names it: without KEY_, - for none, or as
+// a number if it has no name.
+static void print_code(FILE *f, unsigned code) {
+  const char *name = code ? libevdev_event_code_get_name(EV_KEY, code) : "-";
+  if (name == NULL)
+    fprintf(f, " %u", code);
+  else
+    fprintf(f, " %s", strncmp(name, "KEY_", 4) == 0 ? name + 4 : name);
+}
+
+static void print_keyset(FILE *f, const char *what, const keyset *s) {
+  fprintf(f, "%s", what);
+  for (unsigned c = keyset_next(s, 0); c < KEY_CNT; c = keyset_next(s, c + 1))
+    print_code(f, c);
+  fprintf(f, "\n");
+}
+
+static void print_window_map(FILE *f) {
+  fprintf(f, "window %u %s (focused: %s)\n", focused_window_map,
+          compiled_window_maps()[focused_window_map].class_name, focused_window_class);
+}
+
+static void print_maps(FILE *f) {
+  dispatch_table *t = active_dispatch_table;
+  print_window_map(f);
+  fprintf(f, "repeat %u %u\n", t->repeat_delay, t->repeat_interval ? 1000000 / t->repeat_interval : 0);
+
+  for (unsigned c = 0; c < KEYBOARD_SIZE; c++) {
+    if (t->first_fun[c] != c) {
+      fprintf(f, "key");
+      print_code(f, c);
+      print_code(f, t->first_fun[c]);
+      fprintf(f, "\n");
+    }
+  }
+
+  key_map *combos = KEYMAP_AT(key_map, t->combos);
+  for (unsigned c = 0; c < KEYBOARD_SIZE; c++) {
+    dispatch_span span = t->combos_by_key_from[c];
+    for (size_t i = span.start; i < span.start + span.count; i++) {
+      fprintf(f, "combo");
+      print_code(f, combos[i].mod_from);
+      print_code(f, combos[i].key_from);
+      print_code(f, combos[i].mod_to);
+      if (combos[i].macro)
+        fprintf(f, " @%u\n", combos[i].macro);
+      else {
+        print_code(f, combos[i].key_to);
+        fprintf(f, "\n");
+      }
+    }
+  }
+
+  for (unsigned c = 0; c < KEYBOARD_SIZE; c++) {
+    if (km->secondary_fun[c]) {
+      fprintf(f, "janus");
+      print_code(f, c);
+      print_code(f, km->secondary_fun[c]);
+      fprintf(f, "\n");
+    }
+  }
+}
+
+static void print_keys(FILE *f) {
+  for (size_t i = 0; i < MAX_DEVICES; i++) {
+    if (devices[i] == NULL)
+      continue;
+    key_state *s = &devices[i]->state;
+    fprintf(f, "device %s\n", devices[i]->path);
+    print_keyset(f, "physical", &s->physical.down);
+    print_keyset(f, "logical", &s->logically_down);
+
+    keyset held = {0}, pending = {0};
+    for (unsigned c = 0; c < KEYBOARD_SIZE; c++) {
+      if (s->janus[c] == JANUS_HELD)
+        keyset_add(&held, c);
+      else if (s->janus[c] == JANUS_PENDING)
+        keyset_add(&pending, c);
+    }
+    print_keyset(f, "janus held", &held);
+    print_keyset(f, "janus pending", &pending);
+  }
+}
+
+// Handle request line (words, split), writing the reply to f.
+static void handle_control_request(FILE *f, char **words, int n) {
+  if (n == 1 && strcmp(words[0], "maps") == 0) {
+    print_maps(f);
+  } else if (n == 1 && strcmp(words[0], "keys") == 0) {
+    print_keys(f);
+  } else if (n <= 2 && strcmp(words[0], "profile") == 0) {
+    if (n == 2)
+      set_currently_focused_window(words[1]);
+    print_window_map(f);
+  } else if (n <= 2 && strcmp(words[0], "trace") == 0) {
+    if (n == 2 && !trace_thread_started)
+      fprintf(f, "error: no trace file (see REMAPPER_TRACE)\n");
+    else if (n == 2 && (strcmp(words[1], "on") == 0 || strcmp(words[1], "off") == 0))
+      atomic_store(&tracing, strcmp(words[1], "on") == 0);
+    else if (n == 2)
+      fprintf(f, "error: expected trace [on|off]\n");
+    fprintf(f, "trace %s (dropped %lu)\n", atomic_load(&tracing) ? "on" : "off",
+            atomic_load(&trace_dropped));
+  } else if (n == 1 && strcmp(words[0], "latency") == 0) {
+    dump_latency_histograms(f);
+  } else {
+    fprintf(f, "error: expected maps, keys, profile [class], trace [on|off] or latency\n");
+  }
+}
+
+// Handle the requests client i has sent (whole lines of them).
+static void handle_control_client(int i) {
+  control_client *c = control_clients[i];
+
+  for (;;) {
+    ssize_t len = recv(c->fd, c->line + c->size, sizeof(c->line) - c->size, MSG_DONTWAIT);
+    if (len == 0 || (len < 0 && errno != EAGAIN)) {
+      remove_control_client(i);
+      return;
+    }
+    if (len < 0)
+      return;
+    c->size += len;
+
+    char *line, *end;
+    for (line = c->line; (end = memchr(line, '\n', c->line + c->size - line)); line = end + 1) {
+      *end = '\0';
+      char *words[3];
+      int n = 0;
+      for (char *w = strtok(line, " \t\r"); w && n < 3; w = strtok(NULL, " \t\r"))
+        words[n++] = w;
+      if (n == 0)
+        continue;
+
+      FILE *f = fmemopen(control_reply, sizeof(control_reply), "w");
+      handle_control_request(f, words, n);
+      fprintf(f, "\n");
+      size_t size = ftell(f);
+      fclose(f);
+      if (send(c->fd, control_reply, size, MSG_DONTWAIT|MSG_NOSIGNAL) != size) {
+        remove_control_client(i);
+        return;
+      }
+    }
+
+    // Keep what has come of the next request.
+    c->size -= line - c->line;
+    memmove(c->line, line, c->size);
+    if (c->size == sizeof(c->line)) {
+      remove_control_client(i); // (no such request)
+      return;
+    }
+  }
+}
+
+#ifndef REMAPPER_NO_MAIN
+
+// Usage:
+//   08 [device...]
+//
+// With no devices, every keyboard in /dev/input is grabbed, including
+// those plugged in later.
+int main(int argc, char **argv)
+{
+  // Load the keymap (the per-window dispatch tables handle_key looks
+  // keys up in, and the janus keys): from the config file if there is
+  // one, from the config compiled in otherwise.
+  uint64_t start = monotonic_ns();
+  config_path = getenv("REMAPPER_CONFIG");
+  if (config_path) {
+    snprintf(config_cache_path, sizeof(config_cache_path), "%s.cache", config_path);
+    km = load_keymap(&km_is_mapped);
+    if (km == NULL)
+      return 1;
+  } else {
+    km = compile_keymap(&builtin_config, 0, 0);
+  }
+  log_info("Loaded %s (%s) in %llu us\n",
+           config_path ? config_path : "builtin config", km_is_mapped ? "cached" : "compiled",
+           (unsigned long long)(monotonic_ns() - start) / 1000);
+  active_dispatch_table = &compiled_window_maps()[0].table;
+  size_janus_heap();
+
+  // SIGUSR1/SIGINT/SIGTERM are read from a signalfd in the event
+  // loop. (Block them before starting the trace thread, so that it
+  // inherits the mask.)
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGUSR1);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+  // Start tracing, if asked to
+  char *trace_file_name = getenv("REMAPPER_TRACE");
+  if (trace_file_name) {
+    FILE *trace_file = fopen(trace_file_name, "w");
+    if (trace_file == NULL) {
+      perror("Failed to open trace file");
+      return 1;
+    }
+    pthread_t tthread;
+    pthread_create(&tthread, NULL, trace_thread, trace_file);
+    trace_thread_started = 1;
+    atomic_store(&tracing, 1);
+  }
+
+  // Start tracking windows
+  char *focus_spec = getenv("REMAPPER_FOCUS");
+  int focus_fd = open_focus_provider(focus_spec ? focus_spec : "x11");
+
+  // Event loop: a single thread waits on the keyboards, the focus
+  // provider, the timer, the signals, /dev/input and the control
+  // socket's clients.
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+  int signal_fd = signalfd(-1, &signals, SFD_NONBLOCK|SFD_CLOEXEC);
+  if (timer_fd < 0 || signal_fd < 0 || epfd < 0) {
+    perror("Failed to set up the event loop");
+    return 1;
+  }
+  if (focus_fd >= 0)
+    add_to_epoll(focus_fd, SOURCE_FOCUS);
+  add_to_epoll(timer_fd, SOURCE_TIMER);
+  add_to_epoll(signal_fd, SOURCE_SIGNAL);
+
+  int err = create_uinput_device();
+  if (err != 0)
+    return err;
+  sink = &uinput_sink;
+
+  usleep(200000); // let (KEY_ENTER), value 0 go through before
+  // (Probably better: We could just send KEY_ENTER 0 instead)
+
+  // Do libevdev stuff
+  inotify_fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+  if (inotify_fd < 0) {
+    perror("inotify_init1");
+    return 1;
+  }
+  add_to_epoll(inotify_fd, SOURCE_INOTIFY);
+
+  char *control_path = getenv("REMAPPER_CONTROL");
+  if (control_path)
+    open_control_socket(control_path);
+
+  if (config_path) {
+    char config_dir[PATH_MAX];
+    snprintf(config_dir, sizeof(config_dir), "%s", config_path);
+    char *slash = strrchr(config_dir, '/');
+    if (slash) {
+      *slash = '\0';
+      config_file_name = config_path + (slash - config_dir) + 1;
+    } else {
+      strcpy(config_dir, ".");
+      config_file_name = config_path;
+    }
+    config_wd = inotify_add_watch(inotify_fd, config_dir[0] ? config_dir : "/", IN_CLOSE_WRITE|IN_MOVED_TO);
+    if (config_wd < 0)
+      perror("Failed to watch config (it will not be reloaded)");
+  }
+
+  hotplug = argc < 2;
+  if (hotplug) {
+    dev_input_wd = inotify_add_watch(inotify_fd, "/dev/input", IN_CREATE|IN_ATTRIB);
+    if (dev_input_wd < 0) {
+      perror("Failed to watch /dev/input");
+      return 1;
+    }
+    scan_devices();
+  } else {
+    for (int i = 1; i < argc; i++)
+      add_device(argv[i], 0);
+    if (number_of_devices() == 0)
+      return 1;
+  }
+
+  // The focused window (asked for by open_display, say), and focus
+  // changes which may have come in meanwhile.
+  if (focus_fd >= 0)
+    focus->handle_events(focus);
+
+  int running = 1;
+  while (running) {
+    struct epoll_event epevs[8];
+    int n = epoll_wait(epfd, epevs, 8, -1);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("epoll_wait");
+      break;
+    }
+
+    for (int i = 0; i < n; i++) {
+      unsigned int source = epevs[i].data.u32;
+
+      if (source >= SOURCE_DEVICE) {
+        // (It may have been removed by an earlier event of this same
+        // epoll_wait.)
+        if (devices[source - SOURCE_DEVICE])
+          handle_device_events(source - SOURCE_DEVICE);
+        // Without hotplug there is no point in going on once all the
+        // devices we were given are gone.
+        if (!hotplug && number_of_devices() == 0)
+          running = 0;
+        continue;
+      }
+
+      if (source >= SOURCE_CLIENT) {
+        if (control_clients[source - SOURCE_CLIENT])
+          handle_control_client(source - SOURCE_CLIENT);
+        continue;
+      }
+
+      switch (source) {
+      case SOURCE_FOCUS:
+        focus->handle_events(focus);
+        break;
+      case SOURCE_TIMER:
+        handle_timer();
+        break;
+      case SOURCE_SIGNAL:
+        running = handle_signal(signal_fd);
+        break;
+      case SOURCE_INOTIFY:
+        handle_inotify();
+        break;
+      case SOURCE_CONTROL:
+        accept_control_clients();
+        break;
+      }
+    }
+  }
+
+  dump_latency_histograms(stderr);
+
+  return 0;
+}
+
+#endif // REMAPPER_NO_MAIN
@@ -0,0 +1,340 @@
+/*
+  Replay benchmark for the remapping engine of 08.c.
+
+  Streams of input events are fed to the engine from memory (an
+  input_source) and what it sends is collected in memory (an
+  output_sink), so no device, uinput or X server is involved. For
+  each stream, events/s and ns per event are printed.
+
+  Streams are either recordings (made with 01_print_events.c -r, see
+  evtrace.h, or files of raw struct input_event, as read from
+  /dev/input/eventN) or synthetic mixes:
+
+  - plain: typing with keys which are not mapped at all
+  - combo: combos of the default window map (RIGHTCTRL+F, RIGHTALT+F,
+    RIGHTCTRL+ESC...), with the keyboard's key repeats (which 08
+    drops, repeating keys itself)
+  - janus: janus keys tapped, held alone past max_delay, and held with
+    other keys
+
+  Janus and repeat deadlines are expired by event time (as if the
+  timerfd fired right on time), so replays do not depend on how fast
+  they run.
+
+  ###### ###### ###### ###### ###### ######
+
+  Compile with:
+  gcc -O2 -DNDEBUG `pkg-config --cflags libevdev` ./08_bench.c `pkg-config --libs libevdev xcb` -pthread -o 08_bench
+
+  Usage:
+  08_bench [-n events] [-c window class] [recording...]
+
+  With no recordings, the synthetic mixes are run, with about
+  `events` events each (default 4000000). The keymap is the one 08
+  would use (REMAPPER_CONFIG works the same), and the window map is
+  that of `window class` (default: the default window map).
+
+  ###### ###### ###### ###### ###### ######
+ */
+
+#define REMAPPER_NO_MAIN
+#include "08.c"
+#include "evtrace.h"
+
+// Events fed from an array.
+typedef struct {
+  input_source source;
+  const struct input_event *evs;
+  size_t size;
+  size_t next;
+} memory_source;
+
+static int next_memory_event(input_source *source, struct input_event *ev) {
+  memory_source *m = (memory_source *)source;
+
+  if (m->next == m->size)
+    return -EAGAIN;
+  *ev = m->evs[m->next++];
+
+  // Janus keys (and sequences, and repeats) due by now are decided
+  // before this event is handled.
+  uint64_t now = (uint64_t)ev->input_event_sec * 1000000000 + (uint64_t)ev->input_event_usec * 1000;
+  expire_deadlines(now);
+
+  return 0;
+}
+
+// Counts what the engine sends. (And folds it into a checksum, so
+// that the work cannot be optimized away.)
+typedef struct {
+  output_sink sink;
+  size_t events;
+  size_t frames;
+  uint64_t checksum;
+} memory_sink;
+
+static void write_memory_frame(output_sink *sink, const struct input_event *evs, size_t n) {
+  memory_sink *m = (memory_sink *)sink;
+
+  for (size_t i = 0; i < n; i++)
+    m->checksum = m->checksum * 31 + ((uint64_t)evs[i].code << 8) + evs[i].value;
+  m->events += n;
+  m->frames++;
+}
+
+// A stream of input events being generated.
+typedef struct {
+  struct input_event *evs;
+  size_t size;
+  size_t capacity;
+  uint64_t time_ns;
+  unsigned int seed;
+} stream;
+
+static unsigned int random_below(stream *s, unsigned int n) {
+  s->seed = s->seed * 1103515245 + 12345;
+  return (s->seed >> 16) % n;
+}
+
+static void push_ev(stream *s, unsigned short type, unsigned short code, int value) {
+  if (s->size == s->capacity) {
+    s->capacity = s->capacity ? 2 * s->capacity : 4096;
+    s->evs = realloc(s->evs, s->capacity * sizeof(struct input_event));
+  }
+  s->evs[s->size++] = (struct input_event){
+    .input_event_sec = s->time_ns / 1000000000,
+    .input_event_usec = s->time_ns % 1000000000 / 1000,
+    .type = type,
+    .code = code,
+    .value = value,
+  };
+}
+
+// A frame with a single key event, ms after the previous one.
+static void push_key(stream *s, unsigned int ms, unsigned short code, int value) {
+  s->time_ns += (uint64_t)ms * 1000000;
+  push_ev(s, EV_KEY, code, value);
+  push_ev(s, EV_SYN, SYN_REPORT, 0);
+}
+
+static void tap(stream *s, unsigned short code) {
+  push_key(s, 40, code, 1);
+  push_key(s, 60, code, 0);
+}
+
+unsigned short plain_keys[] = {
+  KEY_B, KEY_C, KEY_D, KEY_E, KEY_H, KEY_I, KEY_J, KEY_K, KEY_M,
+  KEY_N, KEY_O, KEY_P, KEY_R, KEY_S, KEY_T, KEY_U, KEY_V, KEY_X,
+  KEY_Y, KEY_Z, KEY_SPACE, KEY_DOT, KEY_COMMA, KEY_BACKSPACE,
+};
+
+#define NUMBER_OF_PLAIN_KEYS (sizeof(plain_keys) / sizeof(plain_keys[0]))
+
+static void generate_plain(stream *s, size_t n) {
+  while (s->size < n)
+    tap(s, plain_keys[random_below(s, NUMBER_OF_PLAIN_KEYS)]);
+}
+
+static void generate_combo(stream *s, size_t n) {
+  static const unsigned short combos[][2] = {
+    { KEY_RIGHTCTRL, KEY_F },
+    { KEY_RIGHTALT,  KEY_F },
+    { KEY_RIGHTCTRL, KEY_ESC },
+    { KEY_RIGHTCTRL, KEY_G },
+    { KEY_LEFTCTRL,  KEY_F },
+  };
+
+  while (s->size < n) {
+    const unsigned short *combo = combos[random_below(s, sizeof(combos) / sizeof(combos[0]))];
+    push_key(s, 40, combo[0], 1);
+    push_key(s, 30, combo[1], 1);
+    for (unsigned int r = random_below(s, 4); r > 0; r--)
+      push_key(s, 33, combo[1], 2);
+    // Release in either order.
+    if (random_below(s, 2)) {
+      push_key(s, 50, combo[1], 0);
+      push_key(s, 20, combo[0], 0);
+    } else {
+      push_key(s, 50, combo[0], 0);
+      push_key(s, 20, combo[1], 0);
+    }
+    tap(s, plain_keys[random_below(s, NUMBER_OF_PLAIN_KEYS)]);
+  }
+}
+
+static void generate_janus(stream *s, size_t n) {
+  static const unsigned short janus[] = { KEY_CAPSLOCK, KEY_ENTER };
+
+  while (s->size < n) {
+    unsigned short key = janus[random_below(s, 2)];
+
+    switch (random_below(s, 3)) {
+    case 0: // tap
+      tap(s, key);
+      break;
+    case 1: // held alone (past the deadline)
+      push_key(s, 40, key, 1);
+      push_key(s, 400, key, 0);
+      break;
+    case 2: // held with another key
+      push_key(s, 40, key, 1);
+      tap(s, plain_keys[random_below(s, NUMBER_OF_PLAIN_KEYS)]);
+      push_key(s, 30, key, 0);
+      break;
+    }
+    tap(s, plain_keys[random_below(s, NUMBER_OF_PLAIN_KEYS)]);
+  }
+}
+
+static void push_recorded_ev(stream *s, const struct input_event *ev) {
+  push_ev(s, ev->type, ev->code, ev->value);
+  s->evs[s->size - 1].input_event_sec = ev->input_event_sec;
+  s->evs[s->size - 1].input_event_usec = ev->input_event_usec;
+}
+
+// Read a recording: either an evtrace file, or raw input_events.
+static int read_recording(const char *path, stream *s) {
+  int fd = open(path, O_RDONLY|O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    perror(path);
+    return -1;
+  }
+
+  void *data = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+  close(fd);
+  if (data == MAP_FAILED) {
+    perror(path);
+    return -1;
+  }
+
+  evtrace_reader r;
+  if (evtrace_open(&r, data, st.st_size) == 0) {
+    struct input_event frame[EVTRACE_MAX_FRAME];
+    int n;
+    while ((n = evtrace_next_frame(&r, frame)) > 0) {
+      for (int i = 0; i < n; i++)
+        push_recorded_ev(s, &frame[i]);
+    }
+    if (n < 0)
+      fprintf(stderr, "%s: corrupt after %zu events\n", path, s->size);
+  } else {
+    const struct input_event *evs = data;
+    for (size_t i = 0; i < st.st_size / sizeof(struct input_event); i++)
+      push_recorded_ev(s, &evs[i]);
+  }
+
+  if (data)
+    munmap(data, st.st_size);
+  return 0;
+}
+
+// Replay s into a fresh engine state (the same for every run): what
+// the run before left (a key repeating, a sequence half typed, the
+// timer armed) is forgotten.
+static uint64_t replay(stream *s, memory_sink *out) {
+  key_state state = {0};
+  memory_source in = { { next_memory_event }, s->evs, s->size, 0 };
+
+  ks = &state;
+  janus_heap_size = 0;
+  timer_deadline = 0;
+  stop_repeat();
+  reset_sequence();
+  sequence_ks = NULL;
+  memset(&sequence_swallowed, 0, sizeof(sequence_swallowed));
+  frame_path = PATH_PASSTHROUGH;
+  out_queue_size = 0;
+  *out = (memory_sink){ { write_memory_frame } };
+  sink = &out->sink;
+
+  uint64_t start = monotonic_ns();
+  handle_input_events(&in.source);
+  return monotonic_ns() - start;
+}
+
+#define RUNS 5
+
+// Replay s a few times and print the best run.
+static void bench(const char *name, stream *s) {
+  memory_sink out;
+  uint64_t best = UINT64_MAX;
+
+  for (int run = 0; run < RUNS; run++) {
+    uint64_t ns = replay(s, &out);
+    if (ns < best)
+      best = ns;
+  }
+
+  printf("%-12s %10zu events %10zu out %8.2f Mevents/s %8.1f ns/event (checksum %016llx)\n",
+         name, s->size, out.events,
+         s->size / (best / 1e3), (double)best / s->size,
+         (unsigned long long)out.checksum);
+}
+
+int main(int argc, char **argv)
+{
+  size_t n = 4000000;
+  char *window_class = "Default";
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:c:")) != -1) {
+    switch (opt) {
+    case 'n':
+      n = strtoul(optarg, NULL, 10);
+      break;
+    case 'c':
+      window_class = optarg;
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-n events] [-c window class] [recording...]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  config_path = getenv("REMAPPER_CONFIG");
+  if (config_path) {
+    snprintf(config_cache_path, sizeof(config_cache_path), "%s.cache", config_path);
+    km = load_keymap(&km_is_mapped);
+    if (km == NULL)
+      return 1;
+  } else {
+    km = compile_keymap(&builtin_config, 0, 0);
+  }
+  set_currently_focused_window(window_class);
+  size_janus_heap();
+
+  // Janus keys arm it (it never fires: deadlines go by event time).
+  timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+
+  printf("%u window maps, %u janus keys\n", km->number_of_window_maps, km->number_of_janus_keys);
+
+  if (optind < argc) {
+    for (int i = optind; i < argc; i++) {
+      stream s = {0};
+      if (read_recording(argv[i], &s) < 0)
+        return 1;
+      bench(argv[i], &s);
+      free(s.evs);
+    }
+    return 0;
+  }
+
+  struct {
+    const char *name;
+    void (*generate)(stream *s, size_t n);
+  } mixes[] = {
+    { "plain", generate_plain },
+    { "combo", generate_combo },
+    { "janus", generate_janus },
+  };
+
+  for (size_t i = 0; i < sizeof(mixes) / sizeof(mixes[0]); i++) {
+    stream s = { .seed = 1, .time_ns = 1000000000 };
+    mixes[i].generate(&s, n);
+    bench(mixes[i].name, &s);
+    free(s.evs);
+  }
+
+  return 0;
+}
@@ -0,0 +1,422 @@
+/*
+  Differential tester for the remappers (03 to 08).
+
+  The same stream of input events is fed to each engine (built into a
+  shared object with engine_harness.c), what each one writes to
+  uinput is caught, and the output of every engine is compared with
+  that of the first one, input frame by input frame. Each engine is
+  timed too (best of a few runs), so that e.g. 08 can be shown to
+  behave as 06 does, and to be no slower.
+
+  The stream is either a recording (made with 01_print_events.c -r,
+  see evtrace.h, or a file of raw struct input_event), or random
+  typing with the keys the remappers care about (ctrl, alt, janus
+  keys, f, b, p, n, ...), which is the same for the same seed.
+
+  Engines start with nothing pressed and the default window focused.
+  Only engines with the same mappings can agree, of course: to
+  compare 08 with 06, give 08 the config 06.conf, which has 06's
+  combos. And 08 repeats keys itself, rather than passing the
+  keyboard's repeats through as 03 to 07 do: with -r, frames of
+  repeats alone are left out of every engine's output.
+
+  ###### ###### ###### ###### ###### ######
+
+  Compile with:
+  gcc -O2 ./diff_engines.c -ldl -o diff_engines
+
+  (And the engines as in engine_harness.c.)
+
+  Usage:
+  diff_engines [-n events] [-s seed] [-t recording] [-r] engine.so...
+
+  E.g.:
+  REMAPPER_CONFIG=06.conf ./diff_engines -r ./06.so ./08.so
+
+  The exit status is 1 if some engine's output differs from the first
+  one's.
+
+  ###### ###### ###### ###### ###### ######
+ */
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "engine_harness.h"
+#include "evtrace.h"
+
+#define RUNS 5
+
+// Differing input frames printed per engine.
+#define MAX_REPORTED_DIFFS 5
+
+static uint64_t monotonic_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// The input events (and the number of the frame each one is in).
+typedef struct {
+  struct input_event *evs;
+  size_t size;
+  size_t capacity;
+  uint32_t *frame_of;
+  size_t number_of_frames;
+  uint64_t time_ns;
+  unsigned int seed;
+} stream;
+
+static void push_ev(stream *s, const struct input_event *ev) {
+  if (s->size == s->capacity) {
+    s->capacity = s->capacity ? 2 * s->capacity : 4096;
+    s->evs = realloc(s->evs, s->capacity * sizeof(struct input_event));
+  }
+  s->evs[s->size++] = *ev;
+}
+
+static void number_frames(stream *s) {
+  s->frame_of = malloc(s->size * sizeof(uint32_t));
+  s->number_of_frames = 0;
+  for (size_t i = 0; i < s->size; i++) {
+    s->frame_of[i] = s->number_of_frames;
+    if (s->evs[i].type == EV_SYN && s->evs[i].code == SYN_REPORT)
+      s->number_of_frames++;
+  }
+}
+
+// Read a recording: either an evtrace file, or raw input_events.
+static int read_recording(const char *path, stream *s) {
+  int fd = open(path, O_RDONLY|O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    perror(path);
+    return -1;
+  }
+
+  void *data = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+  close(fd);
+  if (data == MAP_FAILED) {
+    perror(path);
+    return -1;
+  }
+
+  evtrace_reader r;
+  if (evtrace_open(&r, data, st.st_size) == 0) {
+    struct input_event frame[EVTRACE_MAX_FRAME];
+    int n;
+    while ((n = evtrace_next_frame(&r, frame)) > 0) {
+      for (int i = 0; i < n; i++)
+        push_ev(s, &frame[i]);
+    }
+    if (n < 0)
+      fprintf(stderr, "%s: corrupt after %zu events\n", path, s->size);
+  } else {
+    const struct input_event *evs = data;
+    for (size_t i = 0; i < st.st_size / sizeof(struct input_event); i++)
+      push_ev(s, &evs[i]);
+  }
+
+  if (data)
+    munmap(data, st.st_size);
+  return 0;
+}
+
+static unsigned int random_below(stream *s, unsigned int n) {
+  s->seed = s->seed * 1103515245 + 12345;
+  return (s->seed >> 16) % n;
+}
+
+// A frame with a single key event, ms after the previous one.
+static void push_key(stream *s, unsigned int ms, unsigned short code, int value) {
+  s->time_ns += (uint64_t)ms * 1000000;
+  struct input_event ev = {
+    .input_event_sec = s->time_ns / 1000000000,
+    .input_event_usec = s->time_ns % 1000000000 / 1000,
+    .type = EV_KEY,
+    .code = code,
+    .value = value,
+  };
+  push_ev(s, &ev);
+  ev.type = EV_SYN;
+  ev.code = SYN_REPORT;
+  ev.value = 0;
+  push_ev(s, &ev);
+}
+
+static const unsigned short random_keys[] = {
+  KEY_LEFTCTRL, KEY_RIGHTCTRL, KEY_LEFTALT, KEY_RIGHTALT,
+  KEY_CAPSLOCK, KEY_ENTER, KEY_ESC,
+  KEY_F, KEY_B, KEY_P, KEY_N, KEY_A, KEY_E, KEY_V, KEY_G, KEY_W,
+  KEY_L, KEY_Q, KEY_X, KEY_SPACE,
+};
+
+#define NUMBER_OF_RANDOM_KEYS (sizeof(random_keys) / sizeof(random_keys[0]))
+
+// Up to 3 keys down at a time, repeats, and pauses both shorter and
+// longer than janus keys' max_delay. Every key is up at the end.
+static void generate_random(stream *s, size_t n) {
+  unsigned char down[NUMBER_OF_RANDOM_KEYS] = {0};
+  unsigned int number_down = 0;
+
+  while (s->size < n) {
+    unsigned int k = random_below(s, NUMBER_OF_RANDOM_KEYS);
+    unsigned int ms = random_below(s, 4) ? 5 + random_below(s, 150) : 200 + random_below(s, 400);
+
+    if (down[k] && random_below(s, 3) == 0) {
+      push_key(s, ms, random_keys[k], 2);
+    } else if (down[k]) {
+      push_key(s, ms, random_keys[k], 0);
+      down[k] = 0;
+      number_down--;
+    } else if (number_down < 3) {
+      push_key(s, ms, random_keys[k], 1);
+      down[k] = 1;
+      number_down++;
+    }
+  }
+
+  for (unsigned int k = 0; k < NUMBER_OF_RANDOM_KEYS; k++) {
+    if (down[k])
+      push_key(s, 50, random_keys[k], 0);
+  }
+}
+
+// What an engine wrote: events, each with the input frame it was
+// written for.
+typedef struct {
+  uint32_t frame;
+  uint16_t type;
+  uint16_t code;
+  int32_t value;
+} output_ev;
+
+typedef struct {
+  engine_output output;
+  const stream *in;
+  output_ev *evs;
+  size_t size;
+  size_t capacity;
+} captured_output;
+
+// Whether frames of repeats alone are left out (-r).
+static int without_repeats = 0;
+
+static int is_repeats_only(const struct input_event *evs, size_t n) {
+  int repeats = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (evs[i].type == EV_KEY && evs[i].value != 2)
+      return 0;
+    repeats |= evs[i].type == EV_KEY;
+  }
+  return repeats;
+}
+
+static void capture_frame(engine_output *output, size_t input, const struct input_event *evs, size_t n) {
+  captured_output *c = (captured_output *)output;
+
+  if (without_repeats && is_repeats_only(evs, n))
+    return;
+
+  if (c->size + n > c->capacity) {
+    while (c->size + n > c->capacity)
+      c->capacity = c->capacity ? 2 * c->capacity : 4096;
+    c->evs = realloc(c->evs, c->capacity * sizeof(output_ev));
+  }
+  for (size_t i = 0; i < n; i++)
+    c->evs[c->size++] = (output_ev){ c->in->frame_of[input], evs[i].type, evs[i].code, evs[i].value };
+}
+
+static int devnull = -1;
+
+// Load engine anew (see engine_harness.c) and feed it s. Return the
+// ns it took, or 0 if it could not be run.
+static uint64_t run_engine(const char *path, const stream *s, captured_output *out) {
+  void *so = dlopen(path, RTLD_NOW|RTLD_LOCAL);
+  if (so == NULL) {
+    fprintf(stderr, "%s\n", dlerror());
+    return 0;
+  }
+  engine_run_fn *run = (engine_run_fn *)dlsym(so, ENGINE_RUN);
+  if (run == NULL) {
+    fprintf(stderr, "%s\n", dlerror());
+    dlclose(so);
+    return 0;
+  }
+
+  *out = (captured_output){ { capture_frame }, s, out->evs, 0, out->capacity };
+
+  // The engines print (a lot) to stdout.
+  fflush(stdout);
+  int saved_stdout = dup(STDOUT_FILENO);
+  dup2(devnull, STDOUT_FILENO);
+
+  uint64_t start = monotonic_ns();
+  int rc = run(s->evs, s->size, &out->output);
+  uint64_t ns = monotonic_ns() - start;
+
+  fflush(stdout);
+  dup2(saved_stdout, STDOUT_FILENO);
+  close(saved_stdout);
+  dlclose(so);
+
+  if (rc < 0) {
+    fprintf(stderr, "%s: failed to start\n", path);
+    return 0;
+  }
+  return ns > 0 ? ns : 1;
+}
+
+static void print_frame(const char *prefix, const output_ev *evs, size_t from, size_t to) {
+  printf("%s", prefix);
+  for (size_t i = from; i < to; i++) {
+    if (evs[i].type == EV_KEY)
+      printf(" %u:%d", evs[i].code, evs[i].value);
+    else if (evs[i].type == EV_SYN && evs[i].code == SYN_REPORT)
+      printf(" |");
+    else
+      printf(" (%u %u %d)", evs[i].type, evs[i].code, evs[i].value);
+  }
+  printf("\n");
+}
+
+static void print_input_frame(const stream *s, uint32_t frame) {
+  printf("  input frame %u:", frame);
+  for (size_t i = 0; i < s->size; i++) {
+    if (s->frame_of[i] == frame && s->evs[i].type == EV_KEY)
+      printf(" %u:%d", s->evs[i].code, s->evs[i].value);
+  }
+  printf("\n");
+}
+
+// Compare b with a, input frame by input frame. Return the number of
+// input frames they differ in.
+static size_t diff_outputs(const stream *s, const char *name_a, const captured_output *a,
+                           const char *name_b, const captured_output *b) {
+  size_t i = 0, j = 0, diffs = 0;
+
+  while (i < a->size || j < b->size) {
+    uint32_t frame = UINT32_MAX;
+    if (i < a->size)
+      frame = a->evs[i].frame;
+    if (j < b->size && b->evs[j].frame < frame)
+      frame = b->evs[j].frame;
+
+    size_t end_a = i, end_b = j;
+    while (end_a < a->size && a->evs[end_a].frame == frame)
+      end_a++;
+    while (end_b < b->size && b->evs[end_b].frame == frame)
+      end_b++;
+
+    int same = end_a - i == end_b - j;
+    for (size_t k = 0; same && k < end_a - i; k++) {
+      const output_ev *x = &a->evs[i + k], *y = &b->evs[j + k];
+      same = x->type == y->type && x->code == y->code && x->value == y->value;
+    }
+
+    if (!same && diffs++ < MAX_REPORTED_DIFFS) {
+      print_input_frame(s, frame);
+      char prefix[64];
+      snprintf(prefix, sizeof(prefix), "    %-16s", name_a);
+      print_frame(prefix, a->evs, i, end_a);
+      snprintf(prefix, sizeof(prefix), "    %-16s", name_b);
+      print_frame(prefix, b->evs, j, end_b);
+    }
+
+    i = end_a;
+    j = end_b;
+  }
+
+  return diffs;
+}
+
+int main(int argc, char **argv)
+{
+  size_t n = 1000000;
+  unsigned int seed = 1;
+  const char *recording = NULL;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:s:t:r")) != -1) {
+    switch (opt) {
+    case 'n':
+      n = strtoul(optarg, NULL, 10);
+      break;
+    case 's':
+      seed = strtoul(optarg, NULL, 10);
+      break;
+    case 't':
+      recording = optarg;
+      break;
+    case 'r':
+      without_repeats = 1;
+      break;
+    default:
+      goto usage;
+    }
+  }
+  if (optind == argc)
+    goto usage;
+
+  devnull = open("/dev/null", O_WRONLY|O_CLOEXEC);
+
+  stream s = { .seed = seed, .time_ns = 1000000000 };
+  if (recording) {
+    if (read_recording(recording, &s) < 0)
+      return 2;
+  } else {
+    generate_random(&s, n);
+  }
+  number_frames(&s);
+  printf("%zu events, %zu frames (%s)\n", s.size, s.number_of_frames, recording ? recording : "random");
+
+  int number_of_engines = argc - optind;
+  captured_output *outputs = calloc(number_of_engines, sizeof(captured_output));
+  uint64_t first_best = 0;
+  int status = 0;
+
+  for (int e = 0; e < number_of_engines; e++) {
+    const char *name = argv[optind + e];
+    uint64_t best = UINT64_MAX;
+
+    // (Every run has the same output, as the engine starts afresh.)
+    for (int run = 0; run < RUNS; run++) {
+      uint64_t ns = run_engine(name, &s, &outputs[e]);
+      if (ns == 0)
+        return 2;
+      if (ns < best)
+        best = ns;
+    }
+
+    printf("%-16s %10zu out %8.1f ns/event", name, outputs[e].size, (double)best / s.size);
+    if (e == 0) {
+      first_best = best;
+      printf("\n");
+      continue;
+    }
+    printf(" (%+.1f%% vs %s)\n", 100.0 * ((double)best - first_best) / first_best, argv[optind]);
+
+    size_t diffs = diff_outputs(&s, argv[optind], &outputs[0], name, &outputs[e]);
+    if (diffs) {
+      printf("  %s differs from %s in %zu of %zu input frames\n", name, argv[optind], diffs, s.number_of_frames);
+      status = 1;
+    } else {
+      printf("  same output as %s\n", argv[optind]);
+    }
+  }
+
+  return status;
+
+usage:
+  fprintf(stderr, "Usage: %s [-n events] [-s seed] [-t recording] [-r] engine.so...\n", argv[0]);
+  return 2;
+}
@@ -0,0 +1,212 @@
+/*
+  Cases for the remappers: short streams of input frames, each with
+  the key events an engine must write for it. For what the random
+  streams of diff_engines.c are unlikely to hit, or cannot tell right
+  from wrong (they only compare engines with each other).
+
+  An engine (built into a shared object with engine_harness.c) is fed
+  each case afresh, and the key events it writes are compared with the
+  case's. Deadlines (janus keys, repeats) are expired by event time,
+  as in diff_engines.c: a frame with no events in it (a SYN_REPORT
+  alone) is a point in time for them to expire at.
+
+  The cases are for 08 with its builtin config (REMAPPER_CONFIG
+  unset).
+
+  ###### ###### ###### ###### ###### ######
+
+  Compile with:
+  gcc -O2 ./engine_cases.c -ldl -o engine_cases
+
+  (And the engine as in engine_harness.c.)
+
+  Usage:
+  engine_cases engine.so
+
+  The exit status is 1 if some case fails.
+
+  ###### ###### ###### ###### ###### ######
+ */
+
+#include <dlfcn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "engine_harness.h"
+
+// A case. input is frames separated by |, each one a time (in ms) and
+// the key events of the frame (code:value). output is the key events
+// the engine must write, in order (SYN_REPORTs left out), each run of
+// them after @ and the time of the input frame it was handling.
+typedef struct {
+  const char *name;
+  const char *input;
+  const char *output;
+} engine_case;
+
+static const engine_case cases[] = {
+  // RIGHTCTRL+F sends RIGHT, and holding it repeats RIGHT (not F):
+  // from 250ms on, every 33ms.
+  { "combo hold repeats key_to",
+    "0 97:1 | 10 33:1 | 200 | 270 | 300 | 330 | 340 33:0 | 410 97:0",
+    "@0 100:1 @10 97:1 106:1 33:1 @270 106:2 @300 106:2 @330 106:2 @340 106:0 97:0 100:0 33:0 @410 100:0" },
+  // A key held alone repeats itself, and stops at its release.
+  { "key hold repeats",
+    "0 48:1 | 260 | 300 | 310 48:0 | 600",
+    "@0 48:1 @260 48:2 @300 48:2 @310 48:0" },
+  // A key pressed stops the one repeating.
+  { "press stops repeat",
+    "0 48:1 | 260 | 270 18:1 | 400 48:0 | 430 18:0",
+    "@0 48:1 @260 48:2 @270 18:1 @400 48:0 @430 18:0" },
+  // No bindings are compiled in: A+X (RIGHTCTRL+X) goes out as it is
+  // typed, not held back as the first step of C-x C-s.
+  { "no builtin bindings",
+    "0 30:1 | 10 45:1 | 20 45:0 | 30 48:1 | 40 48:0 | 50 30:0",
+    "@0 97:1 @10 45:1 @20 45:0 @30 48:1 @40 48:0 @50 97:0" },
+  // The keyboard's own repeats go nowhere.
+  { "kernel repeats dropped",
+    "0 48:1 | 100 48:2 | 130 48:2 | 200 48:0",
+    "@0 48:1 @200 48:0" },
+};
+
+#define NUMBER_OF_CASES (sizeof(cases) / sizeof(cases[0]))
+
+// Most events of a case, in or out.
+#define MAX_CASE_EVENTS 256
+
+// Parse input into evs (each frame ended by a SYN_REPORT). Return the
+// number of events, or -1 if input is not valid.
+static int parse_input(const char *input, struct input_event *evs) {
+  int n = 0;
+  const char *p = input;
+
+  while (*p) {
+    char *end;
+    unsigned long ms = strtoul(p, &end, 10);
+    if (end == p)
+      return -1;
+    p = end;
+
+    for (;;) {
+      p += strspn(p, " ");
+      if (*p == '|' || *p == '\0')
+        break;
+      unsigned long code = strtoul(p, &end, 10);
+      if (end == p || *end != ':')
+        return -1;
+      long value = strtol(end + 1, &end, 10);
+      p = end;
+      if (n == MAX_CASE_EVENTS - 1)
+        return -1;
+      evs[n++] = (struct input_event){
+        .input_event_sec = 1 + ms / 1000,
+        .input_event_usec = ms % 1000 * 1000,
+        .type = EV_KEY,
+        .code = code,
+        .value = value,
+      };
+    }
+
+    if (n == MAX_CASE_EVENTS)
+      return -1;
+    evs[n++] = (struct input_event){
+      .input_event_sec = 1 + ms / 1000,
+      .input_event_usec = ms % 1000 * 1000,
+      .type = EV_SYN,
+      .code = SYN_REPORT,
+    };
+    if (*p == '|')
+      p++;
+    p += strspn(p, " ");
+  }
+
+  return n;
+}
+
+// The key events an engine wrote, as in engine_case.output.
+typedef struct {
+  engine_output output;
+  const struct input_event *input; // the case's
+  long ms; // time of the input frame of the last key event (-1: none yet)
+  char text[MAX_CASE_EVENTS * 16];
+  size_t size;
+} text_output;
+
+static void write_text_frame(engine_output *output, size_t input, const struct input_event *evs, size_t n) {
+  text_output *t = (text_output *)output;
+
+  for (size_t i = 0; i < n; i++) {
+    if (evs[i].type != EV_KEY || t->size >= sizeof(t->text) - 32)
+      continue;
+    long ms = (t->input[input].input_event_sec - 1) * 1000 + t->input[input].input_event_usec / 1000;
+    if (ms != t->ms) {
+      t->size += snprintf(t->text + t->size, sizeof(t->text) - t->size, "%s@%ld",
+                          t->size ? " " : "", ms);
+      t->ms = ms;
+    }
+    t->size += snprintf(t->text + t->size, sizeof(t->text) - t->size, "%s%u:%d",
+                        t->size ? " " : "", evs[i].code, evs[i].value);
+  }
+}
+
+// Run c on the engine at path (loaded anew, see engine_harness.c).
+// Return whether the engine wrote what it must.
+static int run_case(const char *path, const engine_case *c) {
+  struct input_event evs[MAX_CASE_EVENTS];
+  int n = parse_input(c->input, evs);
+  if (n < 0) {
+    printf("%s: bad input\n", c->name);
+    return 0;
+  }
+
+  void *so = dlopen(path, RTLD_NOW|RTLD_LOCAL);
+  if (so == NULL) {
+    fprintf(stderr, "%s\n", dlerror());
+    exit(2);
+  }
+  engine_run_fn *run = (engine_run_fn *)dlsym(so, ENGINE_RUN);
+  if (run == NULL) {
+    fprintf(stderr, "%s\n", dlerror());
+    exit(2);
+  }
+
+  // (The engines print a lot to stdout.)
+  fflush(stdout);
+  FILE *saved_stdout = stdout;
+  stdout = fopen("/dev/null", "w");
+  text_output out = { { write_text_frame }, evs, -1 };
+  int rc = run(evs, n, &out.output);
+  fclose(stdout);
+  stdout = saved_stdout;
+  dlclose(so);
+
+  if (rc < 0) {
+    fprintf(stderr, "%s: failed to start\n", path);
+    exit(2);
+  }
+
+  if (strcmp(out.text, c->output) != 0) {
+    printf("%s: FAILED\n  input:    %s\n  expected: %s\n  got:      %s\n",
+           c->name, c->input, c->output, out.text);
+    return 0;
+  }
+  printf("%s: ok\n", c->name);
+  return 1;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s engine.so\n", argv[0]);
+    return 2;
+  }
+
+  int failed = 0;
+  for (size_t i = 0; i < NUMBER_OF_CASES; i++)
+    failed += !run_case(argv[1], &cases[i]);
+
+  printf("%zu of %zu cases passed\n", NUMBER_OF_CASES - failed, NUMBER_OF_CASES);
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,131 @@
+/*
+  Wraps one of the remappers (03 to 08) into a shared object that
+  diff_engines.c can load and feed events to.
+
+  The remapper (the ENGINE file) is included with REMAPPER_NO_MAIN,
+  and what it writes to uidev is caught instead: write and
+  libevdev_uinput_get_fd are redefined for it, so no uinput device is
+  needed (and none is written to). Every frame goes to the
+  engine_output of the run.
+
+  The remappers keep their state in globals, so engine_run works on a
+  fresh engine only once: diff_engines.c loads the shared object anew
+  for every run.
+
+  ###### ###### ###### ###### ###### ######
+
+  Compile with (one shared object per engine):
+  gcc -O2 -DNDEBUG -shared -fPIC -DENGINE='"06_map_multiple_combos_to_a_single_key_or_combo.c"' `pkg-config --cflags libevdev` ./engine_harness.c `pkg-config --libs libevdev x11 xcb` -pthread -o 06.so
+
+  08.c reads its config from REMAPPER_CONFIG, as it does when it runs
+  for real.
+
+  ###### ###### ###### ###### ###### ######
+ */
+
+#ifndef ENGINE
+#error "Define ENGINE as the file of the engine, e.g. -DENGINE='\"06_map_multiple_combos_to_a_single_key_or_combo.c\"'"
+#endif
+
+#include <stddef.h>
+#include <unistd.h>
+#include "libevdev/libevdev-uinput.h"
+
+#include "engine_harness.h"
+
+// Not a file descriptor: what harness_write catches.
+#define HARNESS_UINPUT_FD -2
+
+ssize_t harness_write(int fd, const void *buf, size_t n);
+int harness_uinput_get_fd(const struct libevdev_uinput *uidev);
+
+#define REMAPPER_NO_MAIN
+#define write harness_write
+#define libevdev_uinput_get_fd harness_uinput_get_fd
+#include ENGINE
+#undef write
+#undef libevdev_uinput_get_fd
+
+static engine_output *output;
+static size_t input;
+
+ssize_t harness_write(int fd, const void *buf, size_t n) {
+  if (fd != HARNESS_UINPUT_FD)
+    return write(fd, buf, n);
+
+  output->write_frame(output, input, buf, n / sizeof(struct input_event));
+  return n;
+}
+
+int harness_uinput_get_fd(const struct libevdev_uinput *uidev) {
+  return HARNESS_UINPUT_FD;
+}
+
+#ifdef KEYMAP_MAGIC // 08.c
+
+static key_state state;
+
+// Set 08 up the way its main does, but for the default window, and
+// with memory for a device and uinput.
+static int start_engine() {
+  config_path = getenv("REMAPPER_CONFIG");
+  if (config_path) {
+    snprintf(config_cache_path, sizeof(config_cache_path), "%s.cache", config_path);
+    km = load_keymap(&km_is_mapped);
+    if (km == NULL)
+      return -1;
+  } else {
+    km = compile_keymap(&builtin_config, 0, 0);
+  }
+  active_dispatch_table = &compiled_window_maps()[0].table;
+  size_janus_heap();
+
+  // Janus keys and repeats arm it (it never fires: see feed_engine).
+  timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+  ks = &state;
+  sink = &uinput_sink;
+  return 0;
+}
+
+static void stop_engine() {
+  close(timer_fd);
+  free(janus_heap);
+  free_keymap(km, km_is_mapped);
+}
+
+// Janus, sequence and repeat deadlines are expired by event time (as
+// if the timerfd fired right on time), so that runs do not depend on
+// how fast they go.
+static void feed_engine(struct input_event ev) {
+  uint64_t now = (uint64_t)ev.input_event_sec * 1000000000 + (uint64_t)ev.input_event_usec * 1000;
+  expire_deadlines(now);
+
+  handle_input_event(ev);
+}
+
+#else // 03 to 07
+
+static int start_engine() {
+  return 0;
+}
+
+static void stop_engine() {
+}
+
+static void feed_engine(struct input_event ev) {
+  handle_input_event(ev);
+}
+
+#endif
+
+int engine_run(const struct input_event *evs, size_t n, engine_output *out) {
+  output = out;
+  if (start_engine() < 0)
+    return -1;
+
+  for (input = 0; input < n; input++)
+    feed_engine(evs[input]);
+
+  stop_engine();
+  return 0;
+}
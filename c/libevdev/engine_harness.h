@@ -0,0 +1,23 @@
+// What diff_engines.c and the engines it loads (each built from
+// engine_harness.c, as a shared object) agree on.
+
+#ifndef ENGINE_HARNESS_H
+#define ENGINE_HARNESS_H
+
+#include <linux/input.h>
+#include <stddef.h>
+
+// Where an engine's output goes: every frame it writes to (what it
+// takes to be) uinput, along with the index of the input event it
+// was handling.
+typedef struct engine_output {
+  void (*write_frame)(struct engine_output *out, size_t input, const struct input_event *evs, size_t n);
+} engine_output;
+
+// Feed evs to a fresh engine, sending its output to out. Return 0, or
+// -1 if the engine could not be set up.
+typedef int engine_run_fn(const struct input_event *evs, size_t n, engine_output *out);
+
+#define ENGINE_RUN "engine_run"
+
+#endif // ENGINE_HARNESS_H
@@ -0,0 +1,119 @@
+// evbatch: reading evdev events in batches, a frame at a time.
+//
+// Rather than one libevdev_next_event per event, a single read()
+// takes as many events as there are (up to EVBATCH_SIZE), and they
+// are handed out a frame at a time: the events up to and including a
+// SYN_REPORT. A frame still coming in (no SYN_REPORT yet) waits in
+// the buffer for the next read. Under key repeat, or with a macro
+// being played back, that is one read for dozens of events.
+//
+// SYN_DROPPED (the kernel's buffer overflowed) is handed out as a
+// frame of its own. The events of the frame it cut, and those after
+// it up to the next SYN_REPORT, are thrown away, as the kernel's docs
+// say. What the engine thinks is down may be off after that: to put
+// it right, evbatch_drain and ask the device (EVIOCGKEY), as 08.c
+// does.
+//
+// libevdev is still good for everything else (capabilities, grabbing,
+// uinput): only its reading is done without.
+
+#ifndef EVBATCH_H
+#define EVBATCH_H
+
+#include <errno.h>
+#include <linux/input.h>
+#include <string.h>
+#include <unistd.h>
+
+#define EVBATCH_SIZE 64
+
+typedef struct {
+  int fd;
+  struct input_event evs[EVBATCH_SIZE];
+  size_t start;   // first event not handed out yet
+  size_t scanned; // events before it have no SYN_REPORT (from start)
+  size_t end;     // end of the events read
+  int dropping;   // until the SYN_REPORT after a SYN_DROPPED
+  int drained;    // the last read left the device with nothing more
+} evbatch;
+
+static inline int evbatch_is_drop(const struct input_event *ev) {
+  return ev->type == EV_SYN && ev->code == SYN_DROPPED;
+}
+
+// Read as many events as fit with a single read(). Return the number
+// of events read, or -errno (-ENODEV at the end of a file).
+static inline int evbatch_read(evbatch *b) {
+  // Move the frame still coming in to the front.
+  if (b->start > 0) {
+    memmove(b->evs, b->evs + b->start, (b->end - b->start) * sizeof(struct input_event));
+    b->end -= b->start;
+    b->scanned -= b->start;
+    b->start = 0;
+  }
+
+  size_t room = EVBATCH_SIZE - b->end;
+  ssize_t size = read(b->fd, b->evs + b->end, room * sizeof(struct input_event));
+  if (size < 0)
+    return -errno;
+  if (size == 0)
+    return -ENODEV;
+
+  size_t n = size / sizeof(struct input_event);
+  b->end += n;
+  b->drained = n < room;
+  return n;
+}
+
+// Set *frame to the next frame and return its number of events. Return
+// 0 if there is no whole frame left (evbatch_read for more).
+static inline size_t evbatch_next_frame(evbatch *b, const struct input_event **frame) {
+  for (;;) {
+    size_t i = b->scanned;
+    while (i < b->end && !(b->evs[i].type == EV_SYN &&
+                           (b->evs[i].code == SYN_REPORT || b->evs[i].code == SYN_DROPPED)))
+      i++;
+
+    if (i == b->end) {
+      b->scanned = i;
+      // A frame longer than the buffer goes in parts.
+      if (b->start == 0 && b->end == EVBATCH_SIZE) {
+        b->start = b->scanned = b->end;
+        if (!b->dropping) {
+          *frame = b->evs;
+          return EVBATCH_SIZE;
+        }
+      }
+      return 0;
+    }
+
+    size_t first = b->start;
+    b->start = b->scanned = i + 1;
+
+    if (evbatch_is_drop(&b->evs[i])) {
+      b->dropping = 1;
+      *frame = &b->evs[i];
+      return 1;
+    }
+    if (b->dropping) {
+      b->dropping = 0;
+      continue;
+    }
+
+    *frame = &b->evs[first];
+    return i + 1 - first;
+  }
+}
+
+// Throw away the events buffered, and those the device still has
+// (the fd must be non-blocking), so that the device's state can be
+// taken as it is now, after a SYN_DROPPED.
+static inline void evbatch_drain(evbatch *b) {
+  b->start = b->scanned = b->end = 0;
+  b->dropping = 0;
+  while (read(b->fd, b->evs, sizeof(b->evs)) == sizeof(b->evs))
+    ;
+  b->drained = 1;
+}
+
+#endif // EVBATCH_H
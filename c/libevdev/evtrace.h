@@ -0,0 +1,473 @@
+// evtrace: compact binary recordings of evdev events.
+//
+// Written by 01_print_events.c and 02_read_print_and_write.c (with
+// -r), read by 08_bench.c.
+//
+// Layout of a file (all little endian):
+//
+//   evtrace_header
+//   frame*
+//   evtrace_index_entry*   (at header.index_offset)
+//
+// A frame is the events up to and including a SYN_REPORT (or a
+// SYN_DROPPED, which makes a frame of its own), all of which have the
+// same time:
+//
+//   varint  number of events
+//   varint  time in us (since the previous frame if EVTRACE_DELTA_TIME,
+//           absolute otherwise)
+//   number of events * { u16 type, u16 code, s32 value }
+//
+// Every index_interval-th frame has an index entry, so that a reader
+// can mmap the file and start anywhere (if there was no memory for
+// the index, only the first index_size do). A recording which was not
+// finished (index_offset == 0) can still be read from the start.
+
+#ifndef EVTRACE_H
+#define EVTRACE_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/input.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define EVTRACE_MAGIC "EVTRACE1"
+
+#define EVTRACE_DELTA_TIME 1 // frame times are deltas
+
+typedef struct {
+  char magic[8];
+  uint32_t flags;
+  uint32_t index_interval;
+  uint64_t number_of_frames;
+  uint64_t number_of_events;
+  uint64_t index_offset; // 0 if the recording was not finished
+  uint64_t index_size;   // number of index entries
+} evtrace_header;
+
+typedef struct {
+  uint64_t frame;        // number of the frame
+  uint64_t offset;       // of the frame in the file
+  uint64_t base_time_us; // time its time is relative to (if delta)
+} evtrace_index_entry;
+
+#define EVTRACE_INDEX_INTERVAL 256
+
+// Longest frame: longer ones are split (without a SYN_REPORT ending
+// the first part).
+#define EVTRACE_MAX_FRAME 256
+
+// Most bytes a frame takes.
+#define EVTRACE_MAX_FRAME_BYTES (2 * 10 + EVTRACE_MAX_FRAME * 8)
+
+static inline size_t evtrace_put_varint(unsigned char *p, uint64_t n) {
+  size_t size = 0;
+  while (n >= 0x80) {
+    p[size++] = (n & 0x7f) | 0x80;
+    n >>= 7;
+  }
+  p[size++] = n;
+  return size;
+}
+
+// Return the number of bytes read, or 0 if the varint does not end
+// before end.
+static inline size_t evtrace_get_varint(const unsigned char *p, const unsigned char *end, uint64_t *n) {
+  *n = 0;
+  for (size_t size = 0; p + size < end && size < 10; size++) {
+    *n |= (uint64_t)(p[size] & 0x7f) << (7 * size);
+    if (!(p[size] & 0x80))
+      return size + 1;
+  }
+  return 0;
+}
+
+static inline uint64_t evtrace_time_us(const struct input_event *ev) {
+  return (uint64_t)ev->input_event_sec * 1000000 + ev->input_event_usec;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Reading
+
+typedef struct {
+  const unsigned char *data;    // the whole file (e.g. mmap'd)
+  const unsigned char *end;     // of the frames
+  const evtrace_header *header;
+  const evtrace_index_entry *index; // NULL if not finished
+  const unsigned char *next;    // next frame
+  uint64_t time_us;             // of the last frame read
+} evtrace_reader;
+
+// Return -1 if data (of size bytes) is not an evtrace recording.
+static inline int evtrace_open(evtrace_reader *r, const void *data, size_t size) {
+  const evtrace_header *h = data;
+
+  if (size < sizeof(evtrace_header) || memcmp(h->magic, EVTRACE_MAGIC, sizeof(h->magic)) != 0)
+    return -1;
+
+  r->data = data;
+  r->header = h;
+  r->next = r->data + sizeof(evtrace_header);
+  r->time_us = 0;
+  r->index = NULL;
+  r->end = r->data + size;
+
+  if (h->index_offset) {
+    if (h->index_offset > size || (size - h->index_offset) / sizeof(evtrace_index_entry) < h->index_size)
+      return -1;
+    r->index = (const evtrace_index_entry *)(r->data + h->index_offset);
+    r->end = r->data + h->index_offset;
+  }
+
+  return 0;
+}
+
+// Continue reading from index entry i.
+static inline void evtrace_seek(evtrace_reader *r, size_t i) {
+  r->next = r->data + r->index[i].offset;
+  r->time_us = r->index[i].base_time_us;
+}
+
+// Read the next frame into evs (which has room for EVTRACE_MAX_FRAME
+// events). Return the number of events, 0 at the end, -1 if the
+// recording is corrupt.
+static inline int evtrace_next_frame(evtrace_reader *r, struct input_event *evs) {
+  uint64_t n, time_us;
+  size_t size;
+
+  if (r->next == r->end)
+    return 0;
+
+  if (!(size = evtrace_get_varint(r->next, r->end, &n)) || n > EVTRACE_MAX_FRAME)
+    return -1;
+  r->next += size;
+  if (!(size = evtrace_get_varint(r->next, r->end, &time_us)))
+    return -1;
+  r->next += size;
+  if ((size_t)(r->end - r->next) < n * 8)
+    return -1;
+
+  r->time_us = r->header->flags & EVTRACE_DELTA_TIME ? r->time_us + time_us : time_us;
+
+  for (size_t i = 0; i < n; i++, r->next += 8) {
+    uint16_t type, code;
+    int32_t value;
+    memcpy(&type, r->next, 2);
+    memcpy(&code, r->next + 2, 2);
+    memcpy(&value, r->next + 4, 4);
+    evs[i] = (struct input_event){
+      .input_event_sec = r->time_us / 1000000,
+      .input_event_usec = r->time_us % 1000000,
+      .type = type,
+      .code = code,
+      .value = value,
+    };
+  }
+
+  return n;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Writing
+//
+// The thread reading the device only encodes events into chunks of
+// memory. Full chunks are handed to a writer thread which writes them
+// to the file, so that a slow disk never keeps the device from being
+// read (which is what makes the kernel drop events). Chunks are never
+// waited for: if the writer falls behind, more are allocated, up to
+// EVTRACE_MAX_CHUNKS. Past that (the disk has stalled), frames are
+// dropped, and counted, rather than taking ever more memory; the next
+// frame recorded is preceded by a SYN_DROPPED frame, as the kernel
+// does when it drops events, so that readers resync there.
+
+#define EVTRACE_CHUNK_SIZE (256 * 1024)
+#define EVTRACE_MAX_CHUNKS 16 // 4 MiB
+
+typedef struct evtrace_chunk {
+  struct evtrace_chunk *next;
+  size_t size;
+  unsigned char data[EVTRACE_CHUNK_SIZE];
+} evtrace_chunk;
+
+typedef struct {
+  int fd;
+  uint32_t flags;
+
+  // Used by the reading thread only.
+  struct input_event frame[EVTRACE_MAX_FRAME];
+  size_t frame_size;
+  evtrace_chunk *chunk; // NULL if there was none to be had
+  size_t number_of_chunks; // allocated
+  uint64_t offset; // in the file, of the start of chunk
+  uint64_t time_us; // of the last frame
+  uint64_t number_of_frames;
+  uint64_t number_of_events;
+  uint64_t dropped_frames;
+  uint64_t dropped_events;
+  int dropping; // frames were dropped since the last one recorded
+  evtrace_index_entry *index;
+  size_t index_size;
+  size_t index_capacity;
+  int index_stopped; // there was no memory to grow it
+
+  // Shared with the writer thread.
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  evtrace_chunk *full_head;
+  evtrace_chunk *full_tail;
+  evtrace_chunk *free_chunks;
+  int done;
+  int error; // errno of the first failed write
+  pthread_t thread;
+} evtrace_writer;
+
+static inline void *evtrace_writer_thread(void *arg) {
+  evtrace_writer *w = arg;
+
+  pthread_mutex_lock(&w->lock);
+  for (;;) {
+    while (w->full_head == NULL && !w->done)
+      pthread_cond_wait(&w->cond, &w->lock);
+    if (w->full_head == NULL)
+      break;
+
+    evtrace_chunk *c = w->full_head;
+    w->full_head = c->next;
+    if (w->full_head == NULL)
+      w->full_tail = NULL;
+    pthread_mutex_unlock(&w->lock);
+
+    size_t written = 0;
+    while (written < c->size) {
+      ssize_t n = write(w->fd, c->data + written, c->size - written);
+      if (n < 0) {
+        if (errno == EINTR)
+          continue;
+        if (!w->error)
+          w->error = errno;
+        break;
+      }
+      written += n;
+    }
+
+    pthread_mutex_lock(&w->lock);
+    c->next = w->free_chunks;
+    w->free_chunks = c;
+  }
+  pthread_mutex_unlock(&w->lock);
+
+  return NULL;
+}
+
+// Return NULL if all the chunks there may be are taken (or there is
+// no memory for another one).
+static inline evtrace_chunk *evtrace_get_chunk(evtrace_writer *w) {
+  pthread_mutex_lock(&w->lock);
+  evtrace_chunk *c = w->free_chunks;
+  if (c)
+    w->free_chunks = c->next;
+  pthread_mutex_unlock(&w->lock);
+
+  if (c == NULL && w->number_of_chunks < EVTRACE_MAX_CHUNKS
+      && (c = malloc(sizeof(evtrace_chunk))))
+    w->number_of_chunks++;
+  if (c == NULL)
+    return NULL;
+  c->size = 0;
+  c->next = NULL;
+  return c;
+}
+
+static inline void evtrace_hand_over_chunk(evtrace_writer *w) {
+  if (w->chunk == NULL || w->chunk->size == 0)
+    return;
+
+  w->offset += w->chunk->size;
+
+  pthread_mutex_lock(&w->lock);
+  if (w->full_tail)
+    w->full_tail->next = w->chunk;
+  else
+    w->full_head = w->chunk;
+  w->full_tail = w->chunk;
+  pthread_cond_signal(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+
+  w->chunk = evtrace_get_chunk(w);
+}
+
+// Start recording to path. Return -errno on failure.
+static inline int evtrace_writer_open(evtrace_writer *w, const char *path, uint32_t flags) {
+  memset(w, 0, sizeof(*w));
+  w->flags = flags;
+
+  w->fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+  if (w->fd < 0)
+    return -errno;
+
+  evtrace_header h = { .flags = flags, .index_interval = EVTRACE_INDEX_INTERVAL };
+  memcpy(h.magic, EVTRACE_MAGIC, sizeof(h.magic));
+  if (write(w->fd, &h, sizeof(h)) != sizeof(h)) {
+    int err = -errno;
+    close(w->fd);
+    return err;
+  }
+  w->offset = sizeof(h);
+
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->cond, NULL);
+  w->chunk = evtrace_get_chunk(w);
+  if (w->chunk == NULL) {
+    close(w->fd);
+    return -ENOMEM;
+  }
+
+  // Signals are for the reading thread (to interrupt its read).
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  int rc = pthread_create(&w->thread, NULL, evtrace_writer_thread, w);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (rc != 0) {
+    free(w->chunk);
+    close(w->fd);
+    return -rc;
+  }
+
+  return 0;
+}
+
+// Encode the frame evs (of n events) into the chunk, which has room
+// for it.
+static inline void evtrace_put_frame(evtrace_writer *w, const struct input_event *evs, size_t n) {
+  if (w->number_of_frames % EVTRACE_INDEX_INTERVAL == 0 && !w->index_stopped) {
+    if (w->index_size == w->index_capacity) {
+      size_t capacity = w->index_capacity ? 2 * w->index_capacity : 1024;
+      evtrace_index_entry *index = realloc(w->index, capacity * sizeof(evtrace_index_entry));
+      if (index) {
+        w->index = index;
+        w->index_capacity = capacity;
+      }
+    }
+    if (w->index_size < w->index_capacity)
+      w->index[w->index_size++] = (evtrace_index_entry){
+        .frame = w->number_of_frames,
+        .offset = w->offset + w->chunk->size,
+        .base_time_us = w->time_us,
+      };
+    else
+      w->index_stopped = 1;
+  }
+
+  unsigned char *start = w->chunk->data + w->chunk->size;
+  unsigned char *p = start;
+  uint64_t time_us = evtrace_time_us(&evs[0]);
+
+  p += evtrace_put_varint(p, n);
+  p += evtrace_put_varint(p, w->flags & EVTRACE_DELTA_TIME ? time_us - w->time_us : time_us);
+  for (size_t i = 0; i < n; i++, p += 8) {
+    uint16_t type = evs[i].type, code = evs[i].code;
+    int32_t value = evs[i].value;
+    memcpy(p, &type, 2);
+    memcpy(p + 2, &code, 2);
+    memcpy(p + 4, &value, 4);
+  }
+
+  w->chunk->size += p - start;
+  w->time_us = time_us;
+  w->number_of_frames++;
+  w->number_of_events += n;
+}
+
+static inline void evtrace_write_frame(evtrace_writer *w) {
+  if (w->frame_size == 0)
+    return;
+
+  // (Room for a SYN_DROPPED frame too.)
+  if (w->chunk && EVTRACE_CHUNK_SIZE - w->chunk->size < EVTRACE_MAX_FRAME_BYTES + 2 * 10 + 8)
+    evtrace_hand_over_chunk(w);
+  if (w->chunk == NULL && (w->chunk = evtrace_get_chunk(w)) == NULL) {
+    w->dropped_frames++;
+    w->dropped_events += w->frame_size;
+    w->dropping = 1;
+    w->frame_size = 0;
+    return;
+  }
+
+  if (w->dropping) {
+    struct input_event dropped = w->frame[0];
+    dropped.type = EV_SYN;
+    dropped.code = SYN_DROPPED;
+    dropped.value = 0;
+    evtrace_put_frame(w, &dropped, 1);
+    w->dropping = 0;
+  }
+
+  evtrace_put_frame(w, w->frame, w->frame_size);
+  w->frame_size = 0;
+}
+
+// Record ev. (Called by the thread reading the device.)
+static inline void evtrace_record(evtrace_writer *w, const struct input_event *ev) {
+  struct input_event e = *ev;
+
+  // Frame times only go forward (so that deltas are never negative).
+  if (w->frame_size == 0 && evtrace_time_us(&e) < w->time_us) {
+    e.input_event_sec = w->time_us / 1000000;
+    e.input_event_usec = w->time_us % 1000000;
+  }
+
+  w->frame[w->frame_size++] = e;
+
+  if (w->frame_size == EVTRACE_MAX_FRAME
+      || (ev->type == EV_SYN && (ev->code == SYN_REPORT || ev->code == SYN_DROPPED)))
+    evtrace_write_frame(w);
+}
+
+// Finish the recording: write what is left, and the index. Return
+// -errno if anything could not be written.
+static inline int evtrace_writer_close(evtrace_writer *w) {
+  evtrace_write_frame(w);
+  evtrace_hand_over_chunk(w);
+
+  pthread_mutex_lock(&w->lock);
+  w->done = 1;
+  pthread_cond_signal(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+  pthread_join(w->thread, NULL);
+
+  int err = -w->error;
+  if (!err) {
+    size_t index_bytes = w->index_size * sizeof(evtrace_index_entry);
+    evtrace_header h = {
+      .flags = w->flags,
+      .index_interval = EVTRACE_INDEX_INTERVAL,
+      .number_of_frames = w->number_of_frames,
+      .number_of_events = w->number_of_events,
+      .index_offset = w->offset,
+      .index_size = w->index_size,
+    };
+    memcpy(h.magic, EVTRACE_MAGIC, sizeof(h.magic));
+    if (pwrite(w->fd, w->index, index_bytes, w->offset) != (ssize_t)index_bytes
+        || pwrite(w->fd, &h, sizeof(h), 0) != sizeof(h))
+      err = -errno;
+  }
+
+  close(w->fd);
+  free(w->index);
+  free(w->chunk);
+  while (w->free_chunks) {
+    evtrace_chunk *c = w->free_chunks;
+    w->free_chunks = c->next;
+    free(c);
+  }
+
+  return err;
+}
+
+#endif
@@ -0,0 +1,114 @@
+// keystate: which keys are down, for every key code there is.
+//
+// A keyset is a bitset of key codes (bit n for code n), KEY_CNT bits
+// long: 768 bits, 96 bytes. A keystate is two of them, the keys down
+// and, of those, the ones repeating (whose last value was 2): 192
+// bytes, three cache lines. Setting or asking the state of a key is a
+// shift and a mask, whatever the key, instead of a search through a
+// table of the keys an engine happens to care about.
+//
+// Asking about many keys at once goes through masks, 128 bits at a
+// time (GCC's vector extensions: SSE2 on x86-64, NEON on ARM, or
+// wider where -march allows and the compiler merges them):
+// whether any of the keys of a mask is down (keyset_any), and whether
+// every key but those of a mask is up (keyset_none_but).
+//
+// Key codes must be below KEY_CNT, as those of EV_KEY events are.
+
+#ifndef KEYSTATE_H
+#define KEYSTATE_H
+
+#include <linux/input-event-codes.h>
+#include <stdint.h>
+#include <string.h>
+
+// 128 bits, the unit masks are worked on in.
+typedef uint64_t keyset_vec __attribute__((vector_size(16)));
+
+#define KEYSET_VECS ((KEY_CNT + 127) / 128)
+#define KEYSET_WORDS (KEYSET_VECS * 2)
+
+typedef struct {
+  uint64_t words[KEYSET_WORDS];
+} keyset;
+
+typedef struct {
+  keyset down;
+  keyset repeating;
+} keystate;
+
+// (memcpy, rather than a cast, because a keyset need not be aligned
+// to a vector: the compiler makes it an unaligned load.)
+static inline keyset_vec keyset_load(const keyset *s, size_t v) {
+  keyset_vec vec;
+  memcpy(&vec, &s->words[v * 2], sizeof(vec));
+  return vec;
+}
+
+static inline void keyset_add(keyset *s, unsigned code) {
+  s->words[code / 64] |= (uint64_t)1 << (code % 64);
+}
+
+static inline void keyset_remove(keyset *s, unsigned code) {
+  s->words[code / 64] &= ~((uint64_t)1 << (code % 64));
+}
+
+static inline int keyset_has(const keyset *s, unsigned code) {
+  return (s->words[code / 64] >> (code % 64)) & 1;
+}
+
+// The first key of s from code on, or KEY_CNT if there is none. To go
+// through them all:
+//
+//   for (unsigned c = keyset_next(s, 0); c < KEY_CNT; c = keyset_next(s, c + 1))
+static inline unsigned keyset_next(const keyset *s, unsigned code) {
+  for (unsigned w = code / 64; w < KEYSET_WORDS; w++) {
+    uint64_t bits = s->words[w];
+    if (w == code / 64)
+      bits &= ~(uint64_t)0 << (code % 64);
+    if (bits)
+      return w * 64 + __builtin_ctzll(bits);
+  }
+  return KEY_CNT;
+}
+
+// Whether any key of mask is in s.
+static inline int keyset_any(const keyset *s, const keyset *mask) {
+  keyset_vec acc = {0};
+  for (size_t v = 0; v < KEYSET_VECS; v++)
+    acc |= keyset_load(s, v) & keyset_load(mask, v);
+  return (acc[0] | acc[1]) != 0;
+}
+
+// Whether every key of s is in mask (no key but those of mask is in
+// s).
+static inline int keyset_none_but(const keyset *s, const keyset *mask) {
+  keyset_vec acc = {0};
+  for (size_t v = 0; v < KEYSET_VECS; v++)
+    acc |= keyset_load(s, v) & ~keyset_load(mask, v);
+  return (acc[0] | acc[1]) == 0;
+}
+
+// Record value (1, 2 or 0, as in an EV_KEY event) for code.
+static inline void keystate_set(keystate *k, unsigned code, int value) {
+  if (value == 0)
+    keyset_remove(&k->down, code);
+  else
+    keyset_add(&k->down, code);
+
+  if (value == 2)
+    keyset_add(&k->repeating, code);
+  else
+    keyset_remove(&k->repeating, code);
+}
+
+static inline int keystate_is_down(const keystate *k, unsigned code) {
+  return keyset_has(&k->down, code);
+}
+
+// The last value of code: 1 or 2 if it is down, 0 if it is up.
+static inline int keystate_value(const keystate *k, unsigned code) {
+  return keyset_has(&k->down, code) + keyset_has(&k->repeating, code);
+}
+
+#endif // KEYSTATE_H
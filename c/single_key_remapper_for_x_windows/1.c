@@ -68,7 +68,7 @@ window_map window_maps[] = {
   4 },
   { "Emacs",
   (key_map[]){{ KEY_LEFT, KEY_HOME }},
-  2 },
+  1 },
 };
 
 // Variable that store the index of currently active window map (the
@@ -85,24 +85,125 @@ window_map window_maps[] = {
 // read/write operations on it are atomic.
 volatile int currently_focused_window = -1;
 
+// The window maps compiled: for each of them, the key every key is
+// sent as (itself, if it is not mapped), so that translating a key is
+// a single load. Made by compile_translations at startup.
+typedef unsigned short translation[KEY_CNT];
+
+translation *translations;
+
+// For the windows with no window map.
+translation identity;
+
+// The translation of the currently focused window. Switching windows
+// is writing this pointer (once, for the same reasons as
+// currently_focused_window).
+unsigned short *volatile active_translation = identity;
+
+// What each key was sent as when it was pressed: it is released (and
+// repeats) as that, even if the focus has changed in the meantime.
+// Only the reader thread uses it.
+translation sent_as;
+
+void compile_translations(void) {
+  size_t n = sizeof(window_maps)/sizeof(window_maps[0]);
+  translations = malloc(n * sizeof(translation));
+  if (translations == NULL) {
+    perror("Failed to allocate the translations");
+    exit(1);
+  }
+
+  for (unsigned code = 0; code < KEY_CNT; code++)
+    identity[code] = code;
+  memcpy(sent_as, identity, sizeof(identity));
+
+  for (size_t i = 0; i < n; i++) {
+    memcpy(translations[i], identity, sizeof(identity));
+    for (size_t j = 0; j < window_maps[i].key_maps_size; j++) {
+      key_map km = window_maps[i].key_maps[j];
+      if (km.key_from >= KEY_CNT || km.key_to >= KEY_CNT) {
+        fprintf(stderr, "The %s map has a bad key map (%u --> %u)\n", window_maps[i].window_class_name, km.key_from, km.key_to);
+        exit(1);
+      }
+      translations[i][km.key_from] = km.key_to;
+    }
+  }
+}
+
+// The window maps by window class: an open-addressing hash table
+// (linear probing, at most half full) of their indexes plus 1 (0 for
+// an empty slot), so that a focus change takes one probe, as a rule,
+// however many window maps there are. Made by intern_window_classes
+// at startup.
+unsigned *window_classes;
+size_t window_classes_mask;
+
+// FNV-1a.
+uint32_t hash_class(const char *name) {
+  uint32_t h = 2166136261u;
+  for (; *name; name++)
+    h = (h ^ (unsigned char)*name) * 16777619u;
+  return h;
+}
+
+// Slot of window_classes where class name is, or where it would go.
+unsigned *find_window_class(const char *name) {
+  size_t i = hash_class(name) & window_classes_mask;
+  while (window_classes[i] && strcmp(window_maps[window_classes[i] - 1].window_class_name, name) != 0)
+    i = (i + 1) & window_classes_mask;
+  return &window_classes[i];
+}
+
+void intern_window_classes(void) {
+  size_t n = sizeof(window_maps)/sizeof(window_maps[0]);
+  size_t size = 2;
+  while (size < 2 * n)
+    size *= 2;
+  window_classes = calloc(size, sizeof(unsigned));
+  window_classes_mask = size - 1;
+
+  // (Where two maps have the same class, the first one is kept.)
+  for (size_t i = 0; i < n; i++) {
+    unsigned *slot = find_window_class(window_maps[i].window_class_name);
+    if (*slot == 0)
+      *slot = i + 1;
+  }
+}
+
 void set_currently_focused_window(char *win_name) {
   // Create local variable instead to hold next value of
   // currently_focused_window, instead of directly assigning the value
   // twice. Write the global variable `currently_focused_window` only
   // once. (We want to prevent the reader thread from reading the
   // temporary -1)
-  int new_currently_focused_window = -1;
-  for (size_t i = 0; i < sizeof(window_maps)/sizeof(window_maps[0]); i++) {
-    char *name = window_maps[i].window_class_name;
-    if (strcmp(win_name, name) == 0) {
-      new_currently_focused_window = i;
-      break;
-    }
-  }
+  int new_currently_focused_window = (int)*find_window_class(win_name) - 1;
+  active_translation = new_currently_focused_window == -1 ? identity : translations[new_currently_focused_window];
   currently_focused_window = new_currently_focused_window;
   printf("currently_focused_window set to %d\n", currently_focused_window);
 }
 
+// Classes of the windows focused lately, by window ID, so that
+// focusing a window again takes no round trip to X but the one to
+// learn which window it is. Direct-mapped: a window takes the place of
+// the one before it in its slot.
+//
+// A window is dropped from the cache when it is destroyed (we ask for
+// its StructureNotify events when caching it): X gives the IDs of a
+// client gone to the next client that connects, and a new window of
+// another app must not get the class of the one it took the ID of.
+#define WINDOW_CACHE_SIZE 64
+
+struct {
+  Window id;
+  char class_name[256];
+} window_cache[WINDOW_CACHE_SIZE];
+
+static size_t window_cache_slot(Window id) {
+  // (The low bits of an ID are a counter of its client, the high
+  // ones tell the clients apart.)
+  return (id ^ id >> 21) % WINDOW_CACHE_SIZE;
+}
+
 void *track_window() {
   Display* display;
   XEvent xevent;
@@ -120,7 +221,7 @@ void *track_window() {
   int format_return;
   unsigned long nitems_return;
   unsigned long bytes_left;
-  unsigned char *data;
+  unsigned char *data = NULL;
 
   unsigned char firstLoop = 1;
 
@@ -130,7 +231,14 @@ void *track_window() {
     if (!firstLoop) {
       XNextEvent(display, &xevent);
 
-      if (xevent.xproperty.atom != active_window_atom)
+      if (xevent.type == DestroyNotify) {
+        size_t slot = window_cache_slot(xevent.xdestroywindow.window);
+        if (window_cache[slot].id == xevent.xdestroywindow.window)
+          window_cache[slot].id = 0;
+        continue;
+      }
+
+      if (xevent.type != PropertyNotify || xevent.xproperty.atom != active_window_atom)
         continue;
     }
 
@@ -138,42 +246,47 @@ void *track_window() {
       firstLoop = 0;
     }
 
-    XGetWindowProperty(display,
-                       root_window,
-                       active_window_atom,
-                       0,
-                       1,
-                       False,
-                       XA_WINDOW,
-                       &type_return,   //should be XA_WINDOW
-                       &format_return, //should be 32
-                       &nitems_return, //should be 1 (zero if there is no such window)
-                       &bytes_left,    //should be 0 (i'm not sure but should be atomic read)
-                       &data           //should be non-null
-		       );
-
-    Window focused_window = *(Window *)data;
+    if (XGetWindowProperty(display,
+                           root_window,
+                           active_window_atom,
+                           0,
+                           1,
+                           False,
+                           XA_WINDOW,
+                           &type_return,   //should be XA_WINDOW
+                           &format_return, //should be 32
+                           &nitems_return, //should be 1 (zero if there is no such window)
+                           &bytes_left,    //should be 0 (i'm not sure but should be atomic read)
+                           &data           //should be non-null
+                           ) != Success || data == NULL) {
+      continue;
+    }
+
+    Window focused_window = nitems_return ? *(Window *)data : 0;
+    XFree(data);
 
     if (focused_window == 0) {
       continue;
     }
 
-    char* window_name1;
-    if (XFetchName(display, focused_window, &window_name1) != 0) {
-      printf("The active window is: %s\n", window_name1);
-      XFree(window_name1);
-    }
-    XClassHint class_hint;
-    if (XGetClassHint(display, focused_window, &class_hint) == 0) {
-      continue;
+    size_t slot = window_cache_slot(focused_window);
+    if (window_cache[slot].id != focused_window) {
+      XClassHint class_hint;
+      if (XGetClassHint(display, focused_window, &class_hint) == 0) {
+        continue;
+      }
+      printf("res.class = %s\n", class_hint.res_class);
+      printf("res.name = %s\n", class_hint.res_name);
+      printf("\n\n");
+
+      XSelectInput(display, focused_window, StructureNotifyMask);
+      window_cache[slot].id = focused_window;
+      snprintf(window_cache[slot].class_name, sizeof(window_cache[slot].class_name), "%s", class_hint.res_class);
+      XFree(class_hint.res_name);
+      XFree(class_hint.res_class);
     }
-    char *window_class = class_hint.res_class;
-    char *window_name2 = class_hint.res_name;
-    printf("res.class = %s\n", window_class);
-    printf("res.name = %s\n", window_name2);
-    printf("\n\n");
 
-    set_currently_focused_window(window_class);
+    set_currently_focused_window(window_cache[slot].class_name);
 
   } while (1);
 }
@@ -190,37 +303,13 @@ void printConf(void) {
 
 static void handle_ev_key(const struct libevdev_uinput *uidev, unsigned int code, int value) {
   //printf("code: %d, value: %d\n", code, value);
-  //printf("%d\n", currently_focused_window);
-
-  // TODO: change key code on the fly if key is mapped
-
-  // We must make copy of currently_focused_window because we are
-  // reading its value multiple times and there is another thread that
-  // can change its value.
-  int currently_focused_window_copy = currently_focused_window;
-
-  if (currently_focused_window_copy != -1) {
-    window_map wm = window_maps[currently_focused_window_copy];
-    printf("%d\n", wm.key_maps_size);
-    size_t foundI = -1;
-    for (size_t i = 0; i < wm.key_maps_size; i++) {
-      key_map km = wm.key_maps[i];
-      if (km.key_from == code) {
-        foundI = i;
-        break;
-      }
-    }
 
-    if (foundI != -1) {
-      printf("\n\nMAPPED KEY!\n");
-      printf("key map key from: %u\n", window_maps[currently_focused_window_copy].key_maps[foundI].key_from);
-      printf("code handled: %u\n", code);
-    } else {
-      printf("NORMAL KEY!\n");
-    }
-  }
+  // A press is sent as what the focused window maps it to; a release
+  // or a repeat as what the press was sent as.
+  if (value == 1)
+    sent_as[code] = active_translation[code];
+  code = sent_as[code];
 
-  // just send key through if key is not mapped (for now just send through all keys)
   int err;
   //printf("Sending %u %u\n", code, value);
   err = libevdev_uinput_write_event(uidev, EV_KEY, code, value);
@@ -239,6 +328,8 @@ int main(int argc, char **argv) {
   // Print stuff
   printf("Initializing...\n");
   printConf();
+  intern_window_classes();
+  compile_translations();
 
   // Start tracking windows
   pthread_t track_window_thread;